@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Check speed and bytes read of fcheck on a .xv6z image, against the raw
+# image and against a gzip of it decompressed to a temporary file first.
+# Usage: ./bench_chunked.sh [runs] [tree] [mkfs options...]
+# The images are built by xv6's mkfs from tree, with --chunked=$CHUNK_KIB
+# (default 64) for the .xv6z one. The .xv6z checks run with the default
+# chunk cache, with CACHE chunks if set, and with PREFETCH threads (default
+# 4) decompressing ahead. With COLD=1, run as root, the page cache is dropped
+# before every run so the images are read from disk.
+
+RUNS=${1:-5}
+TREE=${2:-xv6}
+shift 2 2> /dev/null
+CHUNK_KIB=${CHUNK_KIB:-64}
+PREFETCH=${PREFETCH:-4}
+IMAGE_DIR="bench_images"
+OUT="$IMAGE_DIR/chunked"
+
+mkdir -p "$OUT"
+gcc -O -w -iquote xv6/include xv6/tools/mkfs.c fcheck.c xv6z.c -DFCHECK_NO_MAIN -o "$OUT/mkfs" -lm -lz -pthread || exit 1
+rm -f "$OUT/fs.img" "$OUT/fs.xv6z"
+"$OUT/mkfs" "$@" "$OUT/fs.img" "$TREE" > /dev/null || exit 1
+"$OUT/mkfs" "$@" --chunked="$CHUNK_KIB" "$OUT/fs.xv6z" "$TREE" > /dev/null || exit 1
+gzip -c "$OUT/fs.img" > "$OUT/fs.img.gz"
+CACHE_OPT=${CACHE:+--cache=$CACHE}
+
+# Median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# Check one way, RUNS times; prints the median in us and what the last run read
+run() {
+    local name=$1
+    shift
+    for ((i = 0; i < RUNS; i++)); do
+        if [ -n "$COLD" ]; then
+            sync
+            echo 3 > /proc/sys/vm/drop_caches
+        fi
+        start=$(date +%s%N)
+        "$@" > "$OUT/$name.out" || exit 1
+        echo $(( ($(date +%s%N) - start) / 1000 ))
+    done | median | tr -d '\n'
+}
+
+bytes_of() {
+    stat -c %s "$1"
+}
+
+printf "%-16s %12s %14s %14s\n" "image" "median_us" "bytes_read" "file_bytes"
+
+us=$(run raw ./fcheck --stats "$OUT/fs.img")
+read_bytes=$(sed -n 's/^STATS: .*(\([0-9]*\) bytes)$/\1/p' "$OUT/raw.out")
+printf "%-16s %12s %14s %14s\n" "raw" "$us" "$read_bytes" "$(bytes_of "$OUT/fs.img")"
+
+us=$(run gunzip sh -c "gunzip -c '$OUT/fs.img.gz' > '$OUT/tmp.img' && ./fcheck '$OUT/tmp.img' && rm '$OUT/tmp.img'")
+printf "%-16s %12s %14s %14s\n" "gzip+temp" "$us" "$(bytes_of "$OUT/fs.img.gz")" "$(bytes_of "$OUT/fs.img.gz")"
+
+for prefetch in 0 "$PREFETCH"; do
+    us=$(run xv6z ./fcheck --stats $CACHE_OPT --prefetch="$prefetch" "$OUT/fs.xv6z")
+    read_bytes=$(sed -n 's/^CHUNKS: .*read \([0-9]*\) of.*/\1/p' "$OUT/xv6z.out")
+    printf "%-16s %12s %14s %14s\n" "xv6z,prefetch=$prefetch" "$us" "$read_bytes" "$(bytes_of "$OUT/fs.xv6z")"
+done
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Compare the sequential, pipelined and sharded check engines on cold-cache images.
+# Usage: ./bench_engines.sh [runs]
+
+RUNS=${1:-5}
+IMAGE_DIR="bench_images"
+
+# Generated images: name, inodes, directories, files per directory, blocks per file
+IMAGES=(
+    'wide 65536 2000 30 2'
+    'deep 65536 250 250 1'
+    'large 16384 100 150 40'
+)
+
+mkdir -p "$IMAGE_DIR"
+
+# Drop an image from the page cache so every run starts cold
+evict() {
+    dd if="$1" iflag=nocache count=0 status=none
+}
+
+# Median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+printf "%-8s %-12s %12s\n" "image" "engine" "median_us"
+for spec in "${IMAGES[@]}"; do
+    read -r name ninodes ndirs nfiles nblocks <<< "$spec"
+    image="$IMAGE_DIR/$name.img"
+    [ -f "$image" ] || ./gen_image.py "$image" "$ninodes" "$ndirs" "$nfiles" "$nblocks"
+
+    for engine in sequential pipeline sharded; do
+        for ((i = 0; i < RUNS; i++)); do
+            evict "$image"
+            start=$(date +%s%N)
+            ./fcheck --engine="$engine" "$image" > /dev/null 2>&1
+            echo $(( ($(date +%s%N) - start) / 1000 ))
+        done | median | xargs printf "%-8s %-12s %12s\n" "$name" "$engine"
+    done
+done
@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# Compare xv6fs extract against its naive single-threaded baseline.
+# Usage: ./bench_extract.sh [runs] [dest]
+# Put dest on a tmpfs to measure the extraction rather than the disk it writes to.
+
+RUNS=${1:-5}
+IMAGE_DIR="bench_images"
+DEST=${2:-"$IMAGE_DIR/extract"}
+
+# Generated images: name, inodes, directories, files per directory, blocks per file
+IMAGES=(
+    'small 16384 100 150 2'
+    'large 4096 40 40 140'
+)
+
+# Extract modes: name, xv6fs options
+MODES=(
+    'naive --naive'
+    'pwrite-1 --pwrite --threads=1'
+    'pwrite-4 --pwrite --threads=4'
+    'default-4 --threads=4'
+)
+
+mkdir -p "$IMAGE_DIR"
+
+# Median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+printf "%-8s %-10s %12s %10s\n" "image" "mode" "median_us" "MB/s"
+for spec in "${IMAGES[@]}"; do
+    read -r name ninodes ndirs nfiles nblocks <<< "$spec"
+    image="$IMAGE_DIR/extract_$name.img"
+    [ -f "$image" ] || ./gen_image.py "$image" "$ninodes" "$ndirs" "$nfiles" "$nblocks"
+    bytes=$(( ndirs * nfiles * nblocks * 512 ))
+
+    for mode in "${MODES[@]}"; do
+        read -r mode_name options <<< "$mode"
+        us=$(for ((i = 0; i < RUNS; i++)); do
+            rm -rf "$DEST"
+            start=$(date +%s%N)
+            ./xv6fs extract $options "$image" "$DEST" > /dev/null
+            echo $(( ($(date +%s%N) - start) / 1000 ))
+        done | median)
+        printf "%-8s %-10s %12s %10s\n" "$name" "$mode_name" "$us" $(( bytes / us ))
+    done
+done
+rm -rf "$DEST"
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libxv6fs.h"
+
+// Path-lookup throughput of libxv6fs, with and without its caches.
+// Every file path of the image is collected with readdir, then looked up in
+// rounds: without caches, with cold caches (a fresh handle) and with warm
+// ones. The missing rounds look up each path with its last element changed,
+// which the negative entries answer once the directory has been scanned.
+//
+// Usage: bench_lookup <image> [rounds]
+// Deep trees come from gen_image.py's DEPTH argument.
+
+#define ERROR_CODE 1
+
+char **paths;
+unsigned *inums;
+unsigned npaths, cap_paths;
+unsigned long long components;
+
+void add_path(const char *path, unsigned inum)
+{
+    if (npaths == cap_paths)
+    {
+        cap_paths = cap_paths ? 2 * cap_paths : 1024;
+        paths = realloc(paths, cap_paths * sizeof(char *));
+        inums = realloc(inums, cap_paths * sizeof(unsigned));
+        if (!paths || !inums)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(ERROR_CODE);
+        }
+    }
+    paths[npaths] = strdup(path);
+    inums[npaths++] = inum;
+    for (const char *p = path; *p; p++) components += *p == '/';
+}
+
+void collect(struct xv6fs *fs, unsigned dir, char *path, size_t len)
+{
+    struct xv6fs_dirent de;
+    unsigned pos = 0;
+    while (xv6fs_readdir(fs, dir, &pos, &de) == 1)
+    {
+        if (strcmp(de.name, ".") == 0 || strcmp(de.name, "..") == 0) continue;
+        struct xv6fs_stat st;
+        if (xv6fs_stat(fs, de.inum, &st) < 0 || len + 1 + strlen(de.name) >= 4096) continue;
+        sprintf(path + len, "/%s", de.name);
+        if (st.type == 1) collect(fs, de.inum, path, strlen(path));
+        else add_path(path, de.inum);
+        path[len] = '\0';
+    }
+}
+
+double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+// Look every path up, rounds times, returns ns per lookup
+double run(struct xv6fs *fs, unsigned rounds, bool missing)
+{
+    char path[4096 + 2];
+    double start = now_ms();
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        for (unsigned k = 0; k < npaths; k++)
+        {
+            int inum;
+            if (missing)
+            {
+                snprintf(path, sizeof(path), "%s~", paths[k]);
+                inum = xv6fs_lookup(fs, path);
+                if (inum != -ENOENT) goto wrong;
+            }
+            else
+            {
+                inum = xv6fs_lookup(fs, paths[k]);
+                if (inum != (int)inums[k]) goto wrong;
+            }
+            continue;
+        wrong:
+            fprintf(stderr, "ERROR: lookup of %s%s gave %d.\n", paths[k], missing ? "~" : "", inum);
+            exit(ERROR_CODE);
+        }
+    }
+    return (now_ms() - start) * 1e6 / ((double)rounds * npaths);
+}
+
+void report(const char *backend, const char *mode, struct xv6fs *fs, double ns)
+{
+    struct xv6fs_cache_stats s;
+    xv6fs_cache_stats(fs, &s);
+    printf("%-6s %-14s %10.0f %12.0f %10llu %10llu %10llu %12llu\n", backend, mode, ns, 1e9 / ns,
+           s.lookup_hits, s.lookup_misses, s.negative_hits, s.dirent_blocks);
+}
+
+struct xv6fs *open_or_die(const char *image, int flags)
+{
+    struct xv6fs *fs = xv6fs_open(image, flags);
+    if (!fs)
+    {
+        fprintf(stderr, "ERROR: %s: %s\n", image, strerror(errno));
+        exit(ERROR_CODE);
+    }
+    return fs;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "Usage: bench_lookup <image> [rounds]\n");
+        exit(ERROR_CODE);
+    }
+    const char *image = argv[1];
+    unsigned rounds = argc == 3 ? strtoul(argv[2], NULL, 10) : 5;
+    if (rounds == 0) rounds = 1;
+
+    struct xv6fs *fs = open_or_die(image, 0);
+    char path[4096] = "";
+    collect(fs, 1, path, 0);
+    xv6fs_close(fs);
+    if (npaths == 0)
+    {
+        fprintf(stderr, "ERROR: no files in %s.\n", image);
+        exit(ERROR_CODE);
+    }
+    printf("%u paths, %.1f elements on average, %u rounds\n", npaths, (double)components / npaths, rounds);
+    printf("%-6s %-14s %10s %12s %10s %10s %10s %12s\n", "blocks", "mode", "ns/lookup", "lookups/s",
+           "hits", "misses", "negative", "dirent_blks");
+
+    const char *backends[] = { "mmap", "pread" };
+    for (int b = 0; b < 2; b++)
+    {
+        int flags = b ? XV6FS_PREAD : 0;
+
+        fs = open_or_die(image, flags | XV6FS_NOCACHE);
+        report(backends[b], "uncached", fs, run(fs, rounds, false));
+        xv6fs_close(fs);
+
+        fs = open_or_die(image, flags);
+        report(backends[b], "cold", fs, run(fs, 1, false));
+        report(backends[b], "warm", fs, run(fs, rounds, false));
+        xv6fs_close(fs);
+
+        fs = open_or_die(image, flags | XV6FS_NOCACHE);
+        report(backends[b], "missing-nocache", fs, run(fs, rounds, true));
+        xv6fs_close(fs);
+
+        fs = open_or_die(image, flags);
+        run(fs, 1, true);
+        report(backends[b], "missing-warm", fs, run(fs, rounds, true));
+        xv6fs_close(fs);
+    }
+
+    for (unsigned k = 0; k < npaths; k++) free(paths[k]);
+    free(paths);
+    free(inums);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# Time xv6's mkfs building an image from a source tree.
+# Usage: ./bench_mkfs.sh [runs] [tree] [ref] [mkfs options...]
+# ref is a git revision whose mkfs.c is built and timed alongside the current
+# one, for example the commit before a change. Both images must be identical.
+# The mkfs options, such as --size for trees larger than the default image,
+# are given to both. With COLD=1, run as root, the page cache is dropped before
+# every run so the source files are read from disk.
+
+RUNS=${1:-5}
+TREE=${2:-xv6/kernel}
+REF=$3
+shift 3 2> /dev/null
+IMAGE_DIR="bench_images"
+OUT="$IMAGE_DIR/mkfs"
+
+mkdir -p "$OUT"
+gcc -O -w -iquote xv6/include xv6/tools/mkfs.c fcheck.c xv6z.c -DFCHECK_NO_MAIN -o "$OUT/mkfs_current" -lm -lz -pthread || exit 1
+BUILDS=("current $OUT/mkfs_current")
+if [ -n "$REF" ]; then
+    git show "$REF:xv6/tools/mkfs.c" > "$OUT/mkfs_ref.c" || exit 1
+    # mkfs links the checker since --verify
+    CHECKER=$(grep -q fcheck.h "$OUT/mkfs_ref.c" && echo "fcheck.c -DFCHECK_NO_MAIN")
+    # and the .xv6z writer since --chunked
+    grep -q xv6z.h "$OUT/mkfs_ref.c" && CHECKER="$CHECKER xv6z.c"
+    gcc -O -w -iquote xv6/include "$OUT/mkfs_ref.c" $CHECKER -o "$OUT/mkfs_ref" -lm -lz -pthread || exit 1
+    BUILDS+=("$REF $OUT/mkfs_ref")
+fi
+
+# Median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+printf "%-12s %12s\n" "mkfs" "median_us"
+for build in "${BUILDS[@]}"; do
+    read -r name binary <<< "$build"
+    for ((i = 0; i < RUNS; i++)); do
+        rm -f "$OUT/$name.img"
+        if [ -n "$COLD" ]; then
+            sync
+            echo 3 > /proc/sys/vm/drop_caches
+        fi
+        start=$(date +%s%N)
+        "$binary" "$@" "$OUT/$name.img" "$TREE" > /dev/null || exit 1
+        echo $(( ($(date +%s%N) - start) / 1000 ))
+    done | median | xargs printf "%-12s %12s\n" "$name"
+done
+if [ -n "$REF" ] && ! cmp -s "$OUT/current.img" "$OUT/$REF.img"; then
+    echo "ERROR: $REF builds a different image"
+    exit 1
+fi
@@ -0,0 +1,280 @@
+#!/usr/bin/env python3
+# Regression benchmark for fcheck over the corruption catalogue.
+#
+# Usage: bench_regress.py [--runs N] [--baseline FILE] [--csv FILE]
+#                         [--tolerance PCT] [--p95-tolerance P95_PCT]
+#                         [--slack-us US] [--update-baseline]
+#
+# Every image in testcases/ plus the generated images of bench_engines.sh is
+# checked RUNS times. For each image the median and p95 wall time, median
+# user-space cycles, peak RSS and the bytes the checker touched (from --stats)
+# are written to the CSV, next to whether fcheck reported the expected error.
+#
+# The numbers are compared with the checked-in baseline: a time, cycle or RSS
+# figure more than PCT percent over the baseline (P95_PCT for the p95 time)
+# or any growth in bytes touched is a regression. Times also get SLACK_US of
+# absolute slack since process start-up dominates on the small images, and
+# the p95 time is only compared for images whose baseline median is at least
+# ten times SLACK_US, below that it measures scheduler jitter. The exit status is 1 if any image
+# gave the wrong verdict or regressed. Baselines depend on the machine, so
+# regenerate them with --update-baseline when moving to a new reference host.
+#
+# Cycles come from a hardware perf counter and are left empty when the host
+# has none (for example inside most VMs); they are then not compared.
+import argparse
+import csv
+import ctypes
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+# Expected first line of output for each test image, "" for a clean image
+EXPECTED = {
+    'addronce': 'ERROR: direct address used more than once.',
+    'addronce2': 'ERROR: indirect address used more than once.',
+    'badaddr': 'ERROR: bad direct address in inode.',
+    'badfmt': 'ERROR: directory not properly formatted.',
+    'badindir1': 'ERROR: bad indirect address in inode.',
+    'badindir2': 'ERROR: bad indirect address in inode.',
+    'badinode': 'ERROR: bad inode.',
+    'badlarge': 'ERROR: directory appears more than once in file system.',
+    'badrefcnt': 'ERROR: bad reference count for file.',
+    'badrefcnt2': 'ERROR: bad reference count for file.',
+    'badroot': 'ERROR: root directory does not exist.',
+    'badroot2': 'ERROR: root directory does not exist.',
+    'dironce': 'ERROR: directory appears more than once in file system.',
+    'good': '',
+    'goodlarge': '',
+    'goodlink': '',
+    'goodrefcnt': '',
+    'goodrm': '',
+    'imrkfree': 'ERROR: inode referred to in directory but marked free.',
+    'imrkused': 'ERROR: inode marked use but not found in a directory.',
+    'indirfree': 'ERROR: address used by inode but marked free in bitmap.',
+    'mismatch': '',  # Needs the parent mismatch check, which fcheck does not do
+    'mrkfree': 'ERROR: address used by inode but marked free in bitmap.',
+    'mrkused': 'ERROR: bitmap marks block in use but it is not in use.',
+}
+
+# Generated clean images, same specs and directory as bench_engines.sh:
+# name, inodes, directories, files per directory, blocks per file
+GENERATED = [
+    ('wide', 65536, 2000, 30, 2),
+    ('deep', 65536, 250, 250, 1),
+    ('large', 16384, 100, 150, 40),
+]
+IMAGE_DIR = 'bench_images'
+
+METRICS = ['median_us', 'p95_us', 'cycles', 'rss_kb', 'bytes_touched']
+
+
+# perf_event_open for user-space cycles of one child, enabled when it execs
+PERF_TYPE_HARDWARE = 0
+PERF_COUNT_HW_CPU_CYCLES = 0
+PERF_FLAGS = 1 << 0 | 1 << 5 | 1 << 6 | 1 << 12  # disabled, exclude_kernel, exclude_hv, enable_on_exec
+SYS_perf_event_open = 298
+
+# ptrace, to read the checker's own peak RSS when it exits; ru_maxrss would also
+# count the forked Python process the checker was exec'ed from
+PTRACE_TRACEME = 0
+PTRACE_CONT = 7
+PTRACE_SETOPTIONS = 0x4200
+PTRACE_O_TRACEEXIT = 0x40
+
+libc = ctypes.CDLL(None, use_errno=True)
+libc.ptrace.argtypes = [ctypes.c_long, ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p]
+
+
+def open_cycles(pid):
+    attr = struct.pack('IIQQQQQIIQ', PERF_TYPE_HARDWARE, 64, PERF_COUNT_HW_CPU_CYCLES,
+                       0, 0, 0, PERF_FLAGS, 0, 0, 0)
+    fd = libc.syscall(SYS_perf_event_open, ctypes.c_char_p(attr), pid, -1, -1, 0)
+    return fd if fd >= 0 else None
+
+
+def peak_rss_kb(pid):
+    with open(f'/proc/{pid}/status') as f:
+        for line in f:
+            if line.startswith('VmHWM:'):
+                return int(line.split()[1])
+    return 0
+
+
+def run_once(args, trace=False):
+    """Run fcheck once; returns (wall_us, cycles or None, peak_rss_kb, stdout, stderr)
+
+    The peak RSS is only measured with trace set, it stops the checker twice"""
+    gate_r, gate_w = os.pipe()
+    out = tempfile.TemporaryFile()
+    err = tempfile.TemporaryFile()
+    pid = os.fork()
+    if pid == 0:
+        # Wait until the parent has attached the counter
+        os.close(gate_w)
+        os.read(gate_r, 1)
+        os.dup2(out.fileno(), 1)
+        os.dup2(err.fileno(), 2)
+        if trace:
+            libc.ptrace(PTRACE_TRACEME, 0, None, None)
+        try:
+            os.execv(args[0], args)
+        finally:
+            os._exit(127)
+
+    os.close(gate_r)
+    counter = open_cycles(pid)
+    start = time.perf_counter()
+    os.write(gate_w, b'x')
+    os.close(gate_w)
+    rss = 0
+    if trace:
+        os.waitpid(pid, 0)  # Stopped at exec
+        libc.ptrace(PTRACE_SETOPTIONS, pid, None, PTRACE_O_TRACEEXIT)
+        libc.ptrace(PTRACE_CONT, pid, None, None)
+        os.waitpid(pid, 0)  # Stopped at exit, the address space still exists
+        rss = peak_rss_kb(pid)
+        libc.ptrace(PTRACE_CONT, pid, None, None)
+    _, status, _ = os.wait4(pid, 0)
+    wall_us = (time.perf_counter() - start) * 1e6
+
+    cycles = None
+    if counter is not None:
+        cycles = struct.unpack('Q', os.read(counter, 8))[0]
+        os.close(counter)
+    if os.waitstatus_to_exitcode(status) != 0:
+        sys.exit(f"ERROR: {' '.join(args)} exited with status {status}")
+
+    out.seek(0)
+    err.seek(0)
+    return wall_us, cycles, rss, out.read().decode(), err.read().decode()
+
+
+def percentile(values, p):
+    values = sorted(values)
+    rank = max(1, -(-len(values) * p // 100))  # Nearest rank
+    return values[int(rank) - 1]
+
+
+def measure(image, expected, runs):
+    walls, cycles = [], []
+    verdict = None
+    for _ in range(runs):
+        wall_us, cyc, _, _, err = run_once(['./fcheck', image])
+        walls.append(wall_us)
+        if cyc is not None:
+            cycles.append(cyc)
+        first = err.splitlines()[0] if err else ''
+        if verdict is None:
+            verdict = first
+        elif verdict != first:
+            verdict = f'unstable: {verdict!r} / {first!r}'
+
+    # Bytes touched and peak RSS are deterministic, one traced --stats run is enough.
+    # The --stats bitmap adds one bit per block to the RSS
+    _, _, rss, out, _ = run_once(['./fcheck', '--stats', image], trace=True)
+    touched = ''
+    for line in out.splitlines():
+        if line.startswith('STATS:'):
+            touched = int(line.split('(')[1].split()[0])
+
+    return {
+        'image': os.path.basename(image),
+        'expected': expected,
+        'actual': verdict,
+        'correct': 'yes' if verdict == expected else 'no',
+        'median_us': round(percentile(walls, 50)),
+        'p95_us': round(percentile(walls, 95)),
+        'cycles': percentile(cycles, 50) if cycles else '',
+        'rss_kb': rss,
+        'bytes_touched': touched,
+    }
+
+
+def regressions(row, base, tolerance, p95_tolerance, slack_us):
+    """Names of the metrics in row that are worse than the baseline"""
+    worse = []
+    for m in METRICS:
+        if row[m] == '' or base.get(m, '') == '':
+            continue
+        current, before = float(row[m]), float(base[m])
+        if m == 'p95_us' and float(base['median_us']) < 10 * slack_us:
+            continue
+        if m == 'bytes_touched':
+            limit = before
+        else:
+            limit = before * (1 + (p95_tolerance if m == 'p95_us' else tolerance) / 100)
+            if m.endswith('_us'):
+                limit += slack_us
+        if current > limit:
+            worse.append(m)
+    return worse
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Regression benchmark for fcheck')
+    parser.add_argument('--runs', type=int, default=21)
+    parser.add_argument('--baseline', default='bench_baseline.csv')
+    parser.add_argument('--csv', default='bench_results.csv')
+    parser.add_argument('--tolerance', type=float, default=25)
+    parser.add_argument('--p95-tolerance', type=float, default=60)
+    parser.add_argument('--slack-us', type=float, default=1000)
+    parser.add_argument('--update-baseline', action='store_true')
+    opts = parser.parse_args()
+
+    images = [(f'testcases/{name}', expected) for name, expected in sorted(EXPECTED.items())]
+    os.makedirs(IMAGE_DIR, exist_ok=True)
+    for name, ninodes, ndirs, nfiles, nblocks in GENERATED:
+        image = f'{IMAGE_DIR}/{name}.img'
+        if not os.path.exists(image):
+            subprocess.run(['./gen_image.py', image, str(ninodes), str(ndirs), str(nfiles), str(nblocks)],
+                           check=True)
+        images.append((image, ''))
+
+    baseline = {}
+    if os.path.exists(opts.baseline) and not opts.update_baseline:
+        with open(opts.baseline) as f:
+            baseline = {row['image']: row for row in csv.DictReader(f)}
+
+    rows = []
+    failed = False
+    print(f"{'image':<12} {'ok':<4} {'median_us':>10} {'p95_us':>10} {'cycles':>12} {'rss_kb':>8} {'bytes':>10}  status")
+    for image, expected in images:
+        row = measure(image, expected, opts.runs)
+        worse = regressions(row, baseline[row['image']], opts.tolerance, opts.p95_tolerance, opts.slack_us) \
+            if row['image'] in baseline else []
+        if row['correct'] != 'yes':
+            status = 'WRONG VERDICT'
+        elif worse:
+            status = 'regressed: ' + ','.join(worse)
+        elif baseline and row['image'] not in baseline:
+            status = 'no baseline'
+        else:
+            status = 'ok'
+        failed |= status not in ('ok', 'no baseline')
+        row['status'] = status
+        rows.append(row)
+        print(f"{row['image']:<12} {row['correct']:<4} {row['median_us']:>10} {row['p95_us']:>10} "
+              f"{row['cycles']!s:>12} {row['rss_kb']:>8} {row['bytes_touched']!s:>10}  {status}")
+
+    fields = ['image', 'expected', 'actual', 'correct'] + METRICS + ['status']
+    with open(opts.csv, 'w', newline='') as f:
+        writer = csv.DictWriter(f, fields)
+        writer.writeheader()
+        writer.writerows(rows)
+
+    if opts.update_baseline:
+        with open(opts.baseline, 'w', newline='') as f:
+            writer = csv.DictWriter(f, ['image'] + METRICS, extrasaction='ignore')
+            writer.writeheader()
+            writer.writerows(rows)
+        print(f'Baseline written to {opts.baseline}')
+
+    print(f'Results written to {opts.csv}')
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
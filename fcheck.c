@@ -8,30 +8,348 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "types.h"
 #include "fs.h"
+#include "fcheck.h"
+#include "xv6z.h"
 
 #define BLOCK_SIZE (BSIZE)
+#define MAX_BSIZE 1024         // Largest block size of any layout, for block buffers
 #define ERROR_CODE 1
 #define ROOTINO 1
 #define T_UNALLOC 0
 #define T_DIR 1
 #define T_FILE 2
 #define T_DEV 3
+#define DPB (BLOCK_SIZE / sizeof(struct dirent))
+
+// Dirent name kinds
+#define DE_NAME 1
+#define DE_DOT 2
+#define DE_DOTDOT 3
 
 char *addr;                    // Base address of the mapped filesystem
+// Reader of a compressed image, of which addr holds only the metadata, see image_data()
+void (*image_reader)(void *buf, size_t len, uint64_t off);
+size_t prefix_bytes;           // Bytes of a compressed image read into addr so far
 struct dinode *inode_table;    // Pointer to the inode table
-struct superblock *sb;         // Pointer to the superblock
+struct superblock *sb;         // Size, data blocks and inodes, whatever the on-disk superblock format
+
+bool quiet;                    // Record failures without printing (fcheck_check_buffer)
 
 // Tracking arrays for validation
 uint *block_usage;             // Counts how many times each block is used
 uint *dir_ref_count;           // Counts directory references to each inode
 uint *parent_count;            // Counts how many parent directories reference each directory
+uint *block_owner;             // Inode mapping each data block, NULL unless --dedup
+
+// Path reconstruction for error reports
+ushort *path_parent;           // Directory that first names each inode
+uint *path_slot;               // Global dirent index (block * DPB + entry) of that name, 0 if unnamed
+char **dir_path_memo;          // Memoized paths of directories, allocated on first report
+uint paths_scanned;            // Directories below this inode number have had their dirents recorded
+int bad_entry_dir = -1;        // First directory holding an entry to a free inode (check 10)
+
+// Subtree-scoped check (--path), sized by the subtree instead of the image
+struct scope_node
+{
+    uint inum;
+    uint parent;               // Index of the naming directory's node, node 0 is the scope root
+    uint slot;                 // Global dirent index of the name
+};
+bool scoped;                   // Set when only the subtree under scope_path is checked
+const char *scope_path;        // Path the scope root was resolved from
+struct scope_node *scope_nodes;
+uint scope_len, scope_cap;
+int scope_dup_dir = -1;        // First directory reached twice inside the subtree (check 12)
+
+void report_inode_error(const char *msg, uint inum);
+void count_failure(const char *msg);
+void analyze_inode(uint inum, uint claimed);
+void analyze_directory(uint fanout);
+int is_bit_set_in_bitmap(uint block_num);
+int check_root_directory();
+void scan_directory(uint dir_inum, int *dot_inum, int *ddot_inum, bool count);
+int check_inode(uint i);
+
+// Check depth (--level) and read accounting (--stats)
+int check_level = 3;           // 1: inode table, 2: adds indirect blocks and bitmap, 3: adds directories
+bool report_paths = true;      // Off when resolving a path would read blocks the mode must not touch
+uchar *read_map;               // One bit per block read, NULL unless --stats
+uint blocks_read;              // Distinct blocks read
+
+// Space analytics gathered by the full check walk (--analyze)
+// Histograms count values in power-of-two buckets: 0, 1, 2, 3-4, 5-8, ...
+#define NBUCKETS 34
+#define MAX_DEPTH 32           // Deeper directories share the last depth bucket
+bool analyze;
+struct analysis
+{
+    uint files;
+    uint size_hist[NBUCKETS];                   // File sizes in bytes
+    unsigned long long direct_blocks;           // Data blocks mapped by direct addresses
+    unsigned long long indirect_blocks;         // Data blocks mapped through indirect blocks
+    unsigned long long map_blocks;              // The indirect blocks themselves
+    uint indirect_files;                        // Files and directories needing an indirect block
+    unsigned long long slack_bytes;             // Allocated but past the end of the file
+    unsigned long long allocated_bytes;
+    uint slack_hist[NBUCKETS];
+    uint dirs;
+    uint fanout_hist[NBUCKETS];                 // Entries per directory, . and .. excluded
+    uint max_fanout;
+    uint depth_hist[MAX_DEPTH + 1];             // Directory depth, the root is 0
+    uint free_runs;
+    uint run_hist[NBUCKETS];                    // Lengths of runs of free data blocks
+    uint longest_run;
+    unsigned long long free_blocks;
+} analysis;
+
+// Duplicate data detection (--dedup), over the data blocks of regular files
+bool dedup;
 
 // Filesystem layout information
 uint data_block_start;         // First block number where data blocks begin
 uint bitmap_start;             // First block number where the bitmap begins
+uint inode_start;              // First block number of the inode table
+
+// On-disk layout variants (--layout), each with its own kernels from layout.h
+#define SB_PLAIN 0             // size, nblocks, ninodes; inodes from block 2, then the bitmap
+#define SB_LOG 1               // Adds the log, inode table and bitmap start blocks
+#define SB_MAGIC 2             // SB_LOG preceded by FSMAGIC
+#define FSMAGIC 0x10203040
+struct layout
+{
+    const char *name;
+    uint bsize;
+    uint ndirect;              // addrs[ndirect] is the indirect block
+    bool dindirect;            // addrs[ndirect + 1] is a double-indirect block
+    int sb_format;
+    int (*check_root_directory)();
+    int (*scan)(uint first);   // Sequential main scan
+    int (*bitmap_sweep)();
+};
+struct layout *layout;         // Layout of the image being checked
+struct layout *forced_layout;  // From --layout, NULL to detect it
+
+// Superblock of the SB_LOG and SB_MAGIC layouts, after the magic number
+struct log_superblock
+{
+    uint size;
+    uint nblocks;
+    uint ninodes;
+    uint nlog;
+    uint logstart;
+    uint inodestart;
+    uint bmapstart;
+};
+struct superblock sb_fields;   // What sb points to
+
+// Open-addressing hash map from nonzero uint keys to uint values
+// Used where memory must follow the amount of work instead of the image size
+struct umap
+{
+    uint *keys;
+    uint *vals;
+    uint cap;                  // Always a power of two
+    uint len;
+};
+
+uint umap_hash(uint key, uint cap)
+{
+    return (key * 2654435761u) & (cap - 1);
+}
+
+// Returns a pointer to the value slot for key, or NULL if absent
+uint *umap_get(struct umap *m, uint key)
+{
+    if (m->cap == 0) return NULL;
+    for (uint h = umap_hash(key, m->cap); m->keys[h] != 0; h = (h + 1) & (m->cap - 1))
+    {
+        if (m->keys[h] == key) return &m->vals[h];
+    }
+    return NULL;
+}
+
+// Inserts key if absent. Returns 1 if inserted, 0 if already present
+int umap_put(struct umap *m, uint key, uint val)
+{
+    // Keep the load factor at or below one half
+    if (2 * (m->len + 1) > m->cap)
+    {
+        struct umap grown = { 0 };
+        grown.cap = m->cap ? 2 * m->cap : 64;
+        grown.keys = calloc(grown.cap, sizeof(uint));
+        grown.vals = calloc(grown.cap, sizeof(uint));
+        if (!grown.keys || !grown.vals)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(ERROR_CODE);
+        }
+        for (uint h = 0; h < m->cap; h++)
+        {
+            if (m->keys[h] != 0) umap_put(&grown, m->keys[h], m->vals[h]);
+        }
+        free(m->keys);
+        free(m->vals);
+        *m = grown;
+    }
+    
+    uint h = umap_hash(key, m->cap);
+    for (; m->keys[h] != 0; h = (h + 1) & (m->cap - 1))
+    {
+        if (m->keys[h] == key) return 0;
+    }
+    m->keys[h] = key;
+    m->vals[h] = val;
+    m->len++;
+    return 1;
+}
+
+void umap_free(struct umap *m)
+{
+    free(m->keys);
+    free(m->vals);
+    m->keys = m->vals = NULL;
+    m->cap = m->len = 0;
+}
+
+// Empty the map but keep its capacity
+void umap_clear(struct umap *m)
+{
+    if (m->cap) memset(m->keys, 0, m->cap * sizeof(uint));
+    m->len = 0;
+}
+
+struct umap scope_inodes;       // Inode number to scope node index
+struct umap scope_blocks;       // Blocks claimed inside the subtree
+struct umap sample_blocks;      // Blocks claimed by the inode being sampled
+struct umap *claim_set;         // Where claim_block() records claims, NULL for block_usage
+
+// Sampling health check (--sample)
+unsigned long long sample_state;
+
+// Checkpoint and resume of the main inode scan (--checkpoint, --resume)
+const char *checkpoint_file;
+uint checkpoint_pct = 5;       // Share of run time checkpoint writes may take
+double checkpoint_cost_ms;     // How long the last checkpoint write took
+struct timespec checkpoint_last;
+bool checkpoint_failed;
+long long image_bytes;         // Identify the image a checkpoint belongs to
+long long image_mtime;
+
+// Check engines for the main inode scan (--engine)
+#define ENGINE_SEQUENTIAL 0
+#define ENGINE_PIPELINE 1      // Decode inodes, decode blocks and fold claims on three threads
+#define ENGINE_SHARDED 2       // Sequential scan with per-range prefetch threads
+int engine = ENGINE_SEQUENTIAL;
+uint shard_count = 4;
+
+// Pipeline items: one per inode that is not free, followed by one per dirent block of a directory
+#define PIPE_INODE 1
+#define PIPE_DIRENTS 2
+#define PIPE_END 3
+#define RING_SIZE 1024
+struct pipe_item
+{
+    uint kind;
+    uint inum;                 // The inode, or the directory owning the dirents
+    uint nblocks;              // PIPE_INODE: number of PIPE_DIRENTS items that follow
+    uint block;                // PIPE_DIRENTS: the dirent block
+    ushort ent_inum[DPB];
+    uchar ent_kind[DPB];       // 0 for empty entries, otherwise DE_*
+};
+struct ring
+{
+    struct pipe_item items[RING_SIZE];
+    _Atomic uint head __attribute__((aligned(64)));
+    _Atomic uint tail __attribute__((aligned(64)));
+};
+struct ring *inode_ring;       // Stage 1 to stage 2
+struct ring *block_ring;       // Stage 2 to stage 3
+atomic_int pipe_stop;          // Set once stage 3 is done, releases waiting producers
+volatile uint pipe_sink;       // Keeps prefetching reads from being optimized out
+
+// Run metrics (--metrics)
+// Hot-path counters are private to each thread and merged once as the thread finishes
+struct counters
+{
+    unsigned long long inodes;
+    unsigned long long blocks;
+    unsigned long long dirents;
+};
+__thread struct counters local_counts;
+struct counters total_counts;
+pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define NCHECKS 14
+const char *check_labels[NCHECKS] = { "superblock", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "bitmap" };
+struct check_id
+{
+    const char *msg;
+    uint check;                // Index into check_labels
+};
+struct check_id check_ids[] = {
+    { "bad superblock.", 0 },
+    { "bad inode.", 1 },
+    { "bad direct address in inode.", 2 },
+    { "bad indirect address in inode.", 2 },
+    { "root directory does not exist.", 3 },
+    { "directory not properly formatted.", 4 },
+    { "address used by inode but marked free in bitmap.", 5 },
+    { "bitmap marks block in use but it is not in use.", 6 },
+    { "direct address used more than once.", 7 },
+    { "indirect address used more than once.", 8 },
+    { "inode marked use but not found in a directory.", 9 },
+    { "inode referred to in directory but marked free.", 10 },
+    { "bad reference count for file.", 11 },
+    { "directory appears more than once in file system.", 12 },
+    { "bitmap marks metadata block free.", 13 },
+    { "bitmap marks block past the end of the file system in use.", 13 },
+};
+uint check_failures[NCHECKS];
+uint checks_passed;            // Checks that ran to the end without failing, as bits indexed like check_labels
+uint failures;
+uint first_failure;            // Index into check_labels of the first failure
+const char *first_failure_msg;
+
+#define PHASE_SUPERBLOCK 0
+#define PHASE_INODE_SCAN 1
+#define PHASE_BITMAP_SWEEP 2
+#define PHASE_REFERENCES 3
+#define PHASE_SUBTREE 4
+#define PHASE_SAMPLE 5
+#define PHASE_TOTAL 6
+#define NPHASES 7
+const char *phase_names[NPHASES] = { "superblock", "inode_scan", "bitmap_sweep", "references", "subtree", "sample", "total" };
+double phase_buckets[] = { 0.0001, 0.001, 0.01, 0.1, 1, 10, 100 };
+struct timespec phase_start[NPHASES];
+double phase_seconds[NPHASES];
+bool phase_ran[NPHASES];
+
+// Samples already in the metrics file
+#define MAX_METRICS 512
+struct
+{
+    char key[128];
+    double value;
+} previous[MAX_METRICS];
+uint nprevious;
+
+// Account for a block the checker reads (--stats)
+void note_read(uint block_num)
+{
+    if (!read_map || block_num >= sb->size) return;
+    if (read_map[block_num / 8] & (1 << (block_num % 8))) return;
+    read_map[block_num / 8] |= 1 << (block_num % 8);
+    blocks_read++;
+}
 
 int is_valid_data_block(uint block_num)
 {
@@ -39,464 +357,1799 @@ int is_valid_data_block(uint block_num)
     return (block_num >= (uint)0 && block_num < sb->size && block_num >= data_block_start);
 }
 
-// Get a pointer to directory entries in a given block
-struct dirent *get_dirent_block(uint block_num)
+// Block source: a raw image is mapped whole at addr. Of a compressed one only
+// the metadata, up to the end of the bitmap, is read into addr by
+// load_superblock(); every read of the data region goes through here and
+// is served by image_reader from the chunk cache.
+// Returns len bytes at off, in place in a mapped image or else copied into
+// buf, valid until buf is reused
+const void *image_data(size_t off, size_t len, void *buf)
 {
-    return (struct dirent *)(addr + block_num * BLOCK_SIZE);
+    if (!image_reader) return addr + off;
+    image_reader(buf, len, off);
+    return buf;
 }
 
-// Get a pointer to an indirect block 
-uint *get_indirect_block(uint block_num)
+// Block b of the image's layout, buf holds MAX_BSIZE bytes
+const void *image_block(uint b, void *buf)
 {
-    return (uint *)(addr + block_num * BLOCK_SIZE);
+    return image_data((size_t)b * layout->bsize, layout->bsize, buf);
 }
 
-// Check if a block is marked as in-use in the bitmap
-int is_bit_set_in_bitmap(uint block_num)
+// Make the first len bytes of a compressed image readable at addr
+void read_prefix(size_t len)
 {
-    if (block_num >= sb->size) return 0;
-    
-    // Find which block of the bitmap contains this bit
-    uint bitmap_block = BBLOCK(block_num, sb->ninodes);
-    uchar *bitmap = (uchar *)(addr + (bitmap_block * BLOCK_SIZE));
+    if (!image_reader || len <= prefix_bytes) return;
+    image_reader(addr + prefix_bytes, len - prefix_bytes, prefix_bytes);
+    prefix_bytes = len;
+}
+
+// Get directory entries in a given block, buf holds DPB of them
+const struct dirent *get_dirent_block(uint block_num, struct dirent *buf)
+{
+    note_read(block_num);
+    return image_data((size_t)block_num * BLOCK_SIZE, BLOCK_SIZE, buf);
+}
+
+// Get an indirect block, buf holds NINDIRECT addresses
+const uint *get_indirect_block(uint block_num, uint *buf)
+{
+    note_read(block_num);
+    return image_data((size_t)block_num * BLOCK_SIZE, BLOCK_SIZE, buf);
+}
+
+// The dirent at a global dirent index
+const struct dirent *get_dirent(uint slot, struct dirent *buf)
+{
+    return image_data((size_t)slot * sizeof(struct dirent), sizeof(struct dirent), buf);
+}
+
+// Record that an inode claims block_num
+// Returns 0 if the block was already claimed (checks 7 and 8)
+int claim_block(uint block_num)
+{
+    local_counts.blocks++;
+    if (claim_set) return umap_put(claim_set, block_num, 1);
     
-    // Find the specific bit within that block
-    uint bit_index = block_num % BPB;           // Which bit in the bitmap
-    uint byte_offset = bit_index / 8;            // Which byte in the block
-    uint bit_offset = bit_index % 8;             // Which bit in the byte
+    if (block_usage[block_num] > 0) return 0;
+    block_usage[block_num]++;
+    return 1;
+}
+
+// Gather an inode's valid data blocks in file order, blocks must hold MAXFILE entries
+uint dir_blocks(uint inum, uint *blocks)
+{
+    struct dinode *dip = &inode_table[inum];
+    uint nblocks = 0;
     
-    return (bitmap[byte_offset] >> bit_offset) & 1;
+    for (int j = 0; j < NDIRECT; j++)
+    {
+        if (dip->addrs[j] != 0 && is_valid_data_block(dip->addrs[j])) blocks[nblocks++] = dip->addrs[j];
+    }
+    if (dip->addrs[NDIRECT] != 0 && is_valid_data_block(dip->addrs[NDIRECT]))
+    {
+        uint buf[NINDIRECT];
+        const uint *indirect = get_indirect_block(dip->addrs[NDIRECT], buf);
+        for (int j = 0; j < NINDIRECT; j++)
+        {
+            if (indirect[j] != 0 && is_valid_data_block(indirect[j])) blocks[nblocks++] = indirect[j];
+        }
+    }
+    return nblocks;
 }
 
-// Search for a directory entry by name within a block
-// Returns the inode number if found, -1 otherwise
-int find_dirent_in_block(uint block_num, char *name)
+// Look up name in a directory like dirlookup() in the kernel, names are truncated to DIRSIZ
+// Returns the inode number and stores the dirent slot, or -1 if absent
+int dir_lookup(uint dir_inum, const char *name, uint *slot)
 {
-    struct dirent *de = get_dirent_block(block_num);
-    int entries = BLOCK_SIZE / sizeof(struct dirent);
+    uint blocks[MAXFILE];
+    uint nblocks = dir_blocks(dir_inum, blocks);
     
-    for (int i = 0; i < entries; i++)
+    for (uint j = 0; j < nblocks; j++)
     {
-        // Skip empty entries and check if names match
-        if (de[i].inum != 0 && strncmp(de[i].name, name, DIRSIZ) == 0)
+        struct dirent buf[DPB];
+        const struct dirent *de = get_dirent_block(blocks[j], buf);
+        for (uint k = 0; k < DPB; k++)
         {
-            return de[i].inum;
+            if (de[k].inum != 0 && strncmp(de[k].name, name, DIRSIZ) == 0)
+            {
+                *slot = blocks[j] * DPB + k;
+                return de[k].inum;
+            }
         }
     }
     return -1;
 }
 
-// Verify that the root directory exists and is properly formatted
-int check_root_directory()
+// Classify a dirent name as DE_DOT, DE_DOTDOT or DE_NAME
+int dirent_kind(const struct dirent *de)
 {
-    struct dinode *root = &inode_table[ROOTINO];
-    
-    if (root->type != T_DIR)
+    if (strncmp(de->name, ".", DIRSIZ) == 0) return DE_DOT;
+    if (strncmp(de->name, "..", DIRSIZ) == 0) return DE_DOTDOT;
+    return DE_NAME;
+}
+
+// Fold one decoded dirent of directory dir_inum into the scan state
+// Records . and .., and the parent and name slot of every other entry.
+// When count is set, also accumulates reference counts for checks 9, 11 and 12
+// and remembers the first directory with an entry to a free inode for check 10
+void fold_dirent(uint dir_inum, uint inum, uint slot, int kind, int *dot_inum, int *ddot_inum, bool count)
+{
+    if (kind == DE_DOT)
     {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        return 1;
+        if (*dot_inum == -1) *dot_inum = inum;
     }
-    
-    int dot_inum = -1, ddot_inum = -1;
-    
-    // Search for . and .. entries in direct blocks, keep searching until both are found
-    for (int i = 0; i < NDIRECT && (dot_inum == -1 || ddot_inum == -1); i++)
+    else if (kind == DE_DOTDOT)
     {
-        if (root->addrs[i] == 0) continue;
-        if (dot_inum == -1) dot_inum = find_dirent_in_block(root->addrs[i], ".");
-        if (ddot_inum == -1) ddot_inum = find_dirent_in_block(root->addrs[i], "..");
+        if (*ddot_inum == -1) *ddot_inum = inum;
     }
-    
-    // Check indirect block if both arent found yet
-    if (root->addrs[NDIRECT] != 0 && (dot_inum == -1 || ddot_inum == -1))
+    else if (inum < sb->ninodes && path_slot[inum] == 0 && dir_inum <= 0xFFFF)
     {
-        uint *indirect = get_indirect_block(root->addrs[NDIRECT]);
-        for (int i = 0; i < NINDIRECT && (dot_inum == -1 || ddot_inum == -1); i++)
-        {
-            if (indirect[i] == 0) continue;
-            if (dot_inum == -1) dot_inum = find_dirent_in_block(indirect[i], ".");
-            if (ddot_inum == -1) ddot_inum = find_dirent_in_block(indirect[i], "..");
-        }
+        // First name wins, later hard links are not needed to locate the inode
+        path_parent[inum] = dir_inum;
+        path_slot[inum] = slot;
     }
     
-    // For root, both . and .. should point to root itself
-    if (dot_inum != ROOTINO || ddot_inum != ROOTINO)
+    if (!count) return;
+    
+    // Inode number must be valid and the inode must be allocated
+    if (inum >= sb->ninodes || inode_table[inum].type == T_UNALLOC)
     {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        return 1;
+        if (bad_entry_dir == -1) bad_entry_dir = dir_inum;
+        return;
     }
     
-    return 0;
+    // Count all directory references
+    dir_ref_count[inum]++;
+    
+    // For directories, also track parent relationships, skip . and .. for self reference
+    if (inode_table[inum].type == T_DIR && kind == DE_NAME)
+    {
+        parent_count[inum]++;
+    }
 }
 
-// Count how many times each inode is referenced in directories
-// Also tracks parent counts for directories, not including . and ..
-void count_directory_references()
+// Record names for directories the main scan has not reached yet
+// Only runs when an error is reported early, each dirent block is still decoded once
+void finish_path_scan()
 {
-    // Scan through all directory inodes
-    for (uint i = 0; i < sb->ninodes; i++)
+    for (; paths_scanned < sb->ninodes; paths_scanned++)
     {
-        struct dinode *dip = &inode_table[i];
-        if (dip->type != T_DIR) continue;
-        
-        // Check all direct blocks
-        for (int j = 0; j < NDIRECT; j++)
-        {
-            if (dip->addrs[j] == 0) continue;
-            
-            struct dirent *de = get_dirent_block(dip->addrs[j]);
-            int entries = BLOCK_SIZE / sizeof(struct dirent);
-            
-            for (int k = 0; k < entries; k++)
-            {
-                if (de[k].inum != 0)
-                {
-                    uint inum = de[k].inum;
-                    
-                    // Count all directory references
-                    if (inum < sb->ninodes) dir_ref_count[inum]++;
-                    
-                    // For directories, also track parent relationships, skip . and .. for self reference
-                    if (inum < sb->ninodes && inode_table[inum].type == T_DIR)
-                    {
-                        if (strncmp(de[k].name, ".", DIRSIZ) != 0 && 
-                            strncmp(de[k].name, "..", DIRSIZ) != 0)
-                        {
-                            parent_count[inum]++;
-                        }
-                    }
-                }
-            }
-        }
-        
-        // Check indirect blocks
-        if (dip->addrs[NDIRECT] != 0)
-        {
-            uint *indirect = get_indirect_block(dip->addrs[NDIRECT]);
-            for (int j = 0; j < NINDIRECT; j++)
-            {
-                if (indirect[j] == 0) continue;
-                
-                struct dirent *de = get_dirent_block(indirect[j]);
-                int entries = BLOCK_SIZE / sizeof(struct dirent);
-                
-                for (int k = 0; k < entries; k++)
-                {
-                    if (de[k].inum != 0)
-                    {
-                        uint inum = de[k].inum;
-                        if (inum < sb->ninodes) dir_ref_count[inum]++;
-                        
-                        if (inum < sb->ninodes && inode_table[inum].type == T_DIR)
-                        {
-                            if (strncmp(de[k].name, ".", DIRSIZ) != 0 && 
-                                strncmp(de[k].name, "..", DIRSIZ) != 0)
-                            {
-                                parent_count[inum]++;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+        if (inode_table[paths_scanned].type != T_DIR) continue;
+        int dot_inum = -1, ddot_inum = -1;
+        scan_directory(paths_scanned, &dot_inum, &ddot_inum, false);
     }
 }
 
-// Verify that all directory entries point to valid, in-use inodes
-int check_directory_entry_validity()
+// Path of an inode reached by the scoped walk, prepending names up to the scope root
+const char *scope_node_path(uint inum)
 {
-    for (uint i = 0; i < sb->ninodes; i++)
+    static char path[4096];
+    uint *node = umap_get(&scope_inodes, inum);
+    if (!node) return NULL;
+    
+    size_t prefix_len = strlen(scope_path);
+    char *p = path + sizeof(path) - 1;
+    *p = '\0';
+    for (uint n = *node; n != 0; n = scope_nodes[n].parent)
     {
-        struct dinode *dip = &inode_table[i];
-        if (dip->type != T_DIR) continue;
-        
-        // Check direct blocks
-        for (int j = 0; j < NDIRECT; j++)
-        {
-            if (dip->addrs[j] == 0) continue;
-            
-            struct dirent *de = get_dirent_block(dip->addrs[j]);
-            int entries = BLOCK_SIZE / sizeof(struct dirent);
-            
-            for (int k = 0; k < entries; k++)
-            {
-                if (de[k].inum == 0) continue;
-                
-                // Inode number must be valid and the inode must be allocated
-                if (de[k].inum >= sb->ninodes || inode_table[de[k].inum].type == T_UNALLOC)
-                {
-                    fprintf(stderr, "ERROR: inode referred to in directory but marked free.\n");
-                    return 1;
-                }
-            }
-        }
-        
-        // Check indirect blocks
-        if (dip->addrs[NDIRECT] != 0)
-        {
-            uint *indirect = get_indirect_block(dip->addrs[NDIRECT]);
-            for (int j = 0; j < NINDIRECT; j++)
-            {
-                if (indirect[j] == 0) continue;
-                
-                struct dirent *de = get_dirent_block(indirect[j]);
-                int entries = BLOCK_SIZE / sizeof(struct dirent);
-                
-                for (int k = 0; k < entries; k++)
-                {
-                    if (de[k].inum == 0) continue;
-                    
-                    if (de[k].inum >= sb->ninodes || inode_table[de[k].inum].type == T_UNALLOC)
-                    {
-                        fprintf(stderr, "ERROR: inode referred to in directory but marked free.\n");
-                        return 1;
-                    }
-                }
-            }
-        }
+        struct dirent buf;
+        const struct dirent *de = get_dirent(scope_nodes[n].slot, &buf);
+        size_t len = strnlen(de->name, DIRSIZ);
+        if ((size_t)(p - path) < len + 1 + prefix_len) return NULL;
+        p -= len;
+        memcpy(p, de->name, len);
+        *--p = '/';
     }
-    return 0;
+    
+    p -= prefix_len;
+    memcpy(p, scope_path, prefix_len);
+    return *p ? p : "/";
 }
 
-int main(int argc, char *argv[])
+// Build the absolute path of an inode from the recorded parent and name slots
+// Returns NULL when the inode is not named by any directory
+const char *inode_path(uint inum)
 {
-    int fsfd;
-    struct stat statb;
+    static char path[4096];
     
-    if (argc < 2)
-    {
-        fprintf(stderr, "Usage: fcheck <file_system_image>\n");
-        exit(ERROR_CODE);
-    }
+    if (scoped) return scope_node_path(inum);
+    if (inum == ROOTINO) return "/";
+    if (inum >= sb->ninodes) return NULL;
     
-    fsfd = open(argv[1], O_RDONLY);
-    if (fsfd < 0)
+    finish_path_scan();
+    if (path_slot[inum] == 0) return NULL;
+    
+    if (!dir_path_memo)
     {
-        fprintf(stderr, "image not found.\n");
-        exit(ERROR_CODE);
+        dir_path_memo = calloc(sb->ninodes, sizeof(char *));
+        if (!dir_path_memo) return NULL;
     }
+    if (dir_path_memo[inum]) return dir_path_memo[inum];
     
-    if (fstat(fsfd, &statb) == -1)
+    // Collect names leaf first, stopping at root or a memoized ancestor
+    // The depth bound stops parent cycles in corrupted images
+    uint chain[64];
+    int depth = 0;
+    uint cur = inum;
+    const char *prefix = "";
+    while (cur != ROOTINO)
     {
-        perror("fstat");
-        exit(ERROR_CODE);
+        if (dir_path_memo[cur]) { prefix = dir_path_memo[cur]; break; }
+        if (path_slot[cur] == 0 || depth == 64) return NULL;
+        chain[depth++] = cur;
+        cur = path_parent[cur];
     }
     
-    addr = mmap(NULL, statb.st_size, PROT_READ, MAP_PRIVATE, fsfd, 0);
-    if (addr == MAP_FAILED)
+    // Emit names root first, memoizing every directory along the way
+    int len = snprintf(path, sizeof(path), "%s", prefix);
+    for (int d = depth - 1; d >= 0; d--)
     {
-        perror("mmap failed");
-        exit(1);
+        struct dirent buf;
+        const struct dirent *de = get_dirent(path_slot[chain[d]], &buf);
+        len += snprintf(path + len, sizeof(path) - len, "/%.*s", DIRSIZ, de->name);
+        if (len >= (int)sizeof(path)) return NULL;
+        if (inode_table[chain[d]].type == T_DIR) dir_path_memo[chain[d]] = strdup(path);
     }
+    return path;
+}
+
+// Print a check failure followed by the inode it concerns and where it lives
+void report_inode_error(const char *msg, uint inum)
+{
+    count_failure(msg);
+    if (quiet) return;
     
-    sb = (struct superblock *)(addr + 1 * BLOCK_SIZE);
-    
-    // Get pointer to the inode table (starts at block 2)
-    inode_table = (struct dinode *)(addr + IBLOCK((uint)0) * BLOCK_SIZE);
-    
-    // Calculate where the bitmap and data blocks start
-    bitmap_start = BBLOCK(0, sb->ninodes);
-    uint num_bitmap_blocks = (sb->nblocks + BPB - 1) / BPB;  
-    data_block_start = bitmap_start + num_bitmap_blocks;
-    
-    // Allocate tracking arrays
-    block_usage = calloc(sb->size, sizeof(uint));
-    dir_ref_count = calloc(sb->ninodes, sizeof(uint));
-    parent_count = calloc(sb->ninodes, sizeof(uint));
+    fprintf(stderr, "ERROR: %s\n", msg);
     
-    if (!block_usage || !dir_ref_count || !parent_count)
+    // Resolving a path reads directory blocks
+    if (!report_paths)
     {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(ERROR_CODE);
+        fprintf(stderr, "  inode %u\n", inum);
+        return;
     }
     
-    // Check 3: Verify root directory exists and is properly set up
-    if (check_root_directory()) goto cleanup;
+    const char *path = inode_path(inum);
+    fprintf(stderr, "  inode %u: %s\n", inum, path ? path : "(no path)");
+}
+
+// Append an inode to the scoped walk
+void scope_add(uint inum, uint parent, uint slot)
+{
+    if (scope_len == scope_cap)
+    {
+        scope_cap = scope_cap ? 2 * scope_cap : 64;
+        scope_nodes = realloc(scope_nodes, scope_cap * sizeof(struct scope_node));
+        if (!scope_nodes)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(ERROR_CODE);
+        }
+    }
+    umap_put(&scope_inodes, inum, scope_len);
+    scope_nodes[scope_len++] = (struct scope_node){ inum, parent, slot };
+}
+
+// Decode one dirent block of a directory in the subtree and queue unseen children
+void scope_scan_dirent_block(uint node, uint block_num, int *dot_inum, int *ddot_inum)
+{
+    uint dir_inum = scope_nodes[node].inum;
+    struct dirent buf[DPB];
+    const struct dirent *de = get_dirent_block(block_num, buf);
     
-    // Main loop: scan through all inodes and check for consistency
-    for (uint i = 0; i < sb->ninodes; i++)
+    for (uint k = 0; k < DPB; k++)
     {
-        struct dinode *dip = &inode_table[i];
+        if (de[k].inum == 0) continue;
+        uint inum = de[k].inum;
+        local_counts.dirents++;
         
-        // Check 1: Inode must have a valid type
-        if (dip->type != T_UNALLOC && dip->type != T_FILE && 
-            dip->type != T_DIR && dip->type != T_DEV)
+        if (strncmp(de[k].name, ".", DIRSIZ) == 0)
         {
-            fprintf(stderr, "ERROR: bad inode.\n");
-            goto cleanup;
+            if (*dot_inum == -1) *dot_inum = inum;
+            continue;
         }
-        
-        // Skip unallocated inodes for the remaining checks
-        if (dip->type == T_UNALLOC) continue;
-        
-        // Check all direct block addresses
-        for (int j = 0; j < NDIRECT; j++)
+        if (strncmp(de[k].name, "..", DIRSIZ) == 0)
         {
-            uint block = dip->addrs[j];
-            if (block == 0) continue;  // Skip unused entries
-            
-            // Check 2: Block address must be valid
-            if (!is_valid_data_block(block))
-            {
-                fprintf(stderr, "ERROR: bad direct address in inode.\n");
-                goto cleanup;
-            }
-            
-            // Check 7: Each block should only be used once
-            if (block_usage[block] > 0)
-            {
-                fprintf(stderr, "ERROR: direct address used more than once.\n");
-                goto cleanup;
-            }
-            block_usage[block]++;
-            
-            // Check 5: Block must be marked as in-use in the bitmap
-            if (!is_bit_set_in_bitmap(block))
-            {
-                fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                goto cleanup;
-            }
+            if (*ddot_inum == -1) *ddot_inum = inum;
+            continue;
         }
         
-        // Check the indirect block 
-        uint indirect = dip->addrs[NDIRECT];
-        if (indirect != 0)
+        // Check 10 inside the subtree
+        if (inum < sb->ninodes) note_read(IBLOCK(inum));
+        if (inum >= sb->ninodes || inode_table[inum].type == T_UNALLOC)
         {
-            // Check 2: Indirect block address must be valid
-            if (!is_valid_data_block(indirect))
-            {
-                fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-                goto cleanup;
-            }
-            
-            // Check 5: Indirect block must be marked in bitmap
-            if (!is_bit_set_in_bitmap(indirect))
-            {
-                fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                goto cleanup;
-            }
-            
-            // Check 8: Indirect block itself shouldn't be shared
-            if (block_usage[indirect] > 0)
-            {
-                fprintf(stderr, "ERROR: indirect address used more than once.\n");
-                goto cleanup;
-            }
-            block_usage[indirect]++;
-            
-            // Check all the blocks pointed to by the indirect block
-            uint *indirect_addrs = get_indirect_block(indirect);
-            for (int j = 0; j < NINDIRECT; j++)
-            {
-                uint block = indirect_addrs[j];
-                if (block == 0) continue;
-                
-                // Check 2: Each indirect address must be valid
-                if (!is_valid_data_block(block))
-                {
-                    fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-                    goto cleanup;
-                }
-                
-                // Check 8: Each indirect address should only be used once
-                if (block_usage[block] > 0)
-                {
-                    fprintf(stderr, "ERROR: indirect address used more than once.\n");
-                    goto cleanup;
-                }
-                block_usage[block]++;
-                
-                // Check 5: Must be marked in bitmap
-                if (!is_bit_set_in_bitmap(block))
-                {
-                    fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
-                    goto cleanup;
-                }
-            }
+            if (bad_entry_dir == -1) bad_entry_dir = dir_inum;
+            continue;
         }
         
-        // Check 4: Verify directory formatting
-        if (dip->type == T_DIR)
+        // Check 12 inside the subtree, files may be hard linked
+        if (umap_get(&scope_inodes, inum))
         {
-            int dot_inum = -1, ddot_inum = -1;
-            
-            // Look for . and .. in direct blocks
-            for (int j = 0; j < NDIRECT && (dot_inum == -1 || ddot_inum == -1); j++)
-            {
-                if (dip->addrs[j] == 0) continue;
-                if (dot_inum == -1) dot_inum = find_dirent_in_block(dip->addrs[j], ".");
-                if (ddot_inum == -1) ddot_inum = find_dirent_in_block(dip->addrs[j], "..");
-            }
-            
-            // Check indirect blocks if both arent found yet
-            if (dip->addrs[NDIRECT] != 0 && (dot_inum == -1 || ddot_inum == -1))
-            {
-                uint *indirect_addrs = get_indirect_block(dip->addrs[NDIRECT]);
-                for (int j = 0; j < NINDIRECT && (dot_inum == -1 || ddot_inum == -1); j++)
-                {
-                    if (indirect_addrs[j] == 0) continue;
-                    if (dot_inum == -1) dot_inum = find_dirent_in_block(indirect_addrs[j], ".");
-                    if (ddot_inum == -1) ddot_inum = find_dirent_in_block(indirect_addrs[j], "..");
-                }
-            }
-            
-            // . must point to this directory, .. must exist and point to a valid directory
-            if (dot_inum != (int)i || ddot_inum == -1 || 
-                ddot_inum >= sb->ninodes || inode_table[ddot_inum].type != T_DIR)
-            {
-                fprintf(stderr, "ERROR: directory not properly formatted.\n");
-                goto cleanup;
-            }
+            if (inode_table[inum].type == T_DIR && scope_dup_dir == -1) scope_dup_dir = inum;
+            continue;
         }
+        
+        scope_add(inum, node, block_num * DPB + k);
     }
+}
+
+// Check only the inodes reachable from the directory at path (--path)
+// Hash sets replace the image-sized tracking arrays, so cost follows the subtree
+void check_subtree(const char *path)
+{
+    static char canon[4096];
+    size_t canon_len = 0;
+    uint inum = ROOTINO, slot = 0;
     
-    // Check 6: Verify bitmap consistency
-    // Any block marked in-use in the bitmap should actually be used by some inode
-    uint first_data = data_block_start;
-    uint last_data = data_block_start + sb->nblocks;
+    // Check 3 is cheap and every path resolves through the root
+    if (check_root_directory()) return;
     
-    for (uint block = first_data; block < last_data; block++)
+    // Resolve the path one component at a time from ROOTINO
+    for (const char *p = path; *p; )
     {
-        if (is_bit_set_in_bitmap(block) && block_usage[block] == 0)
+        if (*p == '/') { p++; continue; }
+        
+        size_t n = strcspn(p, "/");
+        char name[DIRSIZ + 1];
+        snprintf(name, sizeof(name), "%.*s", (int)(n < DIRSIZ ? n : DIRSIZ), p);
+        
+        int next = inode_table[inum].type == T_DIR ? dir_lookup(inum, name, &slot) : -1;
+        if (next <= 0 || next >= (int)sb->ninodes || canon_len + n + 2 > sizeof(canon))
         {
-            fprintf(stderr, "ERROR: bitmap marks block in use but it is not in use.\n");
-            goto cleanup;
+            fprintf(stderr, "path not found.\n");
+            exit(ERROR_CODE);
         }
+        canon_len += snprintf(canon + canon_len, sizeof(canon) - canon_len, "/%.*s", (int)n, p);
+        inum = next;
+        p += n;
     }
     
-    // Count all directory references, needed for checks 9, 11, and 12
-    count_directory_references();
+    scoped = true;
+    claim_set = &scope_blocks;
+    scope_path = canon;
+    scope_add(inum, 0, slot);
     
-    // Check 12: Directories should only appear in one parent directory
-    for (uint i = 0; i < sb->ninodes; i++)
+    // Breadth-first over the subtree, every inode is checked before its dirents are read
+    for (uint n = 0; n < scope_len; n++)
     {
-        if (inode_table[i].type == T_DIR)
+        uint cur = scope_nodes[n].inum;
+        struct dinode *dip = &inode_table[cur];
+        
+        if (check_inode(cur)) goto done;
+        if (dip->type != T_DIR) continue;
+        
+        int dot_inum = -1, ddot_inum = -1;
+        for (int j = 0; j < NDIRECT; j++)
         {
-            // Root is its own parent so skip it
-            if (i == ROOTINO) continue;
-            
-            // Each non-root directory should appear in exactly one parent
-            if (parent_count[i] > 1)
+            if (dip->addrs[j] == 0) continue;
+            scope_scan_dirent_block(n, dip->addrs[j], &dot_inum, &ddot_inum);
+        }
+        if (dip->addrs[NDIRECT] != 0)
+        {
+            uint buf[NINDIRECT];
+            const uint *indirect = get_indirect_block(dip->addrs[NDIRECT], buf);
+            for (int j = 0; j < NINDIRECT; j++)
             {
-                fprintf(stderr, "ERROR: directory appears more than once in file system.\n");
-                goto cleanup;
+                if (indirect[j] == 0) continue;
+                scope_scan_dirent_block(n, indirect[j], &dot_inum, &ddot_inum);
             }
         }
+        
+        // Check 4
+        if (dot_inum != (int)cur || ddot_inum == -1 || 
+            ddot_inum >= sb->ninodes || inode_table[ddot_inum].type != T_DIR)
+        {
+            report_inode_error("directory not properly formatted.", cur);
+            goto done;
+        }
     }
     
-    // Check 9: Every in-use inode must be referenced somewhere
-    for (uint i = 0; i < sb->ninodes; i++)
+    if (scope_dup_dir != -1)
     {
-        struct dinode *dip = &inode_table[i];
-        if (dip->type != T_UNALLOC && dir_ref_count[i] == 0)
-        {
-            fprintf(stderr, "ERROR: inode marked use but not found in a directory.\n");
-            goto cleanup;
-        }
+        report_inode_error("directory appears more than once in file system.", scope_dup_dir);
+        goto done;
     }
     
-    // Check 10: All directory entries must point to allocated inodes
-    if (check_directory_entry_validity()) goto cleanup;
+    if (bad_entry_dir != -1)
+    {
+        report_inode_error("inode referred to in directory but marked free.", bad_entry_dir);
+        goto done;
+    }
+    
+done:
+    // Whole-image invariants cannot be proven from one subtree
+    printf("SKIPPED: check 6 (bitmap marks block in use but it is not in use) needs the whole image.\n");
+    printf("SKIPPED: check 9 (inode marked use but not found in a directory) needs the whole image.\n");
+    printf("SKIPPED: check 11 (bad reference count for file) needs the whole image.\n");
+    printf("NOTE: checks 7, 8 and 12 only cover claims inside %s (%u inodes).\n", *canon ? canon : "/", scope_len);
+    
+    free(scope_nodes);
+    umap_free(&scope_inodes);
+    umap_free(&scope_blocks);
+}
+
+// splitmix64, a small seeded PRNG so sample runs are reproducible
+unsigned long long sample_next()
+{
+    unsigned long long z = (sample_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+double elapsed_ms(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Checks 4 and 10 on one sampled directory, reading its dirents and the inodes they name
+int sample_directory(uint inum)
+{
+    uint blocks[MAXFILE];
+    uint nblocks = dir_blocks(inum, blocks);
+    int dot_inum = -1, ddot_inum = -1;
+    
+    for (uint j = 0; j < nblocks; j++)
+    {
+        struct dirent buf[DPB];
+        const struct dirent *de = get_dirent_block(blocks[j], buf);
+        for (uint k = 0; k < DPB; k++)
+        {
+            if (de[k].inum == 0) continue;
+            local_counts.dirents++;
+            if (strncmp(de[k].name, ".", DIRSIZ) == 0 && dot_inum == -1) dot_inum = de[k].inum;
+            if (strncmp(de[k].name, "..", DIRSIZ) == 0 && ddot_inum == -1) ddot_inum = de[k].inum;
+            
+            if (de[k].inum < sb->ninodes) note_read(IBLOCK(de[k].inum));
+            if (de[k].inum >= sb->ninodes || inode_table[de[k].inum].type == T_UNALLOC)
+            {
+                report_inode_error("inode referred to in directory but marked free.", inum);
+                return 1;
+            }
+        }
+    }
+    
+    if (dot_inum != (int)inum || ddot_inum == -1 || inode_table[ddot_inum].type != T_DIR)
+    {
+        report_inode_error("directory not properly formatted.", inum);
+        return 1;
+    }
+    return 0;
+}
+
+// Local bitmap check on one sampled 32-bit word
+// Metadata blocks must be marked in use and bits past the end of the image must be clear.
+// Whether a data block is referenced needs every inode, so check 6 is not decided here.
+int sample_bitmap_word(uint word)
+{
+    for (uint bit = 0; bit < 32; bit++)
+    {
+        uint block = word * 32 + bit;
+        int used = is_bit_set_in_bitmap(block);
+        if (block < data_block_start && !used)
+        {
+            fprintf(stderr, "ERROR: bitmap marks metadata block free.\n  block %u\n", block);
+            count_failure("bitmap marks metadata block free.");
+            return 1;
+        }
+        if (block >= sb->size && BBLOCK(block, sb->ninodes) < data_block_start)
+        {
+            // is_bit_set_in_bitmap() stops at sb->size, read the trailing bits directly
+            uchar *bitmap = (uchar *)(addr + BBLOCK(block, sb->ninodes) * BLOCK_SIZE);
+            if ((bitmap[(block % BPB) / 8] >> (block % 8)) & 1)
+            {
+                fprintf(stderr, "ERROR: bitmap marks block past the end of the file system in use.\n  block %u\n", block);
+                count_failure("bitmap marks block past the end of the file system in use.");
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Print a failure rate with its 95% Wilson score interval
+void print_rate(const char *what, uint failed, uint total)
+{
+    if (total == 0)
+    {
+        printf("SAMPLE: no %s sampled\n", what);
+        return;
+    }
+    
+    double z = 1.96, n = total, p = failed / n;
+    double denom = 1 + z * z / n;
+    double center = (p + z * z / (2 * n)) / denom;
+    double half = z * sqrt(p * (1 - p) / n + z * z / (4 * n * n)) / denom;
+    double lo = center - half < 0 ? 0 : center - half;
+    double hi = center + half > 1 ? 1 : center + half;
+    printf("SAMPLE: %s corruption rate %.2f%% (95%% CI %.2f%%-%.2f%%, %u of %u failed)\n",
+           what, 100 * p, 100 * lo, 100 * hi, failed, total);
+}
+
+// Statistical health check (--sample): K random allocated inodes and K random bitmap words
+// Only the sampled blocks and the blocks they depend on are read.
+// Sampling stops early once budget_ms is spent, the estimate covers what was sampled.
+void check_sample(uint k, unsigned long long seed, uint budget_ms)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sample_state = seed;
+    claim_set = &sample_blocks;
+    
+    // Rejection-sample allocated inodes, with a cap so nearly empty images terminate
+    uint inodes = 0, inode_failures = 0;
+    for (uint tries = 0; inodes < k && tries < 64 * k; tries++)
+    {
+        if (budget_ms && elapsed_ms(&start) > budget_ms) break;
+        
+        uint inum = 1 + sample_next() % (sb->ninodes - 1);
+        note_read(IBLOCK(inum));
+        if (inode_table[inum].type == T_UNALLOC) continue;
+        inodes++;
+        
+        // Duplicate claims are only visible within the sampled inode
+        umap_clear(&sample_blocks);
+        if (check_inode(inum) || (inode_table[inum].type == T_DIR && sample_directory(inum)))
+        {
+            inode_failures++;
+        }
+    }
+    
+    // Bitmap words covering the whole image
+    uint nwords = (sb->size + 31) / 32;
+    uint words = 0, word_failures = 0;
+    for (; words < k; words++)
+    {
+        if (budget_ms && elapsed_ms(&start) > budget_ms) break;
+        if (sample_bitmap_word(sample_next() % nwords)) word_failures++;
+    }
+    
+    printf("SAMPLE: seed %llu, %.1f ms\n", seed, elapsed_ms(&start));
+    print_rate("inode", inode_failures, inodes);
+    print_rate("bitmap word", word_failures, words);
+    printf("SKIPPED: checks 3, 6, 9, 11 and 12 need the whole image.\n");
+    
+    umap_free(&sample_blocks);
+}
+
+// Fold the calling thread's counters into the totals, once as the thread finishes
+void merge_counts()
+{
+    pthread_mutex_lock(&counts_lock);
+    total_counts.inodes += local_counts.inodes;
+    total_counts.blocks += local_counts.blocks;
+    total_counts.dirents += local_counts.dirents;
+    pthread_mutex_unlock(&counts_lock);
+    memset(&local_counts, 0, sizeof(local_counts));
+}
+
+// Count a reported failure against the check that reports msg
+void count_failure(const char *msg)
+{
+    for (uint c = 0; c < sizeof(check_ids) / sizeof(check_ids[0]); c++)
+    {
+        if (strcmp(check_ids[c].msg, msg) == 0)
+        {
+            if (failures == 0)
+            {
+                first_failure = check_ids[c].check;
+                first_failure_msg = msg;
+            }
+            check_failures[check_ids[c].check]++;
+            failures++;
+            return;
+        }
+    }
+}
+
+void phase_begin(int phase)
+{
+    clock_gettime(CLOCK_MONOTONIC, &phase_start[phase]);
+}
+
+void phase_end(int phase)
+{
+    phase_seconds[phase] = elapsed_ms(&phase_start[phase]) / 1e3;
+    phase_ran[phase] = true;
+}
+
+// Value a metric already had in the previous file, so counters accumulate across runs
+double previous_metric(const char *key)
+{
+    for (uint i = 0; i < nprevious; i++)
+    {
+        if (strcmp(previous[i].key, key) == 0) return previous[i].value;
+    }
+    return 0;
+}
+
+void emit_metric(FILE *f, const char *key, double value)
+{
+    fprintf(f, "%s %.15g\n", key, value + previous_metric(key));
+}
+
+// Write the run's metrics in text exposition format, adding to the counters and
+// histograms already in the file. checks_run lists the checks the mode performs
+void write_metrics(const char *path, unsigned checks_run)
+{
+    char key[128], tmp[4096];
+    
+    // Load the previous samples
+    FILE *f = fopen(path, "r");
+    if (f)
+    {
+        char line[256];
+        while (fgets(line, sizeof(line), f) && nprevious < MAX_METRICS)
+        {
+            char *space = strrchr(line, ' ');
+            if (line[0] == '#' || !space || space - line >= (int)sizeof(previous[0].key)) continue;
+            snprintf(previous[nprevious].key, sizeof(previous[0].key), "%.*s", (int)(space - line), line);
+            previous[nprevious++].value = strtod(space + 1, NULL);
+        }
+        fclose(f);
+    }
+    
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(f = fopen(tmp, "w")))
+    {
+        perror("metrics");
+        return;
+    }
+    
+    fprintf(f, "# HELP fcheck_runs_total Images checked.\n# TYPE fcheck_runs_total counter\n");
+    emit_metric(f, "fcheck_runs_total", 1);
+    fprintf(f, "# HELP fcheck_failed_runs_total Images with at least one failed check.\n");
+    fprintf(f, "# TYPE fcheck_failed_runs_total counter\n");
+    emit_metric(f, "fcheck_failed_runs_total", failures > 0);
+    
+    // A clean run passes every check its mode performs, a failed one those that finished before it stopped
+    unsigned passed = checks_run & (failures == 0 ? ~0u : checks_passed);
+    fprintf(f, "# HELP fcheck_check_total Check outcomes by check number.\n# TYPE fcheck_check_total counter\n");
+    for (uint c = 0; c < NCHECKS; c++)
+    {
+        snprintf(key, sizeof(key), "fcheck_check_total{check=\"%s\",result=\"pass\"}", check_labels[c]);
+        emit_metric(f, key, passed >> c & 1);
+        snprintf(key, sizeof(key), "fcheck_check_total{check=\"%s\",result=\"fail\"}", check_labels[c]);
+        emit_metric(f, key, check_failures[c]);
+    }
+    
+    fprintf(f, "# HELP fcheck_phase_seconds Wall time per check phase.\n# TYPE fcheck_phase_seconds histogram\n");
+    for (int p = 0; p < NPHASES; p++)
+    {
+        for (uint b = 0; b <= sizeof(phase_buckets) / sizeof(phase_buckets[0]); b++)
+        {
+            bool inf = b == sizeof(phase_buckets) / sizeof(phase_buckets[0]);
+            if (inf) snprintf(key, sizeof(key), "fcheck_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"}", phase_names[p]);
+            else snprintf(key, sizeof(key), "fcheck_phase_seconds_bucket{phase=\"%s\",le=\"%g\"}", phase_names[p], phase_buckets[b]);
+            emit_metric(f, key, phase_ran[p] && (inf || phase_seconds[p] <= phase_buckets[b]));
+        }
+        snprintf(key, sizeof(key), "fcheck_phase_seconds_sum{phase=\"%s\"}", phase_names[p]);
+        emit_metric(f, key, phase_ran[p] ? phase_seconds[p] : 0);
+        snprintf(key, sizeof(key), "fcheck_phase_seconds_count{phase=\"%s\"}", phase_names[p]);
+        emit_metric(f, key, phase_ran[p]);
+    }
+    
+    fprintf(f, "# HELP fcheck_inodes_processed_total Inodes checked.\n# TYPE fcheck_inodes_processed_total counter\n");
+    emit_metric(f, "fcheck_inodes_processed_total", total_counts.inodes);
+    fprintf(f, "# HELP fcheck_blocks_processed_total Block claims recorded.\n# TYPE fcheck_blocks_processed_total counter\n");
+    emit_metric(f, "fcheck_blocks_processed_total", total_counts.blocks);
+    fprintf(f, "# HELP fcheck_dirents_processed_total Directory entries decoded.\n# TYPE fcheck_dirents_processed_total counter\n");
+    emit_metric(f, "fcheck_dirents_processed_total", total_counts.dirents);
+    
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+    {
+        perror("metrics");
+        unlink(tmp);
+    }
+}
+
+// Checkpoint file layout: this header, then the block-usage bitset, then the
+// per-inode dir_ref_count, parent_count, path_parent and path_slot arrays
+struct checkpoint_header
+{
+    char magic[4];             // "FCK2"
+    uint size;                 // Superblock fields and image identity, checked on resume
+    uint nblocks;
+    uint ninodes;
+    long long image_bytes;
+    long long image_mtime;
+    int check_level;           // The state saved depends on both, checked on resume
+    int engine;
+    uint next_inode;           // Inodes below this one have been checked
+    int bad_entry_dir;
+};
+
+// Write the main scan's progress to checkpoint_file, atomically via rename
+int write_checkpoint(uint next_inode)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_file);
+    
+    struct checkpoint_header hdr = { "FCK2", sb->size, sb->nblocks, sb->ninodes, image_bytes, image_mtime,
+                                     check_level, engine, next_inode, bad_entry_dir };
+    uint bitset_len = sb->size / 8 + 1;
+    uchar *bitset = calloc(bitset_len, 1);
+    FILE *f = fopen(tmp, "wb");
+    if (!bitset || !f)
+    {
+        free(bitset);
+        if (f) fclose(f);
+        return 1;
+    }
+    
+    for (uint b = 0; b < sb->size; b++)
+    {
+        if (block_usage[b]) bitset[b / 8] |= 1 << (b % 8);
+    }
+    
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+             fwrite(bitset, 1, bitset_len, f) == bitset_len &&
+             fwrite(dir_ref_count, sizeof(uint), sb->ninodes, f) == sb->ninodes &&
+             fwrite(parent_count, sizeof(uint), sb->ninodes, f) == sb->ninodes &&
+             fwrite(path_parent, sizeof(ushort), sb->ninodes, f) == sb->ninodes &&
+             fwrite(path_slot, sizeof(uint), sb->ninodes, f) == sb->ninodes &&
+             fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    free(bitset);
+    
+    if (!ok || rename(tmp, checkpoint_file) != 0)
+    {
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+// Restore progress from checkpoint_file
+// Returns the inode to continue from, 0 when there is no checkpoint yet
+uint load_checkpoint()
+{
+    struct checkpoint_header hdr;
+    FILE *f = fopen(checkpoint_file, "rb");
+    if (!f) return 0;
+    
+    uint bitset_len = sb->size / 8 + 1;
+    uchar *bitset = malloc(bitset_len);
+    int ok = bitset && fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+             memcmp(hdr.magic, "FCK2", 4) == 0 &&
+             hdr.size == sb->size && hdr.nblocks == sb->nblocks && hdr.ninodes == sb->ninodes &&
+             hdr.image_bytes == image_bytes && hdr.image_mtime == image_mtime &&
+             hdr.next_inode <= sb->ninodes &&
+             fread(bitset, 1, bitset_len, f) == bitset_len &&
+             fread(dir_ref_count, sizeof(uint), sb->ninodes, f) == sb->ninodes &&
+             fread(parent_count, sizeof(uint), sb->ninodes, f) == sb->ninodes &&
+             fread(path_parent, sizeof(ushort), sb->ninodes, f) == sb->ninodes &&
+             fread(path_slot, sizeof(uint), sb->ninodes, f) == sb->ninodes;
+    fclose(f);
+    
+    if (!ok)
+    {
+        fprintf(stderr, "checkpoint does not match image.\n");
+        exit(ERROR_CODE);
+    }
+    
+    // Lower levels leave blocks and references unrecorded, and a resumed run
+    // must reach the verdict the interrupted one would have
+    if (hdr.check_level != check_level || hdr.engine != engine)
+    {
+        fprintf(stderr, "checkpoint was taken with another --level or --engine.\n");
+        exit(ERROR_CODE);
+    }
+    
+    for (uint b = 0; b < sb->size; b++)
+    {
+        block_usage[b] = (bitset[b / 8] >> (b % 8)) & 1;
+    }
+    free(bitset);
+    bad_entry_dir = hdr.bad_entry_dir;
+    return hdr.next_inode;
+}
+
+// Called between inodes, writes a checkpoint only while the time spent writing
+// stays within checkpoint_pct percent of the time spent checking
+void maybe_checkpoint(uint next_inode)
+{
+    if (elapsed_ms(&checkpoint_last) * checkpoint_pct < checkpoint_cost_ms * 100) return;
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (write_checkpoint(next_inode) && !checkpoint_failed)
+    {
+        perror("checkpoint");
+        checkpoint_failed = true;
+    }
+    checkpoint_cost_ms = elapsed_ms(&start);
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint_last);
+}
+
+// Check 4 once a directory's dirents have been folded
+// . must point to this directory, .. must exist and point to a valid directory
+int check_dir_format(uint i, int dot_inum, int ddot_inum)
+{
+    if (dot_inum != (int)i || ddot_inum == -1 || 
+        ddot_inum >= sb->ninodes || inode_table[ddot_inum].type != T_DIR)
+    {
+        report_inode_error("directory not properly formatted.", i);
+        return 1;
+    }
+    return 0;
+}
+
+// Power-of-two histogram bucket of v: 0, 1, 2, 3-4, 5-8, ...
+uint bucket(unsigned long long v)
+{
+    return v <= 1 ? v : 65 - __builtin_clzll(v - 1);
+}
+
+// Fold one checked inode into the space analytics
+// claimed is how many blocks the check claimed for it, indirect blocks included,
+// so only inodes with a double-indirect block need a block read here
+void analyze_inode(uint inum, uint claimed)
+{
+    struct dinode *dip = &inode_table[inum];
+    if (dip->type != T_FILE && dip->type != T_DIR) return;
+    
+    uint direct = claimed, indirect = 0, map = 0;
+    uint dindirect = layout->dindirect ? dip->addrs[layout->ndirect + 1] : 0;
+    if (dip->addrs[layout->ndirect] || dindirect)
+    {
+        direct = 0;
+        for (uint j = 0; j < layout->ndirect; j++) direct += dip->addrs[j] != 0;
+        map = dip->addrs[layout->ndirect] != 0;
+        if (dindirect)
+        {
+            uint buf[MAX_BSIZE / sizeof(uint)];
+            const uint *level1 = image_block(dindirect, buf);
+            map++;
+            for (uint j = 0; j < layout->bsize / sizeof(uint); j++) map += level1[j] != 0;
+        }
+        indirect = claimed - direct - map;
+    }
+    
+    analysis.direct_blocks += direct;
+    analysis.indirect_blocks += indirect;
+    analysis.map_blocks += map;
+    if (map) analysis.indirect_files++;
+    if (dip->type != T_FILE) return;
+    
+    unsigned long long allocated = (unsigned long long)(direct + indirect) * layout->bsize;
+    unsigned long long slack = allocated > dip->size ? allocated - dip->size : 0;
+    analysis.files++;
+    analysis.size_hist[bucket(dip->size)]++;
+    analysis.allocated_bytes += allocated;
+    analysis.slack_bytes += slack;
+    analysis.slack_hist[bucket(slack)]++;
+}
+
+// Fold the entry count of one checked directory into the space analytics
+void analyze_directory(uint fanout)
+{
+    analysis.dirs++;
+    analysis.fanout_hist[bucket(fanout)]++;
+    if (fanout > analysis.max_fanout) analysis.max_fanout = fanout;
+}
+
+// Extend or close the current free run with nbits bits of a bitmap word, free holding 1 for free blocks
+void free_bits(unsigned long long free, uint nbits, uint *run)
+{
+    unsigned long long all = nbits == 64 ? ~0ULL : (1ULL << nbits) - 1;
+    free &= all;
+    
+    // Whole words of used or free blocks need no bit walk
+    if (free == all)
+    {
+        *run += nbits;
+        return;
+    }
+    while (nbits)
+    {
+        uint n;
+        if (free & 1)
+        {
+            n = __builtin_ctzll(~free);
+            *run += n;
+        }
+        else
+        {
+            n = free ? __builtin_ctzll(free) : 64;
+            if (n > nbits) n = nbits;
+            if (*run)
+            {
+                analysis.free_runs++;
+                analysis.run_hist[bucket(*run)]++;
+                analysis.free_blocks += *run;
+                if (*run > analysis.longest_run) analysis.longest_run = *run;
+                *run = 0;
+            }
+        }
+        free = n == 64 ? 0 : free >> n;
+        nbits -= n;
+    }
+}
+
+// Free-space fragmentation: runs of free blocks in the data region, a bitmap word at a time
+void analyze_free_space()
+{
+    uint bpb = layout->bsize * 8;
+    uint first = data_block_start, last = data_block_start + sb->nblocks;
+    uint run = 0;
+    
+    for (uint b = first; b < last;)
+    {
+        // 64-bit word holding b, the bitmap has one bit per block number
+        uint word_start = b & ~63u;
+        uint bitmap_block = bitmap_start + word_start / bpb;
+        unsigned long long word = 0;
+        if (bitmap_block < sb->size)
+        {
+            memcpy(&word, addr + (size_t)bitmap_block * layout->bsize + (word_start % bpb) / 8, sizeof(word));
+        }
+        
+        uint skip = b - word_start;
+        uint nbits = last - b < 64 - skip ? last - b : 64 - skip;
+        free_bits(~word >> skip, nbits, &run);
+        b += nbits;
+    }
+    free_bits(0, 1, &run);
+}
+
+// Depth of directory inum below the root, following the names the scan recorded
+uint dir_depth(uint inum, uchar *depth)
+{
+    uint chain[MAX_DEPTH + 1];
+    uint len = 0;
+    while (inum != ROOTINO && depth[inum] == 0 && len <= MAX_DEPTH)
+    {
+        chain[len++] = inum;
+        inum = path_parent[inum];
+    }
+    uint d = inum == ROOTINO ? 0 : depth[inum];
+    while (len) 
+    {
+        d = d < MAX_DEPTH ? d + 1 : MAX_DEPTH;
+        depth[chain[--len]] = d;
+    }
+    return d;
+}
+
+void print_histogram(const char *what, uint *hist, uint n)
+{
+    printf("ANALYZE: %s:", what);
+    for (uint k = 0; k < n; k++)
+    {
+        if (hist[k] == 0) continue;
+        if (k <= 1) printf(" %u=%u", k, hist[k]);
+        else if (k == 2) printf(" 2=%u", hist[k]);
+        else printf(" %llu-%llu=%u", (1ULL << (k - 2)) + 1, 1ULL << (k - 1), hist[k]);
+    }
+    printf("\n");
+}
+
+// Print the space analytics, after a clean full check
+void print_analysis()
+{
+    uchar *depth = calloc(sb->ninodes, 1);
+    if (!depth)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+    for (uint i = 0; i < sb->ninodes; i++)
+    {
+        if (inode_table[i].type == T_DIR) analysis.depth_hist[dir_depth(i, depth)]++;
+    }
+    free(depth);
+    analyze_free_space();
+    
+    unsigned long long data = analysis.direct_blocks + analysis.indirect_blocks;
+    printf("ANALYZE: files %u, directories %u\n", analysis.files, analysis.dirs);
+    print_histogram("file size bytes", analysis.size_hist, NBUCKETS);
+    printf("ANALYZE: data blocks %llu direct, %llu indirect (%.1f%%), %llu indirect blocks, %u inodes use them\n",
+           analysis.direct_blocks, analysis.indirect_blocks, data ? 100.0 * analysis.indirect_blocks / data : 0.0,
+           analysis.map_blocks, analysis.indirect_files);
+    printf("ANALYZE: slack %llu bytes (%.1f%% of %llu allocated)\n", analysis.slack_bytes,
+           analysis.allocated_bytes ? 100.0 * analysis.slack_bytes / analysis.allocated_bytes : 0.0,
+           analysis.allocated_bytes);
+    print_histogram("slack bytes per file", analysis.slack_hist, NBUCKETS);
+    print_histogram("directory fan-out", analysis.fanout_hist, NBUCKETS);
+    printf("ANALYZE: largest directory %u entries\n", analysis.max_fanout);
+    printf("ANALYZE: directory depth:");
+    for (uint d = 0; d <= MAX_DEPTH; d++)
+    {
+        if (analysis.depth_hist[d]) printf(" %u%s=%u", d, d == MAX_DEPTH ? "+" : "", analysis.depth_hist[d]);
+    }
+    printf("\n");
+    printf("ANALYZE: free %llu of %u data blocks in %u runs, longest %u\n", analysis.free_blocks, sb->nblocks,
+           analysis.free_runs, analysis.longest_run);
+    print_histogram("free run blocks", analysis.run_hist, NBUCKETS);
+}
+
+// Duplicate data detection (--dedup)
+// Data blocks of regular files are hashed in address order by several threads,
+// then grouped by content in a hash table. Equal hashes are confirmed with memcmp
+#define DEDUP_TOP 5            // Largest groups listed
+#define DEDUP_OWNERS 8         // Owners listed per block group
+#define HASH_P1 2654435761u
+#define HASH_P2 2246822519u
+typedef uint hash_lanes __attribute__((vector_size(32)));
+
+unsigned long long *block_hashes;   // Indexed from data_block_start, 0 for blocks not hashed
+uint *block_group;                  // Table slot of each hashed block
+
+struct dedup_slot
+{
+    unsigned long long hash;
+    uint block;                // First block with this content, 0 for an empty slot
+    uint copies;
+};
+struct dedup_slot *dedup_table;
+uint dedup_cap;
+
+struct dedup_file
+{
+    unsigned long long hash;
+    uint inum;
+    uint nblocks;              // Mapped data blocks
+    uint group;                // 1 + index of the group's first file, 0 while ungrouped
+};
+
+// Hash of one block, eight 32-bit lanes advanced together so the loop vectorizes
+// len must be a multiple of 32
+unsigned long long hash_block(const uchar *p, uint len)
+{
+    hash_lanes acc = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    for (uint off = 0; off < len; off += sizeof(acc))
+    {
+        hash_lanes in;
+        memcpy(&in, p + off, sizeof(in));
+        acc += in * HASH_P2;
+        acc = (acc << 13) | (acc >> 19);
+        acc *= HASH_P1;
+    }
+    
+    unsigned long long h = len;
+    for (int k = 0; k < 8; k++)
+    {
+        h = (h ^ acc[k]) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h | 1;
+}
+
+// Hash the file data blocks of one share of the data region
+void *hash_blocks(void *arg)
+{
+    uint share = (uint)(unsigned long)arg;
+    uint per = (sb->nblocks + shard_count - 1) / shard_count;
+    uint lo = share * per, hi = lo + per < sb->nblocks ? lo + per : sb->nblocks;
+    
+    for (uint k = lo; k < hi; k++)
+    {
+        uint owner = block_owner[data_block_start + k];
+        if (owner == 0 || inode_table[owner].type != T_FILE) continue;
+        uint buf[MAX_BSIZE / sizeof(uint)];
+        block_hashes[k] = hash_block(image_block(data_block_start + k, buf), layout->bsize);
+    }
+    return NULL;
+}
+
+// Table slot for the content of block, added with no copies if new
+uint dedup_slot(uint block, unsigned long long hash)
+{
+    uint h = (uint)hash & (dedup_cap - 1);
+    uint buf_a[MAX_BSIZE / sizeof(uint)], buf_b[MAX_BSIZE / sizeof(uint)];
+    for (; dedup_table[h].block != 0; h = (h + 1) & (dedup_cap - 1))
+    {
+        if (dedup_table[h].hash == hash &&
+            memcmp(image_block(dedup_table[h].block, buf_a), image_block(block, buf_b), layout->bsize) == 0) return h;
+    }
+    dedup_table[h].hash = hash;
+    dedup_table[h].block = block;
+    return h;
+}
+
+// Data blocks of a file in file order, unmapped addresses as 0
+// Returns the number of entries up to the last mapped one
+uint file_block_list(uint inum, uint *blocks)
+{
+    struct dinode *dip = &inode_table[inum];
+    uint nind = layout->bsize / sizeof(uint);
+    uint n = 0, len = 0;
+    
+    for (uint j = 0; j < layout->ndirect; j++)
+    {
+        blocks[n++] = dip->addrs[j];
+        if (dip->addrs[j]) len = n;
+    }
+    
+    // One indirect block, then with a double-indirect block the ones it maps
+    uint maps[1 + 1024 / sizeof(uint)] = { dip->addrs[layout->ndirect] };
+    uint nmaps = 1;
+    uint dindirect = layout->dindirect ? dip->addrs[layout->ndirect + 1] : 0;
+    if (dindirect)
+    {
+        uint buf[MAX_BSIZE / sizeof(uint)];
+        memcpy(&maps[1], image_block(dindirect, buf), layout->bsize);
+        nmaps += nind;
+    }
+    for (uint m = 0; m < nmaps; m++)
+    {
+        if (maps[m] == 0)
+        {
+            memset(&blocks[n], 0, nind * sizeof(uint));
+            n += nind;
+            continue;
+        }
+        uint buf[MAX_BSIZE / sizeof(uint)];
+        const uint *indirect = image_block(maps[m], buf);
+        for (uint j = 0; j < nind; j++)
+        {
+            blocks[n++] = indirect[j];
+            if (indirect[j]) len = n;
+        }
+    }
+    return len;
+}
+
+// Whether two files map the same contents in the same order
+bool same_file_data(uint a, uint b, uint *blocks_a, uint *blocks_b)
+{
+    uint len = file_block_list(a, blocks_a);
+    if (len != file_block_list(b, blocks_b)) return false;
+    uint buf_a[MAX_BSIZE / sizeof(uint)], buf_b[MAX_BSIZE / sizeof(uint)];
+    for (uint j = 0; j < len; j++)
+    {
+        if ((blocks_a[j] == 0) != (blocks_b[j] == 0)) return false;
+        if (blocks_a[j] && memcmp(image_block(blocks_a[j], buf_a), image_block(blocks_b[j], buf_b),
+                                  layout->bsize) != 0) return false;
+    }
+    return true;
+}
+
+int compare_dedup_files(const void *a, const void *b)
+{
+    const struct dedup_file *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->inum < y->inum ? -1 : x->inum > y->inum;
+}
+
+// Name of an inode for a report line
+const char *owner_name(uint inum)
+{
+    static char name[32];
+    const char *path = report_paths ? inode_path(inum) : NULL;
+    if (path) return path;
+    snprintf(name, sizeof(name), "inode %u", inum);
+    return name;
+}
+
+// Duplicate whole files: same size and the same block contents in file order
+void find_duplicate_files()
+{
+    uint maxfile = layout->ndirect + layout->bsize / sizeof(uint) * (layout->dindirect ? 1 + layout->bsize / sizeof(uint) : 1);
+    struct dedup_file *files = malloc(sb->ninodes * sizeof(struct dedup_file));
+    uint *blocks_a = malloc(maxfile * sizeof(uint));
+    uint *blocks_b = malloc(maxfile * sizeof(uint));
+    if (!files || !blocks_a || !blocks_b)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+    
+    // Combine the block hashes in file order, files without data are left out
+    uint nfiles = 0;
+    for (uint i = 0; i < sb->ninodes; i++)
+    {
+        if (inode_table[i].type != T_FILE) continue;
+        uint len = file_block_list(i, blocks_a);
+        unsigned long long h = inode_table[i].size;
+        uint nblocks = 0;
+        for (uint j = 0; j < len; j++)
+        {
+            unsigned long long bh = blocks_a[j] ? block_hashes[blocks_a[j] - data_block_start] : 0;
+            h = (h ^ bh) * 0x9E3779B97F4A7C15ULL;
+            h ^= h >> 31;
+            nblocks += blocks_a[j] != 0;
+        }
+        if (nblocks) files[nfiles++] = (struct dedup_file){ h, i, nblocks };
+    }
+    qsort(files, nfiles, sizeof(struct dedup_file), compare_dedup_files);
+    
+    // Within each run of equal hashes, group files by confirmed content
+    // A group is listed through its first file
+    uint dup_files = 0, groups = 0;
+    unsigned long long saved = 0;
+    struct { uint first, copies; unsigned long long saved; } top[DEDUP_TOP] = { { 0 } };
+    for (uint r = 0; r < nfiles;)
+    {
+        uint end = r;
+        while (end < nfiles && files[end].hash == files[r].hash) end++;
+        for (uint a = r; a < end; a++)
+        {
+            if (files[a].group) continue;
+            uint copies = 1;
+            for (uint b = a + 1; b < end; b++)
+            {
+                if (files[b].group || inode_table[files[b].inum].size != inode_table[files[a].inum].size ||
+                    !same_file_data(files[a].inum, files[b].inum, blocks_a, blocks_b)) continue;
+                files[b].group = a + 1;
+                copies++;
+            }
+            if (copies == 1) continue;
+            
+            unsigned long long group_saved = (unsigned long long)(copies - 1) * files[a].nblocks * layout->bsize;
+            dup_files += copies - 1;
+            groups++;
+            saved += group_saved;
+            for (uint t = 0; t < DEDUP_TOP; t++)
+            {
+                if (group_saved <= top[t].saved) continue;
+                memmove(&top[t + 1], &top[t], (DEDUP_TOP - 1 - t) * sizeof(top[0]));
+                top[t].first = a;
+                top[t].copies = copies;
+                top[t].saved = group_saved;
+                break;
+            }
+        }
+        r = end;
+    }
+    
+    printf("DEDUP: %u duplicate files in %u groups, whole-file dedup saves %llu bytes\n", dup_files, groups, saved);
+    for (uint t = 0; t < DEDUP_TOP && top[t].copies; t++)
+    {
+        uint a = top[t].first;
+        printf("DEDUP: file of %u bytes x%u: %s", inode_table[files[a].inum].size, top[t].copies,
+               owner_name(files[a].inum));
+        uint listed = 1;
+        for (uint b = a + 1; b < nfiles && files[b].hash == files[a].hash; b++)
+        {
+            if (files[b].group != a + 1) continue;
+            if (listed++ == DEDUP_OWNERS)
+            {
+                printf(" ...");
+                break;
+            }
+            printf(" %s", owner_name(files[b].inum));
+        }
+        printf("\n");
+    }
+    free(files);
+    free(blocks_a);
+    free(blocks_b);
+}
+
+// Hash every file data block, report duplicate blocks and files, after a clean full check
+void print_dedup()
+{
+    block_hashes = calloc(sb->nblocks, sizeof(unsigned long long));
+    block_group = malloc(sb->nblocks * sizeof(uint));
+    if (!block_hashes || !block_group)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+    
+    pthread_t threads[64];
+    for (uint t = 0; t < shard_count; t++)
+    {
+        pthread_create(&threads[t], NULL, hash_blocks, (void *)(unsigned long)t);
+    }
+    for (uint t = 0; t < shard_count; t++) pthread_join(threads[t], NULL);
+    
+    uint hashed = 0;
+    for (uint k = 0; k < sb->nblocks; k++) hashed += block_hashes[k] != 0;
+    dedup_cap = 64;
+    while (dedup_cap < 2 * hashed) dedup_cap *= 2;
+    dedup_table = calloc(dedup_cap, sizeof(struct dedup_slot));
+    if (!dedup_table)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+    
+    // Group in address order, so the first block of each content is the one kept
+    unsigned long long dup_blocks = 0;
+    uint groups = 0;
+    for (uint k = 0; k < sb->nblocks; k++)
+    {
+        if (block_hashes[k] == 0) continue;
+        uint s = dedup_slot(data_block_start + k, block_hashes[k]);
+        block_group[k] = s;
+        if (dedup_table[s].copies == 1) groups++;
+        if (dedup_table[s].copies++ > 0) dup_blocks++;
+    }
+    
+    uint nfiles = 0;
+    for (uint i = 0; i < sb->ninodes; i++) nfiles += inode_table[i].type == T_FILE;
+    unsigned long long hashed_bytes = (unsigned long long)hashed * layout->bsize;
+    printf("DEDUP: hashed %u data blocks of %u files (%llu bytes) on %u threads\n", hashed, nfiles, hashed_bytes,
+           shard_count);
+    printf("DEDUP: %llu duplicate blocks in %u groups, block dedup saves %llu bytes (%.1f%%)\n", dup_blocks, groups,
+           dup_blocks * layout->bsize, hashed ? 100.0 * dup_blocks / hashed : 0.0);
+    
+    // Most copied contents, with the files holding them in address order
+    uint top[DEDUP_TOP] = { 0 };
+    uint ntop = 0;
+    for (uint s = 0; s < dedup_cap; s++)
+    {
+        if (dedup_table[s].copies < 2) continue;
+        uint t = ntop;
+        if (ntop < DEDUP_TOP) ntop++;
+        else if (dedup_table[top[DEDUP_TOP - 1]].copies >= dedup_table[s].copies) continue;
+        else t = DEDUP_TOP - 1;
+        for (; t > 0 && dedup_table[top[t - 1]].copies < dedup_table[s].copies; t--) top[t] = top[t - 1];
+        top[t] = s;
+    }
+    for (uint t = 0; t < ntop; t++)
+    {
+        struct dedup_slot *slot = &dedup_table[top[t]];
+        printf("DEDUP: block %u x%u:", slot->block, slot->copies);
+        uint listed = 0, last = 0;
+        for (uint k = 0; k < sb->nblocks; k++)
+        {
+            uint owner = block_owner[data_block_start + k];
+            if (block_hashes[k] == 0 || block_group[k] != top[t] || owner == last) continue;
+            if (listed++ == DEDUP_OWNERS)
+            {
+                printf(" ...");
+                break;
+            }
+            printf(" %s", owner_name(owner));
+            last = owner;
+        }
+        printf("\n");
+    }
+    
+    find_duplicate_files();
+    free(block_hashes);
+    free(block_group);
+    free(dedup_table);
+}
+
+// Layout kernels. This tree's layout keeps the plain names, the other engines
+// and modes call those directly and only support it
+#define LAYOUT_FN(name) name
+#define L_BSIZE BSIZE
+#define L_NDIRECT NDIRECT
+#define L_DOUBLE 0
+#include "layout.h"
+
+// xv6-riscv: 1024-byte blocks
+#define LAYOUT_FN(name) name##_riscv
+#define L_BSIZE 1024
+#define L_NDIRECT 12
+#define L_DOUBLE 0
+#include "layout.h"
+
+// xv6-riscv with large files: 11 direct, one indirect and one double-indirect address
+#define LAYOUT_FN(name) name##_riscv_big
+#define L_BSIZE 1024
+#define L_NDIRECT 11
+#define L_DOUBLE 1
+#include "layout.h"
+
+#define LAYOUT_XV6 0
+#define LAYOUT_XV6_LOG 1
+#define LAYOUT_RISCV 2
+#define LAYOUT_RISCV_BIG 3
+#define NLAYOUTS 4
+struct layout layouts[NLAYOUTS] = {
+    { "xv6", BSIZE, NDIRECT, false, SB_PLAIN, check_root_directory, sequential_scan, bitmap_sweep },
+    { "xv6-log", BSIZE, NDIRECT, false, SB_LOG, check_root_directory, sequential_scan, bitmap_sweep },
+    { "xv6-riscv", 1024, 12, false, SB_MAGIC, check_root_directory_riscv, sequential_scan_riscv,
+      bitmap_sweep_riscv },
+    { "xv6-riscv-big", 1024, 11, true, SB_MAGIC, check_root_directory_riscv_big, sequential_scan_riscv_big,
+      bitmap_sweep_riscv_big },
+};
+
+// Pick the layout whose superblock is plausible
+// 1024-byte block images start the superblock with FSMAGIC, the logged
+// 512-byte layout puts the log right after the superblock
+struct layout *detect_layout(off_t image_size)
+{
+    if (image_size >= 2 * 1024 && *(uint *)(addr + 1024) == FSMAGIC) return &layouts[LAYOUT_RISCV];
+    
+    struct log_superblock *lsb = (struct log_superblock *)(addr + BSIZE);
+    if (image_size >= 2 * BSIZE && lsb->nlog != 0 && lsb->logstart == 2 &&
+        lsb->inodestart == 2 + lsb->nlog && lsb->bmapstart > lsb->inodestart)
+    {
+        return &layouts[LAYOUT_XV6_LOG];
+    }
+    return &layouts[LAYOUT_XV6];
+}
+
+// The xv6-riscv superblock does not say whether addrs[11] is the last direct
+// address or the indirect block. Let the files whose size tells the two apart vote:
+// between 13 and 268 blocks a plain inode uses addrs[12] and a large-file one does not
+bool looks_double_indirect()
+{
+    int votes = 0;
+    for (uint i = 0; i < sb->ninodes; i++)
+    {
+        struct dinode *dip = &inode_table[i];
+        if (dip->type != T_FILE && dip->type != T_DIR) continue;
+        
+        uint nblocks = dip->size / 1024 + (dip->size % 1024 != 0);
+        if (nblocks <= 12) continue;
+        if (nblocks > 12 + 256) votes++;
+        else if (dip->addrs[12] != 0) votes--;
+        else if (dip->addrs[11] != 0) votes++;
+    }
+    return votes > 0;
+}
+
+// Locate the superblock and derive the layout, sanity-checking the geometry
+// Every other access indexes the image through these values
+int load_superblock(off_t image_size)
+{
+    read_prefix(image_size < 2 * 1024 ? image_size : 2 * 1024);
+    layout = forced_layout ? forced_layout : detect_layout(image_size);
+    uint bsize = layout->bsize;
+    uint ipb = bsize / sizeof(struct dinode);
+    
+    if (image_size < 2 * bsize)
+    {
+        if (!quiet) fprintf(stderr, "ERROR: bad superblock.\n");
+        count_failure("bad superblock.");
+        return 1;
+    }
+    
+    sb = &sb_fields;
+    if (layout->sb_format == SB_PLAIN)
+    {
+        sb_fields = *(struct superblock *)(addr + 1 * bsize);
+        
+        // The inode table starts at block 2, the bitmap follows it
+        inode_start = IBLOCK((uint)0);
+        bitmap_start = BBLOCK(0, sb->ninodes);
+        uint num_bitmap_blocks = (sb->nblocks + BPB - 1) / BPB;  
+        data_block_start = bitmap_start + num_bitmap_blocks;
+    }
+    else
+    {
+        struct log_superblock *lsb = (struct log_superblock *)(addr + 1 * bsize + (layout->sb_format == SB_MAGIC ? 4 : 0));
+        sb_fields.size = lsb->size;
+        sb_fields.nblocks = lsb->nblocks;
+        sb_fields.ninodes = lsb->ninodes;
+        
+        // mkfs places the data blocks last, the bitmap has a bit for every block
+        inode_start = lsb->inodestart;
+        bitmap_start = lsb->bmapstart;
+        data_block_start = sb->size - sb->nblocks;
+    }
+    inode_table = (struct dinode *)(addr + (size_t)inode_start * bsize);
+    
+    // The inode table, bitmap and data region must all lie inside sb->size,
+    // and sb->size inside the image
+    if (sb->ninodes <= ROOTINO ||
+        sb->size > image_size / bsize ||
+        (unsigned long long)inode_start + (sb->ninodes - 1) / ipb >= sb->size ||
+        (unsigned long long)data_block_start + sb->nblocks > sb->size ||
+        (layout->sb_format != SB_PLAIN &&
+         (sb->nblocks > sb->size || inode_start < 2 ||
+          (unsigned long long)inode_start + (sb->ninodes - 1) / ipb >= bitmap_start ||
+          (unsigned long long)bitmap_start + (sb->size - 1) / (bsize * 8) >= data_block_start)))
+    {
+        if (!quiet) fprintf(stderr, "ERROR: bad superblock.\n");
+        count_failure("bad superblock.");
+        return 1;
+    }
+    
+    // The metadata ends with the data region or with the bitmap's last block, whichever is later
+    size_t metadata_end = (size_t)bitmap_start + (sb->size - 1) / (bsize * 8) + 1;
+    if (metadata_end < data_block_start) metadata_end = data_block_start;
+    read_prefix(metadata_end * bsize < (size_t)image_size ? metadata_end * bsize : (size_t)image_size);
+    
+    if (!forced_layout && layout == &layouts[LAYOUT_RISCV] && looks_double_indirect()) layout = &layouts[LAYOUT_RISCV_BIG];
+    return 0;
+}
+
+// Bounded lock-free single-producer/single-consumer ring
+// head is advanced only by the producer and tail only by the consumer
+struct ring *ring_new()
+{
+    struct ring *r = aligned_alloc(64, sizeof(struct ring));
+    if (!r)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return r;
+}
+
+// Next free slot, waiting while the ring is full. NULL once the pipeline is stopping
+struct pipe_item *ring_slot(struct ring *r)
+{
+    uint head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SIZE)
+    {
+        if (atomic_load_explicit(&pipe_stop, memory_order_relaxed)) return NULL;
+        sched_yield();
+    }
+    return &r->items[head % RING_SIZE];
+}
+
+// Publish the slot returned by ring_slot()
+void ring_push(struct ring *r)
+{
+    atomic_store_explicit(&r->head, atomic_load_explicit(&r->head, memory_order_relaxed) + 1, memory_order_release);
+}
+
+// Oldest unread item, waiting while the ring is empty. NULL once the pipeline is stopping
+struct pipe_item *ring_peek(struct ring *r)
+{
+    uint tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    while (atomic_load_explicit(&r->head, memory_order_acquire) == tail)
+    {
+        if (atomic_load_explicit(&pipe_stop, memory_order_relaxed)) return NULL;
+        sched_yield();
+    }
+    return &r->items[tail % RING_SIZE];
+}
+
+// Release the item returned by ring_peek()
+void ring_pop(struct ring *r)
+{
+    atomic_store_explicit(&r->tail, atomic_load_explicit(&r->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+// Pipeline stage 1: decode the inode table and pass on every inode that is not free
+// Invalid types are passed on too so stage 3 reports them in order
+void *pipe_decode_inodes(void *arg)
+{
+    uint first = *(uint *)arg;
+    struct pipe_item *out;
+    
+    for (uint i = first; i < sb->ninodes; i++)
+    {
+        if (inode_table[i].type == T_UNALLOC) continue;
+        if (!(out = ring_slot(inode_ring))) return NULL;
+        out->kind = PIPE_INODE;
+        out->inum = i;
+        ring_push(inode_ring);
+    }
+    
+    if (!(out = ring_slot(inode_ring))) return NULL;
+    out->kind = PIPE_END;
+    ring_push(inode_ring);
+    return NULL;
+}
+
+// Pipeline stage 2: read indirect blocks and parse dirent blocks of the decoded inodes
+// Goes through addr directly, the read accounting belongs to stage 3
+// Dirents are counted here, where they are decoded
+void *pipe_decode_blocks(void *arg)
+{
+    struct pipe_item *in, *out;
+    uint blocks[MAXFILE];
+    
+    while ((in = ring_peek(inode_ring)))
+    {
+        uint kind = in->kind, i = in->inum;
+        ring_pop(inode_ring);
+        
+        if (kind == PIPE_END)
+        {
+            if (!(out = ring_slot(block_ring))) goto done;
+            out->kind = PIPE_END;
+            ring_push(block_ring);
+            goto done;
+        }
+        
+        struct dinode *dip = &inode_table[i];
+        bool is_dir = dip->type == T_DIR && check_level >= 3;
+        uint nblocks = 0;
+        
+        // Collect the blocks stage 3 will look at, faulting in the indirect block on the way
+        for (int j = 0; is_dir && j < NDIRECT; j++)
+        {
+            if (dip->addrs[j] != 0 && is_valid_data_block(dip->addrs[j])) blocks[nblocks++] = dip->addrs[j];
+        }
+        uint indirect = dip->addrs[NDIRECT];
+        if (check_level >= 2 && indirect != 0 && is_valid_data_block(indirect))
+        {
+            uint buf[NINDIRECT];
+            const uint *indirect_addrs = image_data((size_t)indirect * BLOCK_SIZE, BLOCK_SIZE, buf);
+            pipe_sink += indirect_addrs[0];
+            for (int j = 0; is_dir && j < NINDIRECT; j++)
+            {
+                if (indirect_addrs[j] != 0 && is_valid_data_block(indirect_addrs[j])) blocks[nblocks++] = indirect_addrs[j];
+            }
+        }
+        
+        if (!(out = ring_slot(block_ring))) goto done;
+        out->kind = PIPE_INODE;
+        out->inum = i;
+        out->nblocks = nblocks;
+        ring_push(block_ring);
+        
+        for (uint j = 0; j < nblocks; j++)
+        {
+            struct dirent buf[DPB];
+            const struct dirent *de = image_data((size_t)blocks[j] * BLOCK_SIZE, BLOCK_SIZE, buf);
+            if (!(out = ring_slot(block_ring))) goto done;
+            out->kind = PIPE_DIRENTS;
+            out->inum = i;
+            out->block = blocks[j];
+            for (uint k = 0; k < DPB; k++)
+            {
+                out->ent_inum[k] = de[k].inum;
+                out->ent_kind[k] = de[k].inum ? dirent_kind(&de[k]) : 0;
+                local_counts.dirents += de[k].inum != 0;
+            }
+            ring_push(block_ring);
+        }
+    }
+done:
+    merge_counts();
+    return NULL;
+}
+
+// Pipeline stage 3, run on the calling thread: fold claims and dirents into the
+// block set and reference counters in inode order, reporting exactly what the
+// sequential engine would
+int pipeline_scan(uint first)
+{
+    pthread_t decode_inodes, decode_blocks;
+    int failed = 0;
+    uint last = first;
+    struct pipe_item *in;
+    
+    inode_ring = ring_new();
+    block_ring = ring_new();
+    atomic_store(&pipe_stop, 0);
+    pthread_create(&decode_inodes, NULL, pipe_decode_inodes, &first);
+    pthread_create(&decode_blocks, NULL, pipe_decode_blocks, NULL);
+    
+    while ((in = ring_peek(block_ring)) && in->kind != PIPE_END)
+    {
+        uint i = in->inum, nblocks = in->nblocks;
+        ring_pop(block_ring);
+        
+        // Free inodes never reach this stage, account for their inode blocks here
+        for (uint b = IBLOCK(last); b <= IBLOCK(i); b++) note_read(b);
+        if (checkpoint_file && i / 1024 != last / 1024) maybe_checkpoint(i);
+        last = i;
+        paths_scanned = i;
+        
+        if (check_inode(i))
+        {
+            failed = 1;
+            break;
+        }
+        if (inode_table[i].type != T_DIR || check_level < 3) continue;
+        
+        // Check 4 from the dirents stage 2 parsed
+        int dot_inum = -1, ddot_inum = -1;
+        for (uint j = 0; j < nblocks && (in = ring_peek(block_ring)); j++)
+        {
+            note_read(in->block);
+            for (uint k = 0; k < DPB; k++)
+            {
+                if (in->ent_kind[k] == 0) continue;
+                fold_dirent(i, in->ent_inum[k], in->block * DPB + k, in->ent_kind[k], &dot_inum, &ddot_inum, true);
+            }
+            ring_pop(block_ring);
+        }
+        paths_scanned = i + 1;
+        
+        if (check_dir_format(i, dot_inum, ddot_inum))
+        {
+            failed = 1;
+            break;
+        }
+    }
+    if (!failed)
+    {
+        for (uint b = IBLOCK(last); b < IBLOCK(sb->ninodes); b++) note_read(b);
+        if (sb->ninodes % IPB) note_read(IBLOCK(sb->ninodes));
+    }
+    
+    atomic_store(&pipe_stop, 1);
+    pthread_join(decode_inodes, NULL);
+    pthread_join(decode_blocks, NULL);
+    free(inode_ring);
+    free(block_ring);
+    return failed;
+}
+
+// Sharded prefetch, the baseline the pipeline is measured against: each thread
+// faults in the inode, indirect and dirent blocks of one range of inodes while
+// the sequential engine runs on the calling thread
+void *shard_prefetch(void *arg)
+{
+    uint shard = (uint)(unsigned long)arg;
+    uint per = (sb->ninodes + shard_count - 1) / shard_count;
+    uint lo = shard * per, hi = lo + per < sb->ninodes ? lo + per : sb->ninodes;
+    uint blocks[MAXFILE];
+    uint sum = 0;
+    
+    for (uint i = lo; i < hi && !atomic_load_explicit(&pipe_stop, memory_order_relaxed); i++)
+    {
+        struct dinode *dip = &inode_table[i];
+        if (dip->type != T_FILE && dip->type != T_DIR && dip->type != T_DEV) continue;
+        
+        uint indirect = dip->addrs[NDIRECT];
+        uint word;
+        if (indirect != 0 && is_valid_data_block(indirect))
+        {
+            sum += *(const uint *)image_data((size_t)indirect * BLOCK_SIZE, sizeof(uint), &word);
+        }
+        if (dip->type != T_DIR) continue;
+        
+        // dir_blocks() would touch the read accounting, so gather directly
+        uint nblocks = 0;
+        for (int j = 0; j < NDIRECT; j++)
+        {
+            if (dip->addrs[j] != 0 && is_valid_data_block(dip->addrs[j])) blocks[nblocks++] = dip->addrs[j];
+        }
+        for (uint j = 0; j < nblocks; j++)
+            sum += *(const uint *)image_data((size_t)blocks[j] * BLOCK_SIZE, sizeof(uint), &word);
+    }
+    pipe_sink += sum;
+    return NULL;
+}
+
+int sharded_scan(uint first)
+{
+    pthread_t threads[64];
+    
+    atomic_store(&pipe_stop, 0);
+    for (uint t = 0; t < shard_count; t++)
+    {
+        pthread_create(&threads[t], NULL, shard_prefetch, (void *)(unsigned long)t);
+    }
+    int failed = sequential_scan(first);
+    atomic_store(&pipe_stop, 1);
+    for (uint t = 0; t < shard_count; t++) pthread_join(threads[t], NULL);
+    return failed;
+}
+
+// Checks 12, 9, 10 and 11 from the counters the inode scan gathered
+// Returns 1 after reporting the first failure
+int check_references()
+{
+    // Check 12: Directories should only appear in one parent directory
+    for (uint i = 0; i < sb->ninodes; i++)
+    {
+        if (inode_table[i].type == T_DIR)
+        {
+            // Root is its own parent so skip it
+            if (i == ROOTINO) continue;
+            
+            // Each non-root directory should appear in exactly one parent
+            if (parent_count[i] > 1)
+            {
+                report_inode_error("directory appears more than once in file system.", i);
+                return 1;
+            }
+        }
+    }
+    checks_passed |= 1 << 12;
+    
+    // Check 9: Every in-use inode must be referenced somewhere
+    for (uint i = 0; i < sb->ninodes; i++)
+    {
+        struct dinode *dip = &inode_table[i];
+        if (dip->type != T_UNALLOC && dir_ref_count[i] == 0)
+        {
+            report_inode_error("inode marked use but not found in a directory.", i);
+            return 1;
+        }
+    }
+    checks_passed |= 1 << 9;
+    
+    // Check 10: All directory entries must point to allocated inodes
+    if (bad_entry_dir != -1)
+    {
+        report_inode_error("inode referred to in directory but marked free.", bad_entry_dir);
+        return 1;
+    }
+    checks_passed |= 1 << 10;
     
     // Check 11: File reference counts must match actual directory links
     for (uint i = 0; i < sb->ninodes; i++)
@@ -504,16 +2157,424 @@ int main(int argc, char *argv[])
         struct dinode *dip = &inode_table[i];
         if (dip->type == T_FILE && dip->nlink != dir_ref_count[i])
         {
-            fprintf(stderr, "ERROR: bad reference count for file.\n");
-            goto cleanup;
+            report_inode_error("bad reference count for file.", i);
+            return 1;
+        }
+    }
+    checks_passed |= 1 << 11;
+    
+    return 0;
+}
+
+// Full-image check, stops at the first failure
+// With resume set the main scan continues from checkpoint_file
+// Lower levels skip the checks that need indirect, bitmap or directory blocks
+void check_image(bool resume)
+{
+    // Check 3: Verify root directory exists and is properly set up
+    if (check_level >= 3 && layout->check_root_directory()) return;
+    checks_passed |= 1 << 3;
+    
+    uint first = resume ? load_checkpoint() : 0;
+    if (checkpoint_file) clock_gettime(CLOCK_MONOTONIC, &checkpoint_last);
+    
+    // Main loop: scan through all inodes and check for consistency
+    int failed;
+    phase_begin(PHASE_INODE_SCAN);
+    if (engine == ENGINE_PIPELINE) failed = pipeline_scan(first);
+    else if (engine == ENGINE_SHARDED) failed = sharded_scan(first);
+    else failed = layout->scan(first);
+    phase_end(PHASE_INODE_SCAN);
+    if (failed) return;
+    paths_scanned = sb->ninodes;
+    checks_passed |= 1 << 1 | 1 << 2 | 1 << 4 | 1 << 5 | 1 << 7 | 1 << 8;
+    
+    if (check_level < 2) return;
+    
+    // Check 6: Verify bitmap consistency
+    phase_begin(PHASE_BITMAP_SWEEP);
+    failed = layout->bitmap_sweep();
+    phase_end(PHASE_BITMAP_SWEEP);
+    if (failed) return;
+    checks_passed |= 1 << 6;
+    
+    // Directory semantics need level 3
+    if (check_level < 3) return;
+    
+    phase_begin(PHASE_REFERENCES);
+    check_references();
+    phase_end(PHASE_REFERENCES);
+}
+
+// Capacity of the tracking arrays fcheck_check_buffer keeps between calls
+uint buffer_blocks, buffer_inodes;
+
+// Grow one tracking array to hold n elements, keeping it on failure
+int grow_array(void **array, uint n, size_t elem)
+{
+    void *p = realloc(*array, (size_t)n * elem);
+    if (!p) return 1;
+    *array = p;
+    return 0;
+}
+
+int fcheck_check_buffer(const void *image, size_t len)
+{
+    addr = (char *)image;
+    quiet = true;
+    failures = 0;
+    checks_passed = 0;
+    first_failure_msg = NULL;
+    memset(check_failures, 0, sizeof(check_failures));
+    bad_entry_dir = -1;
+    paths_scanned = 0;
+    
+    int result = FCHECK_CLEAN;
+    if (load_superblock(len))
+    {
+        result = FCHECK_BAD_SUPERBLOCK;
+        goto done;
+    }
+    
+    if (sb->size > buffer_blocks)
+    {
+        if (grow_array((void **)&block_usage, sb->size, sizeof(uint)))
+        {
+            result = FCHECK_NO_MEMORY;
+            goto done;
+        }
+        buffer_blocks = sb->size;
+    }
+    if (sb->ninodes > buffer_inodes)
+    {
+        if (grow_array((void **)&dir_ref_count, sb->ninodes, sizeof(uint)) ||
+            grow_array((void **)&parent_count, sb->ninodes, sizeof(uint)) ||
+            grow_array((void **)&path_parent, sb->ninodes, sizeof(ushort)) ||
+            grow_array((void **)&path_slot, sb->ninodes, sizeof(uint)))
+        {
+            result = FCHECK_NO_MEMORY;
+            goto done;
+        }
+        buffer_inodes = sb->ninodes;
+    }
+    memset(block_usage, 0, sb->size * sizeof(uint));
+    memset(dir_ref_count, 0, sb->ninodes * sizeof(uint));
+    memset(parent_count, 0, sb->ninodes * sizeof(uint));
+    memset(path_parent, 0, sb->ninodes * sizeof(ushort));
+    memset(path_slot, 0, sb->ninodes * sizeof(uint));
+    
+    check_image(false);
+    if (failures) result = first_failure;
+done:
+    quiet = false;
+    return result;
+}
+
+const char *fcheck_last_error(void)
+{
+    return first_failure_msg;
+}
+
+int fcheck_geometry(const void *image, size_t len, struct fcheck_geometry *g)
+{
+    addr = (char *)image;
+    quiet = true;
+    int bad = load_superblock(len);
+    quiet = false;
+    if (bad) return FCHECK_BAD_SUPERBLOCK;
+    
+    g->layout = layout->name;
+    g->bsize = layout->bsize;
+    g->ndirect = layout->ndirect;
+    g->dindirect = layout->dindirect;
+    g->size = sb->size;
+    g->nblocks = sb->nblocks;
+    g->ninodes = sb->ninodes;
+    g->inode_start = inode_start;
+    g->bitmap_start = bitmap_start;
+    g->data_start = data_block_start;
+    return FCHECK_CLEAN;
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage: fcheck [--path=DIR | --level=1|2|3 | --sample=K [--seed=N] [--budget=MS]]\n"
+                    "              [--checkpoint=FILE [--checkpoint-overhead=PCT] [--resume]]\n"
+                    "              [--engine=sequential|pipeline|sharded [--threads=N]]\n"
+                    "              [--layout=auto|xv6|xv6-log|xv6-riscv|xv6-riscv-big]\n"
+                    "              [--cache=CHUNKS] [--prefetch=THREADS]\n"
+                    "              [--metrics=FILE] [--stats] [--analyze] [--dedup] <file_system_image>\n");
+    exit(ERROR_CODE);
+}
+
+#ifndef FCHECK_NO_MAIN
+int main(int argc, char *argv[])
+{
+    int fsfd;
+    struct stat statb;
+    
+    const char *subtree = NULL;
+    bool stats = false;
+    uint sample = 0;
+    unsigned long long seed = 1;
+    uint budget_ms = 0;
+    bool resume = false;
+    const char *metrics_file = NULL;
+    uint cache_chunks = 64;        // Decompressed chunks kept of a .xv6z image
+    uint prefetch = 0;
+    
+    static struct option long_options[] = {
+        { "path", required_argument, NULL, 'p' },
+        { "level", required_argument, NULL, 'l' },
+        { "stats", no_argument, NULL, 's' },
+        { "sample", required_argument, NULL, 'k' },
+        { "seed", required_argument, NULL, 'r' },
+        { "budget", required_argument, NULL, 'b' },
+        { "checkpoint", required_argument, NULL, 'c' },
+        { "checkpoint-overhead", required_argument, NULL, 'o' },
+        { "resume", no_argument, NULL, 'R' },
+        { "engine", required_argument, NULL, 'e' },
+        { "threads", required_argument, NULL, 't' },
+        { "metrics", required_argument, NULL, 'm' },
+        { "layout", required_argument, NULL, 'L' },
+        { "analyze", no_argument, NULL, 'a' },
+        { "dedup", no_argument, NULL, 'D' },
+        { "cache", required_argument, NULL, 'C' },
+        { "prefetch", required_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 }
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            subtree = optarg;
+            break;
+        case 'l':
+            check_level = atoi(optarg);
+            if (check_level < 1 || check_level > 3) usage();
+            break;
+        case 's':
+            stats = true;
+            break;
+        case 'a':
+            analyze = true;
+            break;
+        case 'D':
+            dedup = true;
+            break;
+        case 'k':
+            sample = strtoul(optarg, NULL, 10);
+            if (sample == 0) usage();
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            budget_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            checkpoint_file = optarg;
+            break;
+        case 'o':
+            checkpoint_pct = strtoul(optarg, NULL, 10);
+            if (checkpoint_pct == 0 || checkpoint_pct > 100) usage();
+            break;
+        case 'R':
+            resume = true;
+            break;
+        case 'e':
+            if (strcmp(optarg, "sequential") == 0) engine = ENGINE_SEQUENTIAL;
+            else if (strcmp(optarg, "pipeline") == 0) engine = ENGINE_PIPELINE;
+            else if (strcmp(optarg, "sharded") == 0) engine = ENGINE_SHARDED;
+            else usage();
+            break;
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case 'L':
+            for (int l = 0; l < NLAYOUTS; l++)
+            {
+                if (strcmp(optarg, layouts[l].name) == 0) forced_layout = &layouts[l];
+            }
+            if (!forced_layout && strcmp(optarg, "auto") != 0) usage();
+            break;
+        case 't':
+            shard_count = strtoul(optarg, NULL, 10);
+            if (shard_count == 0 || shard_count > 64) usage();
+            break;
+        case 'C':
+            cache_chunks = strtoul(optarg, NULL, 10);
+            if (cache_chunks == 0) usage();
+            break;
+        case 'P':
+            prefetch = strtoul(optarg, NULL, 10);
+            if (prefetch > 64) usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    
+    // Scoped mode needs the directory blocks to find the subtree, sampling picks its own checks
+    if (optind >= argc || (subtree && check_level != 3) || (sample && (subtree || check_level != 3))) usage();
+    
+    // Checkpoints cover the full scan only
+    if ((resume && !checkpoint_file) || (checkpoint_file && (subtree || sample))) usage();
+    
+    // Analytics and duplicate detection come from the sequential walk of a full level 3 check
+    if ((analyze || dedup) && (subtree || sample || resume || check_level != 3 || engine == ENGINE_PIPELINE)) usage();
+    report_paths = check_level == 3 && !sample;
+    
+    fsfd = open(argv[optind], O_RDONLY);
+    if (fsfd < 0)
+    {
+        fprintf(stderr, "image not found.\n");
+        exit(ERROR_CODE);
+    }
+    
+    if (fstat(fsfd, &statb) == -1)
+    {
+        perror("fstat");
+        exit(ERROR_CODE);
+    }
+    image_mtime = statb.st_mtime;
+    
+    // A .xv6z image is decompressed a chunk at a time as the check reads it,
+    // addr only receives its metadata, see image_data()
+    bool compressed = xv6z_detect(fsfd);
+    size_t len = statb.st_size;
+    if (compressed)
+    {
+        if (xv6z_open(fsfd, &len, cache_chunks, prefetch) != 0) exit(ERROR_CODE);
+        image_reader = xv6z_read;
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    else addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fsfd, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(1);
+    }
+    image_bytes = len;
+    
+    // Checks each mode performs, as bits indexed like check_labels
+    unsigned checks_run = 1;
+    if (subtree) checks_run |= 1 << 1 | 1 << 2 | 1 << 3 | 1 << 4 | 1 << 5 | 1 << 7 | 1 << 8 | 1 << 10 | 1 << 12;
+    else if (sample) checks_run |= 1 << 1 | 1 << 2 | 1 << 4 | 1 << 5 | 1 << 7 | 1 << 8 | 1 << 10 | 1 << 13;
+    else if (check_level == 1) checks_run |= 1 << 1 | 1 << 2;
+    else if (check_level == 2) checks_run |= 1 << 1 | 1 << 2 | 1 << 5 | 1 << 6 | 1 << 7 | 1 << 8;
+    else checks_run |= 0x1FFE;
+    
+    phase_begin(PHASE_TOTAL);
+    phase_begin(PHASE_SUPERBLOCK);
+    int bad_superblock = load_superblock(len);
+    phase_end(PHASE_SUPERBLOCK);
+    if (bad_superblock) goto done;
+    checks_passed |= 1;
+    
+    // The scoped, sampling, checkpointing and threaded modes only know this tree's layout,
+    // and paths are decoded with its block size
+    if (layout != &layouts[LAYOUT_XV6] &&
+        (subtree || sample || checkpoint_file || engine != ENGINE_SEQUENTIAL))
+    {
+        fprintf(stderr, "ERROR: --path, --sample, --checkpoint and --engine need the xv6 layout, not %s.\n",
+                layout->name);
+        exit(ERROR_CODE);
+    }
+    if (layout->bsize != BSIZE) report_paths = false;
+    
+    if (stats)
+    {
+        read_map = calloc(sb->size / 8 + 1, 1);
+        if (!read_map)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(ERROR_CODE);
         }
+        note_read(1);
+    }
+    
+    // Scoped and sampling modes never allocate the image-sized tracking arrays
+    if (subtree)
+    {
+        phase_begin(PHASE_SUBTREE);
+        check_subtree(subtree);
+        phase_end(PHASE_SUBTREE);
+        goto unmap;
+    }
+    if (sample)
+    {
+        phase_begin(PHASE_SAMPLE);
+        check_sample(sample, seed, budget_ms);
+        phase_end(PHASE_SAMPLE);
+        goto unmap;
+    }
+    
+    // Allocate tracking arrays
+    block_usage = calloc(sb->size, sizeof(uint));
+    dir_ref_count = calloc(sb->ninodes, sizeof(uint));
+    parent_count = calloc(sb->ninodes, sizeof(uint));
+    path_parent = calloc(sb->ninodes, sizeof(ushort));
+    path_slot = calloc(sb->ninodes, sizeof(uint));
+    
+    if (dedup) block_owner = calloc(sb->size, sizeof(uint));
+    
+    if (!block_usage || !dir_ref_count || !parent_count || !path_parent || !path_slot || (dedup && !block_owner))
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
     }
     
-cleanup:
+    check_image(resume);
+    
+    // The verdict is final, a later --resume must start over
+    if (checkpoint_file) unlink(checkpoint_file);
+    
+    // A failed check stops the walk early, so the figures would cover part of the image
+    if (analyze && failures) printf("ANALYZE: skipped, the image is not consistent\n");
+    else if (analyze) print_analysis();
+    if (dedup && failures) printf("DEDUP: skipped, the image is not consistent\n");
+    else if (dedup) print_dedup();
+    
     free(block_usage);
+    free(block_owner);
     free(dir_ref_count);
     free(parent_count);
-    munmap(addr, statb.st_size);
+    free(path_parent);
+    free(path_slot);
+    if (dir_path_memo)
+    {
+        for (uint i = 0; i < sb->ninodes; i++) free(dir_path_memo[i]);
+        free(dir_path_memo);
+    }
+unmap:
+    if (stats)
+    {
+        printf("STATS: level %d, read %u of %u blocks (%llu bytes)\n", check_level, blocks_read,
+               sb->size, (unsigned long long)blocks_read * layout->bsize);
+        free(read_map);
+    }
+    if (stats && compressed)
+    {
+        struct xv6z_stats z;
+        xv6z_stats(&z);
+        printf("CHUNKS: loaded %u of %u chunks (%u stored), read %llu of %llu compressed bytes, "
+               "%u hits, %u evicted, %u prefetched\n", z.loaded, z.nchunks, z.stored, z.bytes_read,
+               z.file_bytes, z.hits, z.evicted, z.prefetched);
+    }
+done:
+    phase_end(PHASE_TOTAL);
+    if (metrics_file)
+    {
+        merge_counts();
+        write_metrics(metrics_file, checks_run);
+    }
+    if (compressed) xv6z_close();
+    munmap(addr, len);
     close(fsfd);
     return 0;
 }
+#endif
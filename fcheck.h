@@ -0,0 +1,45 @@
+#ifndef _FCHECK_H_
+#define _FCHECK_H_
+
+#include <stddef.h>
+
+// In-memory interface to the checker.
+// Runs the full level 3 check on an image already in memory: no file I/O,
+// no exit(), nothing printed, and every block, inode and dirent access is
+// bounds-checked against len. The buffer is only read.
+//
+// Checker state is global, so calls must not overlap. Tracking arrays are
+// kept between calls and only grow, so after the first call on an image of
+// a given geometry no further memory is allocated.
+
+#define FCHECK_CLEAN 0            // No inconsistency found
+                                  // 1..12: number of the first failed check
+#define FCHECK_BAD_SUPERBLOCK 13  // Superblock geometry does not fit the image
+#define FCHECK_NO_MEMORY -1       // Tracking arrays could not be allocated
+
+int fcheck_check_buffer(const void *image, size_t len);
+
+// Message of the first failure of the last call, as the CLI prints it
+// after "ERROR: ", or NULL if the image was clean
+const char *fcheck_last_error(void);
+
+// Where everything lives in an image, as the checker derives it
+struct fcheck_geometry
+{
+    const char *layout;           // Layout name, as taken by --layout
+    unsigned bsize;               // Block size
+    unsigned ndirect;             // addrs[ndirect] is the indirect block
+    int dindirect;                // addrs[ndirect + 1] is a double-indirect block
+    unsigned size;                // Superblock fields
+    unsigned nblocks;
+    unsigned ninodes;
+    unsigned inode_start;         // First block of the inode table
+    unsigned bitmap_start;        // First bitmap block, the bitmap has one bit per block number
+    unsigned data_start;          // First data block
+};
+
+// Detect the layout of image and validate its superblock like the checker does
+// Returns FCHECK_CLEAN and fills g, or FCHECK_BAD_SUPERBLOCK
+int fcheck_geometry(const void *image, size_t len, struct fcheck_geometry *g);
+
+#endif //_FCHECK_H_
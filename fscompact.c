@@ -0,0 +1,421 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "types.h"
+#include "fs.h"
+#include "fcheck.h"
+
+// Offline compactor for xv6 images. Every allocated block is relocated so that:
+// - each inode's blocks are contiguous in the order readi() reads them, an
+//   indirect block right before the blocks it maps
+// - directory blocks come first, next to the inode table
+// - free space is one run at the end of the data region
+// With --shrink, size and nblocks are cut down to the blocks in use.
+//
+// The image must pass the full check. The compacted image is built in memory
+// and checked again. Only then is it written, as one planned batch: a pwrite
+// per run of changed blocks, sorted by address. The written image is read back
+// and checked a third time.
+//
+// Usage: fscompact [--shrink] [--dry-run] <image> [<out>]
+// Without <out> the image is rewritten in place.
+
+#define ERROR_CODE 1
+#define T_UNALLOC 0
+#define T_DIR 1
+#define FSMAGIC 0x10203040
+
+struct image
+{
+    char *addr;
+    size_t len;
+    struct fcheck_geometry g;
+};
+
+struct image src, dst;
+uint next_block;               // Next block handed out in dst
+uint moved;                    // Blocks whose number changed
+uint *order;                   // Scratch list of one inode's blocks in read order
+
+char *block_of(struct image *im, uint b)
+{
+    return im->addr + (size_t)b * im->g.bsize;
+}
+
+struct dinode *dinode_of(struct image *im, uint inum)
+{
+    uint ipb = im->g.bsize / sizeof(struct dinode);
+    return (struct dinode *)block_of(im, im->g.inode_start + inum / ipb) + inum % ipb;
+}
+
+void fail_check(const char *what, int verdict)
+{
+    if (verdict == FCHECK_NO_MEMORY) fprintf(stderr, "Memory allocation failed\n");
+    else fprintf(stderr, "ERROR: %s: %s\n", what, fcheck_last_error());
+    exit(ERROR_CODE);
+}
+
+// Blocks an inode holds, in the order readi() reaches them
+// Indirect blocks are listed before the blocks they map
+uint read_order(struct image *im, struct dinode *dip, uint *blocks)
+{
+    uint nindirect = im->g.bsize / sizeof(uint);
+    uint n = 0;
+
+    for (uint j = 0; j < im->g.ndirect; j++)
+    {
+        if (dip->addrs[j]) blocks[n++] = dip->addrs[j];
+    }
+
+    uint roots[2] = { dip->addrs[im->g.ndirect], im->g.dindirect ? dip->addrs[im->g.ndirect + 1] : 0 };
+    for (int level = 0; level < 2; level++)
+    {
+        if (roots[level] == 0) continue;
+        blocks[n++] = roots[level];
+
+        uint *entries = (uint *)block_of(im, roots[level]);
+        for (uint j = 0; j < nindirect; j++)
+        {
+            if (entries[j] == 0) continue;
+            blocks[n++] = entries[j];
+            if (level == 0) continue;
+
+            uint *leaf = (uint *)block_of(im, entries[j]);
+            for (uint k = 0; k < nindirect; k++)
+            {
+                if (leaf[k]) blocks[n++] = leaf[k];
+            }
+        }
+    }
+    return n;
+}
+
+// Print how scattered the inodes' blocks and the free space are
+// An extent is a run of consecutive block numbers in read order
+void report_fragmentation(const char *when, struct image *im)
+{
+    uint holders = 0, fragmented = 0, free_runs = 0, largest = 0, run = 0;
+    unsigned long long extents = 0, free_blocks = 0;
+
+    for (uint i = 0; i < im->g.ninodes; i++)
+    {
+        struct dinode *dip = dinode_of(im, i);
+        if (dip->type == T_UNALLOC) continue;
+        uint n = read_order(im, dip, order);
+        if (n == 0) continue;
+
+        uint e = 1;
+        for (uint k = 1; k < n; k++) e += order[k] != order[k - 1] + 1;
+        holders++;
+        extents += e;
+        fragmented += e > 1;
+    }
+
+    uint bpb = im->g.bsize * 8;
+    for (uint b = im->g.data_start; b <= im->g.size; b++)
+    {
+        bool used = b < im->g.size &&
+                    (block_of(im, im->g.bitmap_start + b / bpb)[b % bpb / 8] >> (b % 8) & 1);
+        if (!used && b < im->g.size)
+        {
+            run++;
+            continue;
+        }
+        if (run == 0) continue;
+        free_runs++;
+        free_blocks += run;
+        if (run > largest) largest = run;
+        run = 0;
+    }
+
+    printf("%s: %u inodes hold blocks, %u fragmented, %llu extents (%.2f per inode); "
+           "%llu free blocks in %u runs, largest %u; size %u\n",
+           when, holders, fragmented, extents, holders ? (double)extents / holders : 0.0,
+           free_blocks, free_runs, largest, im->g.size);
+}
+
+// Copy block b of the source to the next block of dst, returns its new number
+uint place(uint b)
+{
+    uint nb = next_block++;
+    memcpy(block_of(&dst, nb), block_of(&src, b), src.g.bsize);
+    moved += nb != b;
+    return nb;
+}
+
+// Place an indirect block followed by what it maps, rewriting its entries
+// At depth 1 the entries are themselves indirect blocks
+uint place_indirect(uint b, int depth)
+{
+    uint nb = place(b);
+    uint *entries = (uint *)block_of(&dst, nb);
+    for (uint j = 0; j < src.g.bsize / sizeof(uint); j++)
+    {
+        if (entries[j] == 0) continue;
+        entries[j] = depth ? place_indirect(entries[j], depth - 1) : place(entries[j]);
+    }
+    return nb;
+}
+
+void place_inode(uint inum)
+{
+    struct dinode *dip = dinode_of(&dst, inum);
+    for (uint j = 0; j < src.g.ndirect; j++)
+    {
+        if (dip->addrs[j]) dip->addrs[j] = place(dip->addrs[j]);
+    }
+    if (dip->addrs[src.g.ndirect]) dip->addrs[src.g.ndirect] = place_indirect(dip->addrs[src.g.ndirect], 0);
+    if (src.g.dindirect && dip->addrs[src.g.ndirect + 1])
+    {
+        dip->addrs[src.g.ndirect + 1] = place_indirect(dip->addrs[src.g.ndirect + 1], 1);
+    }
+}
+
+// Geometry of the compacted image. Without shrinking it is the source's
+// With shrinking the data region holds just the used blocks, except that
+// this tree's layout derives its bitmap length from nblocks, so nblocks may
+// keep some free blocks for the bitmap to cover every block number
+void plan_geometry(bool shrink, uint used)
+{
+    dst.g = src.g;
+    if (!shrink) return;
+
+    uint bpb = src.g.bsize * 8;
+    if (strcmp(src.g.layout, "xv6") != 0)
+    {
+        // Bitmap and data start are recorded in the superblock, only the tail goes
+        dst.g.nblocks = used;
+        dst.g.size = src.g.data_start + used;
+        return;
+    }
+
+    for (uint nbitmap = 1;; nbitmap++)
+    {
+        uint nblocks = used > (nbitmap - 1) * bpb ? used : (nbitmap - 1) * bpb + 1;
+        if ((nblocks + bpb - 1) / bpb != nbitmap) continue;
+        uint size = src.g.bitmap_start + nbitmap + nblocks;
+        if (size > nbitmap * bpb) continue;
+        dst.g.nblocks = nblocks;
+        dst.g.size = size;
+        dst.g.data_start = src.g.bitmap_start + nbitmap;
+        return;
+    }
+}
+
+// Build the compacted image in dst
+void compact(bool shrink)
+{
+    uint bpb = src.g.bsize * 8;
+    uint used = 0;
+    for (uint b = src.g.data_start; b < src.g.size; b++)
+    {
+        used += block_of(&src, src.g.bitmap_start + b / bpb)[b % bpb / 8] >> (b % 8) & 1;
+    }
+    plan_geometry(shrink, used);
+
+    dst.len = (size_t)dst.g.size * dst.g.bsize;
+    dst.addr = calloc(dst.len, 1);
+    if (!dst.addr)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+
+    // Boot block, superblock, log and inode table carry over, then the superblock is updated
+    memcpy(dst.addr, src.addr, (size_t)src.g.bitmap_start * src.g.bsize);
+    uint *fields = (uint *)block_of(&dst, 1);
+    if (fields[0] == FSMAGIC) fields++;
+    fields[0] = dst.g.size;
+    fields[1] = dst.g.nblocks;
+
+    // Directories first, so their blocks sit right after the inode table, then everything else
+    next_block = dst.g.data_start;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (uint i = 0; i < src.g.ninodes; i++)
+        {
+            short type = dinode_of(&src, i)->type;
+            if (type == T_UNALLOC || (type == T_DIR) != (pass == 0)) continue;
+            place_inode(i);
+        }
+    }
+
+    // Metadata and the placed blocks are in use, the rest is one free run
+    for (uint b = 0; b < next_block; b++)
+    {
+        block_of(&dst, dst.g.bitmap_start + b / bpb)[b % bpb / 8] |= 1 << (b % 8);
+    }
+}
+
+// Write dst over the blocks of fd that differ from the source, in runs
+// Every run is planned before the first write, while the source is intact
+void write_changes(int fd, bool in_place)
+{
+    uint nblocks = dst.g.size;
+    uint *runs = malloc((nblocks + 1) * sizeof(uint));
+    if (!runs)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+
+    uint nruns = 0;
+    for (uint b = 0; b < nblocks;)
+    {
+        bool same = in_place && (size_t)(b + 1) * src.g.bsize <= src.len &&
+                    memcmp(block_of(&src, b), block_of(&dst, b), dst.g.bsize) == 0;
+        if (same)
+        {
+            b++;
+            continue;
+        }
+        uint first = b;
+        while (b < nblocks && !(in_place && (size_t)(b + 1) * src.g.bsize <= src.len &&
+                                memcmp(block_of(&src, b), block_of(&dst, b), dst.g.bsize) == 0)) b++;
+        runs[nruns++] = first;
+        runs[nruns++] = b;
+    }
+
+    unsigned long long bytes = 0;
+    for (uint r = 0; r < nruns; r += 2)
+    {
+        size_t off = (size_t)runs[r] * dst.g.bsize, len = (size_t)(runs[r + 1] - runs[r]) * dst.g.bsize;
+        for (size_t done = 0; done < len;)
+        {
+            ssize_t n = pwrite(fd, dst.addr + off + done, len - done, off + done);
+            if (n <= 0)
+            {
+                perror("pwrite");
+                exit(ERROR_CODE);
+            }
+            done += n;
+        }
+        bytes += len;
+    }
+    printf("wrote %u runs, %llu bytes\n", nruns / 2, bytes);
+    free(runs);
+}
+
+int main(int argc, char *argv[])
+{
+    bool shrink = false, dry_run = false;
+    static struct option long_options[] = {
+        { "shrink", no_argument, NULL, 's' },
+        { "dry-run", no_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        if (opt == 's') shrink = true;
+        else if (opt == 'n') dry_run = true;
+        else optind = argc + 1;
+    }
+    if (optind >= argc || argc - optind > 2)
+    {
+        fprintf(stderr, "Usage: fscompact [--shrink] [--dry-run] <image> [<out>]\n");
+        exit(ERROR_CODE);
+    }
+    const char *path = argv[optind];
+    const char *out = argc - optind == 2 ? argv[optind + 1] : NULL;
+
+    int fd = open(path, dry_run || out ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+    {
+        fprintf(stderr, "image not found.\n");
+        exit(ERROR_CODE);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("fstat");
+        exit(ERROR_CODE);
+    }
+    src.len = st.st_size;
+    src.addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src.addr == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(ERROR_CODE);
+    }
+
+    // Relocation follows every address, so they must all be valid and claimed once
+    int verdict = fcheck_check_buffer(src.addr, src.len);
+    if (verdict != FCHECK_CLEAN) fail_check("image is not consistent", verdict);
+    fcheck_geometry(src.addr, src.len, &src.g);
+
+    uint nindirect = src.g.bsize / sizeof(uint);
+    order = malloc((src.g.ndirect + 1 + nindirect + (src.g.dindirect ? 1 + nindirect * (1 + nindirect) : 0)) *
+                   sizeof(uint));
+    if (!order)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+
+    report_fragmentation("before", &src);
+    compact(shrink);
+    verdict = fcheck_check_buffer(dst.addr, dst.len);
+    if (verdict != FCHECK_CLEAN) fail_check("compacted image fails the check", verdict);
+    fcheck_geometry(dst.addr, dst.len, &dst.g);
+    report_fragmentation("after", &dst);
+    printf("moved %u of %u blocks in use\n", moved, next_block - dst.g.data_start);
+    if (dry_run) return 0;
+
+    int out_fd = fd;
+    if (out)
+    {
+        out_fd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (out_fd < 0)
+        {
+            perror(out);
+            exit(ERROR_CODE);
+        }
+    }
+    write_changes(out_fd, !out);
+    munmap(src.addr, src.len);
+
+    // Shrinking drops the tail, growing never happens
+    if (!out && shrink && ftruncate(out_fd, dst.len) == -1)
+    {
+        perror("ftruncate");
+        exit(ERROR_CODE);
+    }
+    if (fsync(out_fd) == -1)
+    {
+        perror("fsync");
+        exit(ERROR_CODE);
+    }
+
+    // Read back what reached the file
+    if (fstat(out_fd, &st) == -1)
+    {
+        perror("fstat");
+        exit(ERROR_CODE);
+    }
+    char *written = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, out_fd, 0);
+    if (written == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(ERROR_CODE);
+    }
+    verdict = fcheck_check_buffer(written, st.st_size);
+    if (verdict != FCHECK_CLEAN) fail_check("written image fails the check", verdict);
+    printf("verified %s\n", out ? out : path);
+
+    munmap(written, st.st_size);
+    free(dst.addr);
+    free(order);
+    close(out_fd);
+    if (out) close(fd);
+    return 0;
+}
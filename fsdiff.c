@@ -0,0 +1,471 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "fs.h"
+#include "fcheck.h"
+
+// Metadata diff of two xv6 images: superblock, inodes, directory entries and bitmap.
+// A memcmp sweep over the inode table, bitmap, indirect and directory blocks finds what
+// changed, then only the changed dinodes and dirent blocks are decoded. File data blocks
+// are never read. Output is one change per line:
+//
+//   superblock FIELD OLD NEW
+//   inode INUM added|removed TYPE
+//   inode INUM type|major|minor|nlink|size OLD NEW
+//   inode INUM block +BLOCK|-BLOCK        Blocks the inode holds, indirect blocks included
+//   dirent DIR +NAME INUM | -NAME INUM | ~NAME OLD NEW
+//   bitmap +FIRST-LAST | -FIRST-LAST      Runs of blocks marked used or free
+
+#define ERROR_CODE 1
+#define T_UNALLOC 0
+#define T_DIR 1
+
+// One mapped image
+struct image
+{
+    char *addr;
+    off_t len;
+    struct fcheck_geometry g;
+};
+
+struct image old_img, new_img;
+uint changes;
+
+int map_image(const char *path, struct image *im)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "image not found.\n");
+        exit(ERROR_CODE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("fstat");
+        exit(ERROR_CODE);
+    }
+    im->len = st.st_size;
+    im->addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (im->addr == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(ERROR_CODE);
+    }
+
+    if (fcheck_geometry(im->addr, im->len, &im->g) != FCHECK_CLEAN)
+    {
+        fprintf(stderr, "ERROR: %s: bad superblock.\n", path);
+        exit(ERROR_CODE);
+    }
+    return 0;
+}
+
+char *block_of(struct image *im, uint b)
+{
+    return im->addr + (size_t)b * im->g.bsize;
+}
+
+struct dinode *dinode_of(struct image *im, uint inum)
+{
+    uint ipb = im->g.bsize / sizeof(struct dinode);
+    return (struct dinode *)block_of(im, im->g.inode_start + inum / ipb) + inum % ipb;
+}
+
+// Which blocks of an inode inode_blocks() lists
+#define BLOCKS_ALL 0
+#define BLOCKS_DATA 1
+#define BLOCKS_INDIRECT 2
+
+// Blocks held by an inode, addresses outside the image are kept but not followed
+uint *inode_blocks(struct image *im, struct dinode *dip, uint *n, int which)
+{
+    uint nindirect = im->g.bsize / sizeof(uint);
+    uint cap = im->g.ndirect + 1 + nindirect;
+    if (im->g.dindirect) cap += 1 + nindirect * (1 + nindirect);
+    uint *blocks = malloc(cap * sizeof(uint));
+    if (!blocks)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+
+    *n = 0;
+    for (uint j = 0; j < im->g.ndirect && which != BLOCKS_INDIRECT; j++)
+    {
+        if (dip->addrs[j]) blocks[(*n)++] = dip->addrs[j];
+    }
+
+    // Single indirect, then the double-indirect tree
+    uint roots[2] = { dip->addrs[im->g.ndirect], im->g.dindirect ? dip->addrs[im->g.ndirect + 1] : 0 };
+    for (int level = 0; level < 2; level++)
+    {
+        uint ind = roots[level];
+        if (ind == 0) continue;
+        if (which != BLOCKS_DATA) blocks[(*n)++] = ind;
+        if (ind >= im->g.size) continue;
+
+        uint *entries = (uint *)block_of(im, ind);
+        for (uint j = 0; j < nindirect; j++)
+        {
+            if (entries[j] == 0) continue;
+            if ((level == 0) != (which == BLOCKS_INDIRECT) || which == BLOCKS_ALL) blocks[(*n)++] = entries[j];
+            if (level == 0 || entries[j] >= im->g.size || which == BLOCKS_INDIRECT) continue;
+
+            uint *leaf = (uint *)block_of(im, entries[j]);
+            for (uint k = 0; k < nindirect; k++)
+            {
+                if (leaf[k]) blocks[(*n)++] = leaf[k];
+            }
+        }
+    }
+    return blocks;
+}
+
+int cmp_uint(const void *a, const void *b)
+{
+    uint x = *(const uint *)a, y = *(const uint *)b;
+    return (x > y) - (x < y);
+}
+
+// Report blocks one inode gained and lost
+void diff_blocks(uint inum, struct dinode *o, struct dinode *n)
+{
+    uint no, nn;
+    uint *ob = inode_blocks(&old_img, o, &no, BLOCKS_ALL);
+    uint *nb = inode_blocks(&new_img, n, &nn, BLOCKS_ALL);
+    qsort(ob, no, sizeof(uint), cmp_uint);
+    qsort(nb, nn, sizeof(uint), cmp_uint);
+
+    uint i = 0, j = 0;
+    while (i < no || j < nn)
+    {
+        if (j == nn || (i < no && ob[i] < nb[j]))
+        {
+            printf("inode %u block -%u\n", inum, ob[i++]);
+            changes++;
+        }
+        else if (i == no || nb[j] < ob[i])
+        {
+            printf("inode %u block +%u\n", inum, nb[j++]);
+            changes++;
+        }
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+    free(ob);
+    free(nb);
+}
+
+void diff_field(uint inum, const char *field, long o, long n)
+{
+    if (o == n) return;
+    printf("inode %u %s %ld %ld\n", inum, field, o, n);
+    changes++;
+}
+
+// Decode one dinode that differs between the images
+void diff_inode(uint inum)
+{
+    struct dinode *o = dinode_of(&old_img, inum);
+    struct dinode *n = dinode_of(&new_img, inum);
+
+    if (o->type == T_UNALLOC && n->type != T_UNALLOC)
+    {
+        printf("inode %u added %d\n", inum, n->type);
+        changes++;
+    }
+    else if (o->type != T_UNALLOC && n->type == T_UNALLOC)
+    {
+        printf("inode %u removed %d\n", inum, o->type);
+        changes++;
+    }
+    else
+    {
+        diff_field(inum, "type", o->type, n->type);
+    }
+    diff_field(inum, "major", o->major, n->major);
+    diff_field(inum, "minor", o->minor, n->minor);
+    diff_field(inum, "nlink", o->nlink, n->nlink);
+    diff_field(inum, "size", o->size, n->size);
+
+    // Indirect blocks are metadata, so an unchanged addrs[] may still map other blocks
+    diff_blocks(inum, o, n);
+}
+
+// Directory entries of one directory, sorted by name
+struct entry
+{
+    char name[DIRSIZ + 1];
+    uint inum;
+};
+
+int cmp_entry(const void *a, const void *b)
+{
+    return strcmp(((const struct entry *)a)->name, ((const struct entry *)b)->name);
+}
+
+struct entry *dir_entries(struct image *im, struct dinode *dip, uint *n)
+{
+    uint nblocks;
+    uint *blocks = inode_blocks(im, dip, &nblocks, BLOCKS_DATA);
+    uint dpb = im->g.bsize / sizeof(struct dirent);
+    struct entry *entries = malloc((size_t)nblocks * dpb * sizeof(struct entry) + 1);
+    if (!entries)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+
+    *n = 0;
+    for (uint j = 0; j < nblocks; j++)
+    {
+        uint b = blocks[j];
+        if (b < im->g.data_start || b >= im->g.size) continue;
+
+        struct dirent *de = (struct dirent *)block_of(im, b);
+        for (uint k = 0; k < dpb; k++)
+        {
+            if (de[k].inum == 0) continue;
+            memcpy(entries[*n].name, de[k].name, DIRSIZ);
+            entries[*n].name[DIRSIZ] = 0;
+            entries[*n].inum = de[k].inum;
+            (*n)++;
+        }
+    }
+    free(blocks);
+    qsort(entries, *n, sizeof(struct entry), cmp_entry);
+    return entries;
+}
+
+// Whether any metadata block of inode inum differs, its dinode being identical:
+// the indirect blocks, and for a directory its dirent blocks
+bool mapped_blocks_differ(uint inum)
+{
+    struct dinode *dip = dinode_of(&old_img, inum);
+    bool is_dir = dip->type == T_DIR;
+    if (!is_dir && dip->addrs[old_img.g.ndirect] == 0 &&
+        !(old_img.g.dindirect && dip->addrs[old_img.g.ndirect + 1] != 0))
+    {
+        return false;
+    }
+    
+    uint n;
+    uint *blocks = inode_blocks(&old_img, dip, &n, is_dir ? BLOCKS_ALL : BLOCKS_INDIRECT);
+    bool differ = false;
+    for (uint j = 0; j < n && !differ; j++)
+    {
+        if (blocks[j] >= old_img.g.size || blocks[j] >= new_img.g.size) continue;
+        differ = memcmp(block_of(&old_img, blocks[j]), block_of(&new_img, blocks[j]), old_img.g.bsize) != 0;
+    }
+    free(blocks);
+    return differ;
+}
+
+void diff_directory(uint inum)
+{
+    struct dinode *o = dinode_of(&old_img, inum);
+    struct dinode *n = dinode_of(&new_img, inum);
+    uint no = 0, nn = 0;
+    struct entry *oe = o->type == T_DIR ? dir_entries(&old_img, o, &no) : NULL;
+    struct entry *ne = n->type == T_DIR ? dir_entries(&new_img, n, &nn) : NULL;
+
+    uint i = 0, j = 0;
+    while (i < no || j < nn)
+    {
+        int c = i == no ? 1 : j == nn ? -1 : strcmp(oe[i].name, ne[j].name);
+        if (c < 0)
+        {
+            printf("dirent %u -%s %u\n", inum, oe[i].name, oe[i].inum);
+            i++;
+        }
+        else if (c > 0)
+        {
+            printf("dirent %u +%s %u\n", inum, ne[j].name, ne[j].inum);
+            j++;
+        }
+        else
+        {
+            if (oe[i].inum == ne[j].inum)
+            {
+                i++;
+                j++;
+                continue;
+            }
+            printf("dirent %u ~%s %u %u\n", inum, oe[i].name, oe[i].inum, ne[j].inum);
+            i++;
+            j++;
+        }
+        changes++;
+    }
+    free(oe);
+    free(ne);
+}
+
+// Sweep the inode tables a block at a time, then decode the dinodes of differing blocks
+void diff_inodes()
+{
+    uint ninodes = old_img.g.ninodes < new_img.g.ninodes ? old_img.g.ninodes : new_img.g.ninodes;
+    uint bsize = old_img.g.bsize;
+    uint ipb = bsize / sizeof(struct dinode);
+
+    for (uint first = 0; first < ninodes; first += ipb)
+    {
+        uint count = ninodes - first < ipb ? ninodes - first : ipb;
+        struct dinode *o = dinode_of(&old_img, first);
+        struct dinode *n = dinode_of(&new_img, first);
+        bool block_differs = memcmp(o, n, count * sizeof(struct dinode)) != 0;
+
+        for (uint k = 0; k < count; k++)
+        {
+            uint inum = first + k;
+            bool is_dir = o[k].type == T_DIR || n[k].type == T_DIR;
+            if (block_differs && memcmp(&o[k], &n[k], sizeof(struct dinode)) != 0)
+            {
+                diff_inode(inum);
+                if (is_dir) diff_directory(inum);
+            }
+            else if (o[k].type != T_UNALLOC && mapped_blocks_differ(inum))
+            {
+                // An inode can also change through its indirect or dirent blocks alone
+                diff_blocks(inum, &o[k], &n[k]);
+                if (is_dir) diff_directory(inum);
+            }
+        }
+    }
+
+    // Inodes only one image has
+    for (uint inum = ninodes; inum < new_img.g.ninodes; inum++)
+    {
+        if (dinode_of(&new_img, inum)->type == T_UNALLOC) continue;
+        printf("inode %u added %d\n", inum, dinode_of(&new_img, inum)->type);
+        changes++;
+    }
+    for (uint inum = ninodes; inum < old_img.g.ninodes; inum++)
+    {
+        if (dinode_of(&old_img, inum)->type == T_UNALLOC) continue;
+        printf("inode %u removed %d\n", inum, dinode_of(&old_img, inum)->type);
+        changes++;
+    }
+}
+
+// Word w of bitmap block bb, zero where the image has no such bitmap block
+unsigned long long bitmap_word(struct image *im, uint bb, uint w)
+{
+    uint blk = im->g.bitmap_start + bb;
+    if (blk >= im->g.data_start) return 0;
+    
+    unsigned long long word;
+    memcpy(&word, block_of(im, blk) + w * sizeof(word), sizeof(word));
+    return word;
+}
+
+void report_run(int used, uint first, uint last)
+{
+    printf("bitmap %c%u-%u\n", used ? '+' : '-', first, last);
+    changes++;
+}
+
+// Compare the bitmaps a block at a time, then a 64-bit word at a time inside
+// differing blocks, decoding only the differing words into runs
+void diff_bitmap()
+{
+    uint size = old_img.g.size > new_img.g.size ? old_img.g.size : new_img.g.size;
+    uint bpb = old_img.g.bsize * 8;
+    uint nbitmap = (size + bpb - 1) / bpb;
+
+    // Open run of changed bits: first block and whether it became used
+    int run_used = -1;
+    uint run_first = 0, run_last = 0;
+
+    for (uint bb = 0; bb < nbitmap; bb++)
+    {
+        uint ob = old_img.g.bitmap_start + bb, nb = new_img.g.bitmap_start + bb;
+        if (ob < old_img.g.data_start && nb < new_img.g.data_start &&
+            memcmp(block_of(&old_img, ob), block_of(&new_img, nb), old_img.g.bsize) == 0)
+        {
+            continue;
+        }
+
+        for (uint w = 0; w < bpb / 64; w++)
+        {
+            uint base = bb * bpb + w * 64;
+            if (base >= size) break;
+            unsigned long long nw = bitmap_word(&new_img, bb, w);
+            unsigned long long x = bitmap_word(&old_img, bb, w) ^ nw;
+            if (size - base < 64) x &= (1ULL << (size - base)) - 1;
+
+            while (x)
+            {
+                uint k = __builtin_ctzll(x);
+                uint b = base + k;
+                int used = (nw >> k) & 1;
+                if (run_used == used && run_last + 1 == b)
+                {
+                    run_last = b;
+                }
+                else
+                {
+                    if (run_used != -1) report_run(run_used, run_first, run_last);
+                    run_used = used;
+                    run_first = run_last = b;
+                }
+                x &= x - 1;
+            }
+        }
+    }
+    if (run_used != -1) report_run(run_used, run_first, run_last);
+}
+
+void diff_superblock()
+{
+    const char *fields[] = { "size", "nblocks", "ninodes", "inode_start", "bitmap_start", "data_start" };
+    uint o[] = { old_img.g.size, old_img.g.nblocks, old_img.g.ninodes,
+                 old_img.g.inode_start, old_img.g.bitmap_start, old_img.g.data_start };
+    uint n[] = { new_img.g.size, new_img.g.nblocks, new_img.g.ninodes,
+                 new_img.g.inode_start, new_img.g.bitmap_start, new_img.g.data_start };
+    for (int f = 0; f < 6; f++)
+    {
+        if (o[f] == n[f]) continue;
+        printf("superblock %s %u %u\n", fields[f], o[f], n[f]);
+        changes++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: fsdiff <old_image> <new_image>\n");
+        exit(ERROR_CODE);
+    }
+    map_image(argv[1], &old_img);
+    map_image(argv[2], &new_img);
+
+    if (strcmp(old_img.g.layout, new_img.g.layout) != 0)
+    {
+        fprintf(stderr, "ERROR: layouts differ (%s, %s).\n", old_img.g.layout, new_img.g.layout);
+        exit(ERROR_CODE);
+    }
+
+    diff_superblock();
+    diff_inodes();
+    diff_bitmap();
+
+    munmap(old_img.addr, old_img.len);
+    munmap(new_img.addr, new_img.len);
+    return 0;
+}
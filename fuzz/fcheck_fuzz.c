@@ -0,0 +1,228 @@
+// libFuzzer harness for fcheck_check_buffer
+//
+// Build with "make fuzz" (clang) and run on the test images:
+//   ./fcheck_fuzz -max_len=1048576 testcases/
+//
+// The custom mutator understands the image layout and edits dinode fields,
+// directory entries and bitmap bits in place, so most inputs get past the
+// superblock and exercise the later checks. One in eight mutations is left
+// to libFuzzer's generic byte mutator.
+//
+// "make fuzz-standalone" builds the same harness with gcc and a small driver
+// that loads seed images, applies the mutator in a loop and reports
+// executions per second, for hosts without libFuzzer.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../types.h"
+#include "../fs.h"
+#include "../fcheck.h"
+
+size_t LLVMFuzzerMutate(uint8_t *data, size_t size, size_t max_size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    fcheck_check_buffer(data, size);
+    return 0;
+}
+
+// splitmix64, the mutator keeps no state outside one call
+unsigned long long fuzz_next(unsigned long long *state)
+{
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Pick a block address, mostly inside the data region so claims, bitmap and
+// directory checks see it, sometimes a reserved block or garbage for check 2
+uint fuzz_block(unsigned long long *rng, struct superblock *sb, uint data_start)
+{
+    uint r = fuzz_next(rng) % 16;
+    if (r == 0) return 0;
+    if (r == 1) return fuzz_next(rng) % data_start;
+    if (r == 2) return (uint)fuzz_next(rng);
+    return data_start + fuzz_next(rng) % sb->nblocks;
+}
+
+// Pick an inode number, mostly valid, sometimes just past the table for check 10
+uint fuzz_inum(unsigned long long *rng, struct superblock *sb)
+{
+    if (fuzz_next(rng) % 16 == 0) return sb->ninodes + fuzz_next(rng) % 4;
+    return fuzz_next(rng) % sb->ninodes;
+}
+
+size_t LLVMFuzzerCustomMutator(uint8_t *data, size_t size, size_t max_size, unsigned int seed)
+{
+    unsigned long long rng = seed;
+    if (size < 2 * BSIZE || fuzz_next(&rng) % 8 == 0) return LLVMFuzzerMutate(data, size, max_size);
+
+    // Only structured edits when the geometry fits the buffer
+    struct superblock *sb = (struct superblock *)(data + BSIZE);
+    uint data_start = BBLOCK(0, sb->ninodes) + (sb->nblocks + BPB - 1) / BPB;
+    if (sb->ninodes <= ROOTINO || sb->nblocks == 0 || sb->size > size / BSIZE ||
+        IBLOCK(sb->ninodes - 1) >= sb->size || (unsigned long long)data_start + sb->nblocks > sb->size)
+    {
+        return LLVMFuzzerMutate(data, size, max_size);
+    }
+
+    struct dinode *inodes = (struct dinode *)(data + IBLOCK(0) * BSIZE);
+    uint edits = 1 + fuzz_next(&rng) % 3;
+    for (uint e = 0; e < edits; e++)
+    {
+        switch (fuzz_next(&rng) % 8)
+        {
+        case 0:
+        case 1:
+        {
+            // Block address of an allocated inode, direct or indirect slot
+            struct dinode *dip = &inodes[fuzz_inum(&rng, sb) % sb->ninodes];
+            dip->addrs[fuzz_next(&rng) % (NDIRECT + 1)] = fuzz_block(&rng, sb, data_start);
+            break;
+        }
+        case 2:
+        {
+            // Type, including invalid ones for check 1
+            struct dinode *dip = &inodes[fuzz_inum(&rng, sb) % sb->ninodes];
+            dip->type = fuzz_next(&rng) % 5;
+            break;
+        }
+        case 3:
+        {
+            // Link count and size
+            struct dinode *dip = &inodes[fuzz_inum(&rng, sb) % sb->ninodes];
+            uint r = fuzz_next(&rng);
+            if (r & 1) dip->nlink += (r & 2) ? 1 : -1;
+            else dip->size = fuzz_next(&rng) % (MAXFILE * BSIZE + 1);
+            break;
+        }
+        case 4:
+        case 5:
+        {
+            // Entry of a directory block: retarget it, or rename it to . or ..
+            struct dirent *de = (struct dirent *)(data + (size_t)(data_start + fuzz_next(&rng) % sb->nblocks) * BSIZE);
+            de += fuzz_next(&rng) % (BSIZE / sizeof(struct dirent));
+            uint r = fuzz_next(&rng) % 4;
+            if (r < 2) de->inum = fuzz_inum(&rng, sb);
+            else if (r == 2) de->inum = 0;
+            else
+            {
+                memset(de->name, 0, DIRSIZ);
+                strcpy(de->name, (fuzz_next(&rng) & 1) ? "." : "..");
+            }
+            break;
+        }
+        case 6:
+        {
+            // Bitmap bit of a data block
+            uint b = data_start + fuzz_next(&rng) % sb->nblocks;
+            data[(size_t)BBLOCK(b, sb->ninodes) * BSIZE + (b % BPB) / 8] ^= 1 << (b % 8);
+            break;
+        }
+        case 7:
+        {
+            // Copy one inode over another, which duplicates its blocks
+            uint from = fuzz_inum(&rng, sb) % sb->ninodes;
+            uint to = fuzz_inum(&rng, sb) % sb->ninodes;
+            inodes[to] = inodes[from];
+            break;
+        }
+        }
+    }
+    return size;
+}
+
+#ifdef FCHECK_FUZZ_STANDALONE
+
+// Stand-in for libFuzzer's byte mutator: flip a few random bits
+size_t LLVMFuzzerMutate(uint8_t *data, size_t size, size_t max_size)
+{
+    static unsigned long long rng = 1;
+    if (size == 0) return 0;
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned long long r = fuzz_next(&rng);
+        data[r % size] ^= 1 << (r >> 61);
+    }
+    return size;
+}
+
+#define MAX_SEEDS 64
+#define RESET_EVERY 32  // Mutations pile up on one copy, then the seed is restored
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: fcheck_fuzz EXECS IMAGE...\n");
+        exit(1);
+    }
+    unsigned long execs = strtoul(argv[1], NULL, 10);
+
+    uint8_t *seeds[MAX_SEEDS];
+    size_t sizes[MAX_SEEDS];
+    size_t max_size = 0;
+    int nseeds = 0;
+    for (int i = 2; i < argc && nseeds < MAX_SEEDS; i++)
+    {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) continue;
+        fseek(f, 0, SEEK_END);
+        long len = ftell(f);
+        rewind(f);
+        seeds[nseeds] = malloc(len);
+        if (!seeds[nseeds] || fread(seeds[nseeds], 1, len, f) != (size_t)len)
+        {
+            fprintf(stderr, "ERROR: cannot read %s\n", argv[i]);
+            exit(1);
+        }
+        fclose(f);
+        sizes[nseeds] = len;
+        if ((size_t)len > max_size) max_size = len;
+        nseeds++;
+    }
+    if (nseeds == 0)
+    {
+        fprintf(stderr, "ERROR: no seed images.\n");
+        exit(1);
+    }
+
+    uint8_t *buf = malloc(max_size);
+    if (!buf) exit(1);
+
+    unsigned long results[FCHECK_BAD_SUPERBLOCK + 2] = { 0 };
+    size_t size = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long n = 0; n < execs; n++)
+    {
+        if (n % RESET_EVERY == 0)
+        {
+            int s = (n / RESET_EVERY) % nseeds;
+            memcpy(buf, seeds[s], sizes[s]);
+            size = sizes[s];
+        }
+        size = LLVMFuzzerCustomMutator(buf, size, max_size, n);
+        int r = fcheck_check_buffer(buf, size);
+        results[r < 0 ? FCHECK_BAD_SUPERBLOCK + 1 : r]++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%lu execs in %.2f s, %.0f exec/s\n", execs, secs, execs / secs);
+    for (int r = 0; r <= FCHECK_BAD_SUPERBLOCK + 1; r++)
+    {
+        if (results[r]) printf("  result %d: %lu\n", r > FCHECK_BAD_SUPERBLOCK ? FCHECK_NO_MEMORY : r, results[r]);
+    }
+
+    free(buf);
+    for (int i = 0; i < nseeds; i++) free(seeds[i]);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+# Generate a clean xv6 file system image for benchmarking fcheck.
+#
+# Usage: gen_image.py OUT NINODES NDIRS FILES_PER_DIR BLOCKS_PER_FILE [LAYOUT [DEPTH]]
+#
+# The root holds NDIRS directories d0..dN, each holding FILES_PER_DIR files
+# f0..fN of BLOCKS_PER_FILE blocks. With DEPTH above 1 each dK is the top of a
+# chain of DEPTH nested directories s1, s2, ... and the files sit in the deepest. Blocks are handed out in creation order the
+# way mkfs does, and the geometry matches what fcheck derives from the superblock.
+#
+# LAYOUT is one of the on-disk variants fcheck understands:
+#   xv6            this tree: 512-byte blocks, size/nblocks/ninodes superblock (default)
+#   xv6-log        512-byte blocks, superblock with log, inode and bitmap starts
+#   xv6-riscv      1024-byte blocks, magic superblock with log, inode and bitmap starts
+#   xv6-riscv-big  xv6-riscv with 11 direct, one indirect and one double-indirect address
+import struct
+import sys
+
+LAYOUTS = {
+    # name: block size, direct addresses, double indirect, superblock format
+    'xv6': (512, 12, False, 'plain'),
+    'xv6-log': (512, 12, False, 'log'),
+    'xv6-riscv': (1024, 12, False, 'magic'),
+    'xv6-riscv-big': (1024, 11, True, 'magic'),
+}
+FSMAGIC = 0x10203040
+LOGSIZE = 30
+
+if len(sys.argv) not in (6, 7, 8) or (len(sys.argv) >= 7 and sys.argv[6] not in LAYOUTS):
+    sys.exit("Usage: gen_image.py OUT NINODES NDIRS FILES_PER_DIR BLOCKS_PER_FILE [%s [DEPTH]]" % "|".join(LAYOUTS))
+out = sys.argv[1]
+ninodes, ndirs, files_per_dir, blocks_per_file = map(int, sys.argv[2:6])
+BSIZE, NDIRECT, DOUBLE, SBFORMAT = LAYOUTS[sys.argv[6] if len(sys.argv) >= 7 else 'xv6']
+depth = int(sys.argv[7]) if len(sys.argv) == 8 else 1
+if depth < 1:
+    sys.exit("DEPTH must be at least 1")
+
+IPB = BSIZE // 64
+BPB = BSIZE * 8
+NINDIRECT = BSIZE // 4
+DPB = BSIZE // 16
+MAXFILE = NDIRECT + NINDIRECT + (NINDIRECT * NINDIRECT if DOUBLE else 0)
+
+
+def dir_blocks(entries):
+    return (entries + DPB - 1) // DPB
+
+
+nfiles = ndirs * files_per_dir
+if 2 + ndirs * depth + nfiles > ninodes or ninodes > 65536:
+    sys.exit("too many files for %d inodes" % ninodes)
+if dir_blocks(ndirs + 2) > MAXFILE or dir_blocks(files_per_dir + 2) > MAXFILE:
+    sys.exit("directory too large")
+if blocks_per_file > MAXFILE:
+    sys.exit("file too large")
+
+
+def with_indirect(nblocks):
+    """Data blocks plus the indirect blocks that map them"""
+    total = nblocks
+    if nblocks > NDIRECT:
+        total += 1
+    rest = nblocks - NDIRECT - NINDIRECT
+    if rest > 0:
+        total += 1 + (rest + NINDIRECT - 1) // NINDIRECT
+    return total
+
+
+data_needed = (with_indirect(dir_blocks(ndirs + 2)) + ndirs * with_indirect(dir_blocks(files_per_dir + 2))
+               + ndirs * (depth - 1) * with_indirect(dir_blocks(3)) + nfiles * with_indirect(blocks_per_file))
+
+if SBFORMAT == 'plain':
+    # fcheck places the data region after ceil(nblocks / BPB) bitmap blocks
+    inode_start = 2
+    bitmap_start = ninodes // IPB + 3
+    nbitmap = (data_needed + BPB - 1) // BPB
+    nblocks = max(data_needed, (nbitmap - 1) * BPB + 1)
+    size = bitmap_start + nbitmap + nblocks
+else:
+    # Like mkfs: log after the superblock, then inodes, then a bitmap covering every block
+    inode_start = 2 + LOGSIZE
+    bitmap_start = inode_start + ninodes // IPB + 1
+    nblocks = data_needed
+    nbitmap = 1
+    while (bitmap_start + nbitmap + nblocks) // BPB + 1 > nbitmap:
+        nbitmap += 1
+    size = bitmap_start + nbitmap + nblocks
+data_start = bitmap_start + nbitmap
+
+img = bytearray(size * BSIZE)
+if SBFORMAT == 'plain':
+    struct.pack_into("<III", img, BSIZE, size, nblocks, ninodes)
+elif SBFORMAT == 'log':
+    struct.pack_into("<7I", img, BSIZE, size, nblocks, ninodes, LOGSIZE, 2, inode_start, bitmap_start)
+else:
+    struct.pack_into("<8I", img, BSIZE, FSMAGIC, size, nblocks, ninodes, LOGSIZE, 2, inode_start, bitmap_start)
+next_block = data_start
+
+
+def balloc():
+    global next_block
+    b = next_block
+    next_block += 1
+    return b
+
+
+def windirect(blocks):
+    """Write an indirect block mapping blocks, returns its address"""
+    b = balloc()
+    struct.pack_into("<%dI" % len(blocks), img, b * BSIZE, *blocks)
+    return b
+
+
+def winode(inum, type, size, blocks):
+    addrs = blocks[:NDIRECT] + [0] * (NDIRECT - len(blocks[:NDIRECT]))
+    rest = blocks[NDIRECT:]
+    addrs.append(windirect(rest[:NINDIRECT]) if rest else 0)
+    if DOUBLE:
+        rest = rest[NINDIRECT:]
+        level1 = [windirect(rest[i:i + NINDIRECT]) for i in range(0, len(rest), NINDIRECT)]
+        addrs.append(windirect(level1) if level1 else 0)
+    struct.pack_into("<hhhhI13I", img, (inode_start + inum // IPB) * BSIZE + inum % IPB * 64,
+                     type, 0, 0, 1, size, *addrs)
+
+
+def wdir(inum, entries):
+    blocks = [balloc() for _ in range(dir_blocks(len(entries)))]
+    for i, (child, name) in enumerate(entries):
+        struct.pack_into("<H14s", img, blocks[i // DPB] * BSIZE + (i % DPB) * 16, child, name.encode())
+    winode(inum, 1, len(blocks) * BSIZE, blocks)
+
+
+inum = 2
+root = [(1, "."), (1, "..")]
+for d in range(ndirs):
+    chain = list(range(inum, inum + depth))
+    inum += depth
+    root.append((chain[0], "d%d" % d))
+    dir_inum = chain[-1]
+    entries = [(dir_inum, "."), (chain[-2] if depth > 1 else 1, "..")]
+    for f in range(files_per_dir):
+        entries.append((inum, "f%d" % f))
+        winode(inum, 2, blocks_per_file * BSIZE, [balloc() for _ in range(blocks_per_file)])
+        inum += 1
+    wdir(dir_inum, entries)
+    for k in range(depth - 2, -1, -1):
+        wdir(chain[k], [(chain[k], "."), (chain[k - 1] if k else 1, ".."), (chain[k + 1], "s%d" % (k + 1))])
+wdir(1, root)
+
+# Mark every block up to the last one handed out, metadata included, as mkfs does
+for b in range(next_block):
+    img[(bitmap_start + b // BPB) * BSIZE + (b % BPB) // 8] |= 1 << (b % 8)
+
+with open(out, "wb") as f:
+    f.write(img)
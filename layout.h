@@ -0,0 +1,410 @@
+// Check kernels for one on-disk layout.
+// Included once per layout by fcheck.c, with no include guard, after defining:
+//   LAYOUT_FN(name)  name of each kernel for this layout
+//   L_BSIZE          block size
+//   L_NDIRECT        direct addresses in a dinode, addrs[L_NDIRECT] is the indirect block
+//   L_DOUBLE         1 if addrs[L_NDIRECT + 1] is a double-indirect block
+// Every size is a compile-time constant, so the hot loops carry no layout branches.
+// Where the inodes and bitmap live is read from inode_start and bitmap_start.
+
+#define L_IPB (L_BSIZE / sizeof(struct dinode))
+#define L_BPB (L_BSIZE * 8)
+#define L_NINDIRECT (L_BSIZE / sizeof(uint))
+#define L_DPB (L_BSIZE / sizeof(struct dirent))
+#define L_IBLOCK(i) ((i) / L_IPB + inode_start)
+#define L_BBLOCK(b) ((b) / L_BPB + bitmap_start)
+// Metadata blocks are always at addr, data blocks come through image_data()
+#define L_BLOCK(b) (addr + (size_t)(b) * L_BSIZE)
+#define L_DATA(b, buf) image_data((size_t)(b) * L_BSIZE, L_BSIZE, buf)
+
+// Check if a block is marked as in-use in the bitmap
+int LAYOUT_FN(is_bit_set_in_bitmap)(uint block_num)
+{
+    if (block_num >= sb->size) return 0;
+
+    // Find which block of the bitmap contains this bit
+    uint bitmap_block = L_BBLOCK(block_num);
+    if (bitmap_block >= sb->size) return 0;
+    note_read(bitmap_block);
+    uchar *bitmap = (uchar *)L_BLOCK(bitmap_block);
+
+    // Find the specific bit within that block
+    uint bit_index = block_num % L_BPB;         // Which bit in the bitmap
+    uint byte_offset = bit_index / 8;            // Which byte in the block
+    uint bit_offset = bit_index % 8;             // Which bit in the byte
+
+    return (bitmap[byte_offset] >> bit_offset) & 1;
+}
+
+// Search for a directory entry by name within a block
+// Returns the inode number if found, -1 otherwise
+int LAYOUT_FN(find_dirent_in_block)(uint block_num, char *name)
+{
+    note_read(block_num);
+    struct dirent buf[L_DPB];
+    const struct dirent *de = L_DATA(block_num, buf);
+
+    for (int i = 0; i < L_DPB; i++)
+    {
+        // Skip empty entries and check if names match
+        if (de[i].inum != 0 && strncmp(de[i].name, name, DIRSIZ) == 0)
+        {
+            return de[i].inum;
+        }
+    }
+    return -1;
+}
+
+// Search the blocks an indirect block maps for . and ..
+void LAYOUT_FN(find_dots_in_indirect)(uint indirect, int *dot_inum, int *ddot_inum)
+{
+    note_read(indirect);
+    uint buf[L_NINDIRECT];
+    const uint *entries = L_DATA(indirect, buf);
+    for (int i = 0; i < L_NINDIRECT && (*dot_inum == -1 || *ddot_inum == -1); i++)
+    {
+        if (entries[i] == 0 || !is_valid_data_block(entries[i])) continue;
+        if (*dot_inum == -1) *dot_inum = LAYOUT_FN(find_dirent_in_block)(entries[i], ".");
+        if (*ddot_inum == -1) *ddot_inum = LAYOUT_FN(find_dirent_in_block)(entries[i], "..");
+    }
+}
+
+// Verify that the root directory exists and is properly formatted
+int LAYOUT_FN(check_root_directory)()
+{
+    struct dinode *root = &inode_table[ROOTINO];
+    note_read(L_IBLOCK(ROOTINO));
+
+    if (root->type != T_DIR)
+    {
+        report_inode_error("root directory does not exist.", ROOTINO);
+        return 1;
+    }
+
+    int dot_inum = -1, ddot_inum = -1;
+
+    // Search for . and .. entries in direct blocks, keep searching until both are found
+    for (int i = 0; i < L_NDIRECT && (dot_inum == -1 || ddot_inum == -1); i++)
+    {
+        if (root->addrs[i] == 0 || !is_valid_data_block(root->addrs[i])) continue;
+        if (dot_inum == -1) dot_inum = LAYOUT_FN(find_dirent_in_block)(root->addrs[i], ".");
+        if (ddot_inum == -1) ddot_inum = LAYOUT_FN(find_dirent_in_block)(root->addrs[i], "..");
+    }
+
+    // Check indirect block if both arent found yet
+    if (root->addrs[L_NDIRECT] != 0 && is_valid_data_block(root->addrs[L_NDIRECT]) &&
+        (dot_inum == -1 || ddot_inum == -1))
+    {
+        LAYOUT_FN(find_dots_in_indirect)(root->addrs[L_NDIRECT], &dot_inum, &ddot_inum);
+    }
+
+#if L_DOUBLE
+    uint dindirect = root->addrs[L_NDIRECT + 1];
+    if (dindirect != 0 && is_valid_data_block(dindirect) && (dot_inum == -1 || ddot_inum == -1))
+    {
+        note_read(dindirect);
+        uint buf[L_NINDIRECT];
+        const uint *level1 = L_DATA(dindirect, buf);
+        for (int i = 0; i < L_NINDIRECT && (dot_inum == -1 || ddot_inum == -1); i++)
+        {
+            if (level1[i] == 0 || !is_valid_data_block(level1[i])) continue;
+            LAYOUT_FN(find_dots_in_indirect)(level1[i], &dot_inum, &ddot_inum);
+        }
+    }
+#endif
+
+    // For root, both . and .. should point to root itself
+    if (dot_inum != ROOTINO || ddot_inum != ROOTINO)
+    {
+        report_inode_error("root directory does not exist.", ROOTINO);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Decode one block of directory entries for directory dir_inum
+void LAYOUT_FN(scan_dirent_block)(uint dir_inum, uint block_num, int *dot_inum, int *ddot_inum, bool count)
+{
+    note_read(block_num);
+    struct dirent buf[L_DPB];
+    const struct dirent *de = L_DATA(block_num, buf);
+
+    for (uint k = 0; k < L_DPB; k++)
+    {
+        if (de[k].inum == 0) continue;
+        local_counts.dirents++;
+        fold_dirent(dir_inum, de[k].inum, block_num * L_DPB + k, dirent_kind(&de[k]), dot_inum, ddot_inum, count);
+    }
+}
+
+// Decode the dirent blocks an indirect block maps
+void LAYOUT_FN(scan_indirect)(uint dir_inum, uint indirect, int *dot_inum, int *ddot_inum, bool count)
+{
+    note_read(indirect);
+    uint buf[L_NINDIRECT];
+    const uint *entries = L_DATA(indirect, buf);
+    for (int j = 0; j < L_NINDIRECT; j++)
+    {
+        if (entries[j] == 0 || !is_valid_data_block(entries[j])) continue;
+        LAYOUT_FN(scan_dirent_block)(dir_inum, entries[j], dot_inum, ddot_inum, count);
+    }
+}
+
+// Walk every dirent block of a directory in a single pass
+// Blocks outside the data region are skipped so this is safe on unvalidated inodes
+void LAYOUT_FN(scan_directory)(uint dir_inum, int *dot_inum, int *ddot_inum, bool count)
+{
+    struct dinode *dip = &inode_table[dir_inum];
+
+    for (int j = 0; j < L_NDIRECT; j++)
+    {
+        if (dip->addrs[j] == 0 || !is_valid_data_block(dip->addrs[j])) continue;
+        LAYOUT_FN(scan_dirent_block)(dir_inum, dip->addrs[j], dot_inum, ddot_inum, count);
+    }
+
+    if (dip->addrs[L_NDIRECT] != 0 && is_valid_data_block(dip->addrs[L_NDIRECT]))
+    {
+        LAYOUT_FN(scan_indirect)(dir_inum, dip->addrs[L_NDIRECT], dot_inum, ddot_inum, count);
+    }
+
+#if L_DOUBLE
+    uint dindirect = dip->addrs[L_NDIRECT + 1];
+    if (dindirect != 0 && is_valid_data_block(dindirect))
+    {
+        note_read(dindirect);
+        uint buf[L_NINDIRECT];
+        const uint *level1 = L_DATA(dindirect, buf);
+        for (int j = 0; j < L_NINDIRECT; j++)
+        {
+            if (level1[j] == 0 || !is_valid_data_block(level1[j])) continue;
+            LAYOUT_FN(scan_indirect)(dir_inum, level1[j], dot_inum, ddot_inum, count);
+        }
+    }
+#endif
+}
+
+// Checks 5 and 8 for an indirect block of inode i, and 2, 5 and 8 for the addresses it holds
+// The block address itself has already been found valid
+// Returns 1 after reporting the first failure
+int LAYOUT_FN(check_indirect)(uint i, uint indirect)
+{
+    // Check 5: Indirect block must be marked in bitmap
+    if (!LAYOUT_FN(is_bit_set_in_bitmap)(indirect))
+    {
+        report_inode_error("address used by inode but marked free in bitmap.", i);
+        return 1;
+    }
+
+    // Check 8: Indirect block itself shouldn't be shared
+    if (!claim_block(indirect))
+    {
+        report_inode_error("indirect address used more than once.", i);
+        return 1;
+    }
+
+    // Check all the blocks pointed to by the indirect block
+    note_read(indirect);
+    uint buf[L_NINDIRECT];
+    const uint *indirect_addrs = L_DATA(indirect, buf);
+    for (int j = 0; j < L_NINDIRECT; j++)
+    {
+        uint block = indirect_addrs[j];
+        if (block == 0) continue;
+
+        // Check 2: Each indirect address must be valid
+        if (!is_valid_data_block(block))
+        {
+            report_inode_error("bad indirect address in inode.", i);
+            return 1;
+        }
+
+        // Check 8: Each indirect address should only be used once
+        if (!claim_block(block))
+        {
+            report_inode_error("indirect address used more than once.", i);
+            return 1;
+        }
+        if (block_owner) block_owner[block] = i;
+
+        // Check 5: Must be marked in bitmap
+        if (!LAYOUT_FN(is_bit_set_in_bitmap)(block))
+        {
+            report_inode_error("address used by inode but marked free in bitmap.", i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Checks 1, 2, 5, 7 and 8 for one inode: type, block addresses, bitmap and duplicate claims
+// Level 1 only checks the type and the addresses held in the inode itself
+// Returns 1 after reporting the first failure
+int LAYOUT_FN(check_inode)(uint i)
+{
+    struct dinode *dip = &inode_table[i];
+    note_read(L_IBLOCK(i));
+    local_counts.inodes++;
+
+    // Check 1: Inode must have a valid type
+    if (dip->type != T_UNALLOC && dip->type != T_FILE &&
+        dip->type != T_DIR && dip->type != T_DEV)
+    {
+        report_inode_error("bad inode.", i);
+        return 1;
+    }
+
+    // Skip unallocated inodes for the remaining checks
+    if (dip->type == T_UNALLOC) return 0;
+
+    // Check all direct block addresses
+    for (int j = 0; j < L_NDIRECT; j++)
+    {
+        uint block = dip->addrs[j];
+        if (block == 0) continue;  // Skip unused entries
+
+        // Check 2: Block address must be valid
+        if (!is_valid_data_block(block))
+        {
+            report_inode_error("bad direct address in inode.", i);
+            return 1;
+        }
+
+        // Level 1 stops at address ranges
+        if (check_level < 2) continue;
+
+        // Check 7: Each block should only be used once
+        if (!claim_block(block))
+        {
+            report_inode_error("direct address used more than once.", i);
+            return 1;
+        }
+        if (block_owner) block_owner[block] = i;
+
+        // Check 5: Block must be marked as in-use in the bitmap
+        if (!LAYOUT_FN(is_bit_set_in_bitmap)(block))
+        {
+            report_inode_error("address used by inode but marked free in bitmap.", i);
+            return 1;
+        }
+    }
+
+    // Check the indirect block
+    uint indirect = dip->addrs[L_NDIRECT];
+    if (indirect != 0)
+    {
+        // Check 2: Indirect block address must be valid
+        if (!is_valid_data_block(indirect))
+        {
+            report_inode_error("bad indirect address in inode.", i);
+            return 1;
+        }
+
+        // Level 1 reads the inode table only, so the indirect block is not opened
+        if (check_level >= 2 && LAYOUT_FN(check_indirect)(i, indirect)) return 1;
+    }
+
+#if L_DOUBLE
+    // The double-indirect block maps indirect blocks, all of them count as indirect addresses
+    uint dindirect = dip->addrs[L_NDIRECT + 1];
+    if (dindirect != 0)
+    {
+        if (!is_valid_data_block(dindirect))
+        {
+            report_inode_error("bad indirect address in inode.", i);
+            return 1;
+        }
+        if (check_level < 2) return 0;
+
+        if (!LAYOUT_FN(is_bit_set_in_bitmap)(dindirect))
+        {
+            report_inode_error("address used by inode but marked free in bitmap.", i);
+            return 1;
+        }
+        if (!claim_block(dindirect))
+        {
+            report_inode_error("indirect address used more than once.", i);
+            return 1;
+        }
+
+        note_read(dindirect);
+        uint buf[L_NINDIRECT];
+        const uint *level1 = L_DATA(dindirect, buf);
+        for (int j = 0; j < L_NINDIRECT; j++)
+        {
+            if (level1[j] == 0) continue;
+            if (!is_valid_data_block(level1[j]))
+            {
+                report_inode_error("bad indirect address in inode.", i);
+                return 1;
+            }
+            if (LAYOUT_FN(check_indirect)(i, level1[j])) return 1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+// Main loop of the sequential engine: scan through all inodes and check for consistency
+// Returns 1 after reporting the first failure
+int LAYOUT_FN(sequential_scan)(uint first)
+{
+    for (uint i = first; i < sb->ninodes; i++)
+    {
+        struct dinode *dip = &inode_table[i];
+        paths_scanned = i;
+
+        if (checkpoint_file && i % 1024 == 0 && i != first) maybe_checkpoint(i);
+
+        unsigned long long claimed = local_counts.blocks;
+        if (LAYOUT_FN(check_inode)(i)) return 1;
+        if (dip->type == T_UNALLOC) continue;
+        if (analyze) analyze_inode(i, local_counts.blocks - claimed);
+
+        // Check 4: Verify directory formatting
+        // One pass over the dirents finds . and .., counts references and records names
+        if (dip->type == T_DIR && check_level >= 3)
+        {
+            int dot_inum = -1, ddot_inum = -1;
+            unsigned long long dirents = local_counts.dirents;
+            LAYOUT_FN(scan_directory)(i, &dot_inum, &ddot_inum, true);
+            paths_scanned = i + 1;
+            if (check_dir_format(i, dot_inum, ddot_inum)) return 1;
+            if (analyze) analyze_directory(local_counts.dirents - dirents - 2);
+        }
+    }
+    return 0;
+}
+
+// Check 6: Any block marked in-use in the bitmap should actually be used by some inode
+// Returns 1 after reporting the first failure
+int LAYOUT_FN(bitmap_sweep)()
+{
+    uint first_data = data_block_start;
+    uint last_data = data_block_start + sb->nblocks;
+
+    for (uint block = first_data; block < last_data; block++)
+    {
+        if (LAYOUT_FN(is_bit_set_in_bitmap)(block) && block_usage[block] == 0)
+        {
+            if (!quiet) fprintf(stderr, "ERROR: bitmap marks block in use but it is not in use.\n  block %u\n", block);
+            count_failure("bitmap marks block in use but it is not in use.");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#undef L_IPB
+#undef L_BPB
+#undef L_NINDIRECT
+#undef L_DPB
+#undef L_IBLOCK
+#undef L_BBLOCK
+#undef L_BLOCK
+#undef L_DATA
+#undef LAYOUT_FN
+#undef L_BSIZE
+#undef L_NDIRECT
+#undef L_DOUBLE
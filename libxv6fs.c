@@ -0,0 +1,435 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "fs.h"
+#include "fcheck.h"
+#include "libxv6fs.h"
+
+#define T_DIR 1
+
+// One (directory, name) lookup result, inum 0 records a name that is absent
+struct name_entry
+{
+    uint dir;                  // 0 for an empty slot
+    uint inum;
+    char name[DIRSIZ];         // Zero-padded
+};
+
+struct xv6fs
+{
+    int fd;
+    int flags;
+    char *base;                // The image, mapped or mirrored
+    size_t len;
+    uchar *loaded;             // XV6FS_PREAD: one bit per block already read into base
+    struct fcheck_geometry g;
+
+    struct name_entry *names;  // Open addressing, at most half full
+    uint names_cap;
+    uint names_len;
+
+    uint **maps;               // Per inode: data block of each file block, built on first use
+    uint *map_len;
+
+    struct xv6fs_cache_stats stats;
+};
+
+// pread() a byte range of the image into the mirror
+static int read_range(struct xv6fs *fs, size_t off, size_t len)
+{
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = pread(fs->fd, fs->base + off + done, len - done, off + done);
+        if (n < 0) return -errno;
+        if (n == 0) return -EIO;
+        done += n;
+    }
+    return 0;
+}
+
+// Block b of the image, NULL if it cannot be read
+static const char *block(struct xv6fs *fs, uint b)
+{
+    if (b >= fs->g.size) return NULL;
+    if (fs->loaded && !(fs->loaded[b / 8] >> (b % 8) & 1))
+    {
+        if (read_range(fs, (size_t)b * fs->g.bsize, fs->g.bsize) < 0) return NULL;
+        fs->loaded[b / 8] |= 1 << (b % 8);
+    }
+    return fs->base + (size_t)b * fs->g.bsize;
+}
+
+// A block an inode points to, which must lie in the data region
+static const char *data_block(struct xv6fs *fs, uint b)
+{
+    if (b < fs->g.data_start) return NULL;
+    return block(fs, b);
+}
+
+static struct dinode *dinode(struct xv6fs *fs, uint inum)
+{
+    uint ipb = fs->g.bsize / sizeof(struct dinode);
+    const char *b = block(fs, fs->g.inode_start + inum / ipb);
+    return b ? (struct dinode *)b + inum % ipb : NULL;
+}
+
+static uint file_blocks(struct xv6fs *fs, struct dinode *dip)
+{
+    uint nindirect = fs->g.bsize / sizeof(uint);
+    uint max = fs->g.ndirect + nindirect + (fs->g.dindirect ? nindirect * nindirect : 0);
+    uint n = (uint)(((unsigned long long)dip->size + fs->g.bsize - 1) / fs->g.bsize);
+    return n < max ? n : max;
+}
+
+// Data block holding file block lbn, walking the indirect blocks every time
+// 0 for a hole, an address outside the data region or a block past the map
+static uint bmap(struct xv6fs *fs, struct dinode *dip, uint lbn)
+{
+    uint nindirect = fs->g.bsize / sizeof(uint);
+    uint b;
+    if (lbn >= file_blocks(fs, dip))
+    {
+        return 0;
+    }
+    else if (lbn < fs->g.ndirect)
+    {
+        b = dip->addrs[lbn];
+    }
+    else if (lbn - fs->g.ndirect < nindirect)
+    {
+        const uint *indirect = (const uint *)data_block(fs, dip->addrs[fs->g.ndirect]);
+        b = indirect ? indirect[lbn - fs->g.ndirect] : 0;
+    }
+    else if (fs->g.dindirect && lbn - fs->g.ndirect - nindirect < nindirect * nindirect)
+    {
+        lbn -= fs->g.ndirect + nindirect;
+        const uint *dindirect = (const uint *)data_block(fs, dip->addrs[fs->g.ndirect + 1]);
+        const uint *level1 = dindirect ? (const uint *)data_block(fs, dindirect[lbn / nindirect]) : NULL;
+        b = level1 ? level1[lbn % nindirect] : 0;
+    }
+    else
+    {
+        return 0;
+    }
+    return data_block(fs, b) ? b : 0;
+}
+
+// Data block holding file block lbn of inum, through the inode's cached block map
+static uint map_block(struct xv6fs *fs, uint inum, struct dinode *dip, uint lbn)
+{
+    if (fs->flags & XV6FS_NOCACHE) return bmap(fs, dip, lbn);
+
+    if (!fs->maps[inum])
+    {
+        uint n = file_blocks(fs, dip);
+        uint *map = malloc((n ? n : 1) * sizeof(uint));
+        if (!map) return bmap(fs, dip, lbn);
+        for (uint k = 0; k < n; k++) map[k] = bmap(fs, dip, k);
+        fs->maps[inum] = map;
+        fs->map_len[inum] = n;
+        fs->stats.block_maps++;
+    }
+    return lbn < fs->map_len[inum] ? fs->maps[inum][lbn] : 0;
+}
+
+static uint name_hash(uint dir, const char *name, uint cap)
+{
+    uint h = 2166136261u ^ dir;
+    for (int k = 0; k < DIRSIZ && name[k]; k++) h = (h ^ (uchar)name[k]) * 16777619u;
+    return h & (cap - 1);
+}
+
+static struct name_entry *name_get(struct xv6fs *fs, uint dir, const char *name)
+{
+    if (fs->names_cap == 0) return NULL;
+    for (uint h = name_hash(dir, name, fs->names_cap); fs->names[h].dir != 0; h = (h + 1) & (fs->names_cap - 1))
+    {
+        if (fs->names[h].dir == dir && memcmp(fs->names[h].name, name, DIRSIZ) == 0) return &fs->names[h];
+    }
+    return NULL;
+}
+
+// Record name in dir as inum, the first record of a name wins
+static void name_put(struct xv6fs *fs, uint dir, const char *name, uint inum)
+{
+    if (2 * (fs->names_len + 1) > fs->names_cap)
+    {
+        uint cap = fs->names_cap ? 2 * fs->names_cap : 1024;
+        struct name_entry *grown = calloc(cap, sizeof(struct name_entry));
+        if (!grown) return;
+        struct name_entry *old = fs->names;
+        uint old_cap = fs->names_cap;
+        fs->names = grown;
+        fs->names_cap = cap;
+        fs->names_len = 0;
+        for (uint h = 0; h < old_cap; h++)
+        {
+            if (old[h].dir != 0) name_put(fs, old[h].dir, old[h].name, old[h].inum);
+        }
+        free(old);
+    }
+
+    uint h = name_hash(dir, name, fs->names_cap);
+    for (; fs->names[h].dir != 0; h = (h + 1) & (fs->names_cap - 1))
+    {
+        if (fs->names[h].dir == dir && memcmp(fs->names[h].name, name, DIRSIZ) == 0) return;
+    }
+    fs->names[h].dir = dir;
+    fs->names[h].inum = inum;
+    memcpy(fs->names[h].name, name, DIRSIZ);
+    fs->names_len++;
+}
+
+// Look name up in directory dir like dirlookup(), name is zero-padded to DIRSIZ
+// A miss scans the whole directory and caches every entry, so later names in
+// it hit. A name found absent is cached too
+static int dirlookup(struct xv6fs *fs, uint dir, struct dinode *dp, const char *name)
+{
+    bool cache = !(fs->flags & XV6FS_NOCACHE) && dir != 0;
+    if (cache)
+    {
+        struct name_entry *e = name_get(fs, dir, name);
+        if (e && e->inum)
+        {
+            fs->stats.lookup_hits++;
+            return e->inum;
+        }
+        if (e)
+        {
+            fs->stats.negative_hits++;
+            return -ENOENT;
+        }
+    }
+    fs->stats.lookup_misses++;
+
+    int found = -ENOENT;
+    uint per_block = fs->g.bsize / sizeof(struct dirent);
+    uint ndirents = dp->size / sizeof(struct dirent);
+    for (uint e = 0; e < ndirents; e += per_block)
+    {
+        const struct dirent *de = (const struct dirent *)data_block(fs, map_block(fs, dir, dp, e / per_block));
+        if (!de) continue;
+        fs->stats.dirent_blocks++;
+
+        for (uint k = 0; k < per_block && e + k < ndirents; k++)
+        {
+            if (de[k].inum == 0) continue;
+            char entry[DIRSIZ] = { 0 };
+            strncpy(entry, de[k].name, DIRSIZ);
+            if (found == -ENOENT && memcmp(entry, name, DIRSIZ) == 0)
+            {
+                found = de[k].inum < fs->g.ninodes ? (int)de[k].inum : -EIO;
+                if (!cache) return found;
+            }
+            if (cache) name_put(fs, dir, entry, de[k].inum < fs->g.ninodes ? de[k].inum : 0);
+        }
+    }
+    if (cache && found == -ENOENT) name_put(fs, dir, name, 0);
+    return found;
+}
+
+// Copy the next path element into name, zero-padded and cut to DIRSIZ like skipelem()
+// Returns the rest of the path, or NULL when no element is left
+static const char *skipelem(const char *path, char *name)
+{
+    while (*path == '/') path++;
+    if (*path == '\0') return NULL;
+    const char *s = path;
+    while (*path != '/' && *path != '\0') path++;
+    size_t len = path - s;
+    memset(name, 0, DIRSIZ);
+    memcpy(name, s, len < DIRSIZ ? len : DIRSIZ);
+    while (*path == '/') path++;
+    return path;
+}
+
+int xv6fs_lookup(struct xv6fs *fs, const char *path)
+{
+    uint inum = ROOTINO;
+    char name[DIRSIZ];
+
+    while ((path = skipelem(path, name)) != NULL)
+    {
+        struct dinode *dp = dinode(fs, inum);
+        if (!dp) return -EIO;
+        if (dp->type != T_DIR) return -ENOTDIR;
+        int next = dirlookup(fs, inum, dp, name);
+        if (next < 0) return next;
+        inum = next;
+    }
+    return inum;
+}
+
+int xv6fs_stat(struct xv6fs *fs, unsigned inum, struct xv6fs_stat *st)
+{
+    if (inum >= fs->g.ninodes) return -EINVAL;
+    struct dinode *dip = dinode(fs, inum);
+    if (!dip) return -EIO;
+    if (dip->type == 0) return -ENOENT;
+
+    st->inum = inum;
+    st->type = dip->type;
+    st->major = dip->major;
+    st->minor = dip->minor;
+    st->nlink = dip->nlink;
+    st->size = dip->size;
+    st->blocks = 0;
+    uint n = file_blocks(fs, dip);
+    for (uint k = 0; k < n; k++) st->blocks += map_block(fs, inum, dip, k) != 0;
+    return 0;
+}
+
+int xv6fs_readdir(struct xv6fs *fs, unsigned dir, unsigned *pos, struct xv6fs_dirent *de)
+{
+    if (dir >= fs->g.ninodes) return -EINVAL;
+    struct dinode *dp = dinode(fs, dir);
+    if (!dp) return -EIO;
+    if (dp->type != T_DIR) return -ENOTDIR;
+
+    uint per_block = fs->g.bsize / sizeof(struct dirent);
+    for (; *pos < dp->size / sizeof(struct dirent); (*pos)++)
+    {
+        const struct dirent *entries = (const struct dirent *)data_block(fs, map_block(fs, dir, dp, *pos / per_block));
+        if (!entries) continue;
+        const struct dirent *e = &entries[*pos % per_block];
+        if (e->inum == 0) continue;
+
+        de->inum = e->inum;
+        memcpy(de->name, e->name, DIRSIZ);
+        de->name[DIRSIZ] = '\0';
+        (*pos)++;
+        return 1;
+    }
+    return 0;
+}
+
+ssize_t xv6fs_pread(struct xv6fs *fs, unsigned inum, void *buf, size_t n, off_t off)
+{
+    if (inum >= fs->g.ninodes || off < 0) return -EINVAL;
+    struct dinode *dip = dinode(fs, inum);
+    if (!dip) return -EIO;
+    if (dip->type == 0) return -ENOENT;
+    if ((unsigned long long)off >= dip->size) return 0;
+    if (n > dip->size - off) n = dip->size - off;
+
+    // Block by block, holes and unreadable blocks read as zeros
+    for (size_t done = 0; done < n;)
+    {
+        size_t pos = off + done;
+        uint lbn = pos / fs->g.bsize, in = pos % fs->g.bsize;
+        size_t len = fs->g.bsize - in < n - done ? fs->g.bsize - in : n - done;
+        const char *b = data_block(fs, map_block(fs, inum, dip, lbn));
+        if (b) memcpy((char *)buf + done, b + in, len);
+        else memset((char *)buf + done, 0, len);
+        done += len;
+    }
+    return n;
+}
+
+void xv6fs_cache_stats(struct xv6fs *fs, struct xv6fs_cache_stats *stats)
+{
+    *stats = fs->stats;
+}
+
+struct xv6fs *xv6fs_open(const char *image, int flags)
+{
+    struct xv6fs *fs = calloc(1, sizeof(struct xv6fs));
+    if (!fs)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    fs->flags = flags;
+    fs->fd = open(image, O_RDONLY);
+    struct stat st;
+    if (fs->fd < 0 || fstat(fs->fd, &st) == -1) goto fail;
+    fs->len = st.st_size;
+
+    if (!(flags & XV6FS_PREAD))
+    {
+        fs->base = mmap(NULL, fs->len, PROT_READ, MAP_PRIVATE, fs->fd, 0);
+        if (fs->base == MAP_FAILED) goto fail;
+        if (fcheck_geometry(fs->base, fs->len, &fs->g) != FCHECK_CLEAN) goto bad;
+    }
+    else
+    {
+        // A sparse mirror of the image, blocks are read into it on first use
+        // The superblock comes first, then everything before the data region,
+        // which also lets layout detection see the inode table
+        fs->base = mmap(NULL, fs->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (fs->base == MAP_FAILED) goto fail;
+        int err = read_range(fs, 0, fs->len < 2048 ? fs->len : 2048);
+        if (err == 0 && fcheck_geometry(fs->base, fs->len, &fs->g) != FCHECK_CLEAN) goto bad;
+        if (err == 0) err = read_range(fs, 0, (size_t)fs->g.data_start * fs->g.bsize);
+        if (err < 0)
+        {
+            errno = -err;
+            goto fail;
+        }
+        if (fcheck_geometry(fs->base, fs->len, &fs->g) != FCHECK_CLEAN) goto bad;
+
+        fs->loaded = calloc(fs->g.size / 8 + 1, 1);
+        if (!fs->loaded) goto fail;
+        for (uint b = 0; b < fs->g.data_start; b++) fs->loaded[b / 8] |= 1 << (b % 8);
+    }
+
+    if (flags & XV6FS_CHECK)
+    {
+        if (fs->loaded)
+        {
+            int err = read_range(fs, 0, fs->len);
+            if (err < 0)
+            {
+                errno = -err;
+                goto fail;
+            }
+            memset(fs->loaded, 0xFF, fs->g.size / 8 + 1);
+        }
+        int verdict = fcheck_check_buffer(fs->base, fs->len);
+        if (verdict == FCHECK_NO_MEMORY)
+        {
+            errno = ENOMEM;
+            goto fail;
+        }
+        if (verdict != FCHECK_CLEAN) goto bad;
+    }
+
+    fs->maps = calloc(fs->g.ninodes, sizeof(uint *));
+    fs->map_len = calloc(fs->g.ninodes, sizeof(uint));
+    if (!fs->maps || !fs->map_len) goto fail;
+    return fs;
+
+bad:
+    errno = EINVAL;
+fail:
+    {
+        int err = errno ? errno : ENOMEM;
+        xv6fs_close(fs);
+        errno = err;
+    }
+    return NULL;
+}
+
+void xv6fs_close(struct xv6fs *fs)
+{
+    if (fs->maps)
+    {
+        for (uint i = 0; i < fs->g.ninodes; i++) free(fs->maps[i]);
+    }
+    free(fs->maps);
+    free(fs->map_len);
+    free(fs->names);
+    free(fs->loaded);
+    if (fs->base && fs->base != MAP_FAILED) munmap(fs->base, fs->len);
+    if (fs->fd >= 0) close(fs->fd);
+    free(fs);
+}
@@ -0,0 +1,69 @@
+#ifndef _LIBXV6FS_H_
+#define _LIBXV6FS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Read-only access to the files inside an xv6 image, for host tools.
+// Paths resolve like namex() in the kernel: from the root, one DIRSIZ-long
+// element at a time, with "." and ".." taken from the directories themselves.
+// Files are named by inode number once looked up.
+//
+// Every layout fcheck understands is supported. Block addresses are checked
+// against the data region before they are followed, so a corrupted image gives
+// errors, not crashes. Calls on one handle must not overlap, and opening an
+// image uses the checker's global state, so opens must not overlap either.
+//
+// Functions return 0 or a count on success and a negative errno on failure.
+
+struct xv6fs;
+
+#define XV6FS_PREAD 1      // Read blocks with pread() instead of mapping the image
+#define XV6FS_CHECK 2      // Refuse images that fail the full fcheck check, implies reading all of it
+#define XV6FS_NOCACHE 4    // No lookup or block map caching, for comparison
+
+struct xv6fs_stat
+{
+    unsigned inum;
+    short type;            // 1 directory, 2 file, 3 device
+    short major;
+    short minor;
+    short nlink;
+    unsigned size;
+    unsigned blocks;       // Data blocks, indirect blocks not included
+};
+
+struct xv6fs_dirent
+{
+    unsigned inum;
+    char name[15];         // DIRSIZ bytes and a terminator
+};
+
+// Returns NULL with errno set on failure
+struct xv6fs *xv6fs_open(const char *image, int flags);
+void xv6fs_close(struct xv6fs *fs);
+
+// Inode number of an absolute path
+int xv6fs_lookup(struct xv6fs *fs, const char *path);
+
+int xv6fs_stat(struct xv6fs *fs, unsigned inum, struct xv6fs_stat *st);
+
+// Next entry of directory dir at or after *pos, skipping empty slots
+// Returns 1 and advances *pos past it, or 0 at the end
+int xv6fs_readdir(struct xv6fs *fs, unsigned dir, unsigned *pos, struct xv6fs_dirent *de);
+
+// Read up to n bytes at off, short at the end of the file
+ssize_t xv6fs_pread(struct xv6fs *fs, unsigned inum, void *buf, size_t n, off_t off);
+
+// Cache counters, for benchmarks
+struct xv6fs_cache_stats
+{
+    unsigned long long lookup_hits;
+    unsigned long long lookup_misses;
+    unsigned long long negative_hits;
+    unsigned long long dirent_blocks;  // Directory blocks scanned
+    unsigned long long block_maps;     // Block maps built
+};
+void xv6fs_cache_stats(struct xv6fs *fs, struct xv6fs_cache_stats *stats);
+
+#endif //_LIBXV6FS_H_
@@ -0,0 +1,79 @@
+#!/bin/bash
+
+# Checkpoint and resume of the main scan (--checkpoint/--resume): a run
+# resumed from a checkpoint must reach the verdict of an uninterrupted run,
+# and a checkpoint taken at another --level or --engine must be refused.
+# The first checkpoint is caught by making FILE.tmp a FIFO and reading it;
+# fcheck cannot fsync the FIFO, so it goes on and finishes as usual.
+# Usage: ./test_checkpoint.sh    (after make)
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+MKFS="$DIR/mkfs"
+IMG="$DIR/fs.img"
+FAILED=0
+
+gcc -O -w -iquote xv6/include xv6/tools/mkfs.c fcheck.c xv6z.c -DFCHECK_NO_MAIN -o "$MKFS" -lm -lz -pthread || exit 1
+
+# Enough files that used inodes cross several 1024-inode checkpoint boundaries
+mkdir -p "$DIR/tree/many"
+cp -r xv6/user "$DIR/tree"
+for ((k = 0; k < 3000; k++)); do echo $k > "$DIR/tree/many/f$k"; done
+"$MKFS" --size=16384 --ninodes=8192 "$IMG" "$DIR/tree" > /dev/null || exit 1
+
+pass() {
+    echo "PASS: $1"
+}
+
+fail() {
+    echo "FAIL: $1"
+    FAILED=1
+}
+
+# Save the first checkpoint of a run with options $@ to $DIR/saved
+first_checkpoint() {
+    rm -f "$DIR/ck" "$DIR/ck.tmp" "$DIR/saved"
+    mkfifo "$DIR/ck.tmp"
+    cat "$DIR/ck.tmp" > "$DIR/saved" &
+    ./fcheck "$@" --checkpoint="$DIR/ck" "$IMG" > /dev/null 2>&1
+    # A run that wrote no checkpoint never opened the FIFO, unblock the reader
+    [ -p "$DIR/ck.tmp" ] && : > "$DIR/ck.tmp"
+    wait
+    [ -s "$DIR/saved" ]
+}
+
+# Resume from the saved checkpoint with options $@, print what fcheck printed
+resume() {
+    cp "$DIR/saved" "$DIR/ck"
+    ./fcheck "$@" --checkpoint="$DIR/ck" --resume "$IMG" 2>&1
+}
+
+for level in 1 2 3; do
+    first_checkpoint --level=$level || { fail "no checkpoint written at level $level"; continue; }
+    expected=$(./fcheck --level=$level "$IMG" 2>&1)
+    if [ "$(resume --level=$level)" = "$expected" ]; then
+        pass "resumed at level $level, same verdict"
+    else
+        fail "resumed at level $level, verdict differs"
+    fi
+    other=$((level % 3 + 1))
+    if resume --level=$other | grep -q "^checkpoint was taken with another"; then
+        pass "level $level checkpoint refused at level $other"
+    else
+        fail "level $level checkpoint resumed at level $other"
+    fi
+done
+
+first_checkpoint --engine=pipeline || fail "no checkpoint written by the pipeline engine"
+if [ "$(resume --engine=pipeline)" = "$(./fcheck "$IMG" 2>&1)" ]; then
+    pass "resumed with the pipeline engine, same verdict"
+else
+    fail "resumed with the pipeline engine, verdict differs"
+fi
+if resume | grep -q "^checkpoint was taken with another"; then
+    pass "pipeline checkpoint refused by the sequential engine"
+else
+    fail "pipeline checkpoint resumed by the sequential engine"
+fi
+
+exit $FAILED
@@ -0,0 +1,103 @@
+#!/bin/bash
+
+# Incremental mkfs rebuilds (--base/--manifest): after changes to the tree,
+# the rebuilt image must pass fcheck and extract to the same tree as a fresh
+# build, whether written to a new file or over the base itself. A rebuild
+# that fails halfway must leave the base image and its manifest as they were.
+# Usage: ./test_incremental.sh    (after make)
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+MKFS="$DIR/mkfs"
+GEOMETRY="--size=8192 --ninodes=1024"
+FAILED=0
+
+gcc -O -w -iquote xv6/include xv6/tools/mkfs.c fcheck.c xv6z.c -DFCHECK_NO_MAIN -o "$MKFS" -lm -lz -pthread || exit 1
+
+pass() {
+    echo "PASS: $1"
+}
+
+fail() {
+    echo "FAIL: $1"
+    FAILED=1
+}
+
+# Extract image to dir and compare it with the extraction of the fresh build
+same_tree() {
+    rm -rf "$DIR/$2"
+    ./xv6fs extract --threads=1 "$1" "$DIR/$2" > /dev/null && diff -r "$DIR/fresh" "$DIR/$2" > /dev/null
+}
+
+mkdir "$DIR/tree"
+cp -r xv6/kernel xv6/user xv6/include "$DIR/tree"
+# Names the manifest has to escape, kept through the rebuild
+echo "newline" > "$DIR/tree/n"$'\n'"l"
+echo "percent" > "$DIR/tree/p%0aq"
+"$MKFS" $GEOMETRY --manifest="$DIR/base.txt" "$DIR/base.img" "$DIR/tree" > /dev/null || exit 1
+
+# Change, add, remove, grow and shrink files, remove a directory, add one
+T="$DIR/tree"
+echo "changed" >> "$T/kernel/main.c"
+rm "$T/user/cat.c"
+rm -r "$T/include"
+mkdir -p "$T/new/deeper"
+head -c 70000 /dev/urandom > "$T/new/large"
+echo "new" > "$T/new/deeper/small"
+head -c 300 "$T/kernel/proc.c" > "$DIR/head" && cat "$DIR/head" > "$T/kernel/proc.c"
+cat "$T/kernel/fs.c" "$T/kernel/fs.c" "$T/kernel/fs.c" > "$DIR/fs3" && cat "$DIR/fs3" > "$T/kernel/fs.c"
+touch "$T/kernel/bio.c"
+
+"$MKFS" $GEOMETRY "$DIR/fresh.img" "$T" > /dev/null || exit 1
+./xv6fs extract --threads=1 "$DIR/fresh.img" "$DIR/fresh" > /dev/null || exit 1
+
+cp "$DIR/base.txt" "$DIR/copy.txt"
+"$MKFS" --base="$DIR/base.img" --manifest="$DIR/copy.txt" "$DIR/copy.img" "$T" > /dev/null
+if [ -z "$(./fcheck "$DIR/copy.img" 2>&1)" ]; then pass "rebuild to a new file passes fcheck"; else fail "rebuild to a new file fails fcheck"; fi
+if same_tree "$DIR/copy.img" copy; then pass "rebuild to a new file holds the fresh build's tree"; else fail "rebuild to a new file differs from the fresh build"; fi
+
+cp "$DIR/base.img" "$DIR/inplace.img"
+cp "$DIR/base.txt" "$DIR/inplace.txt"
+"$MKFS" --base="$DIR/inplace.img" --manifest="$DIR/inplace.txt" "$DIR/inplace.img" "$T" > /dev/null
+if [ -z "$(./fcheck "$DIR/inplace.img" 2>&1)" ]; then pass "rebuild over the base passes fcheck"; else fail "rebuild over the base fails fcheck"; fi
+if same_tree "$DIR/inplace.img" inplace; then pass "rebuild over the base holds the fresh build's tree"; else fail "rebuild over the base differs from the fresh build"; fi
+if cmp -s "$DIR/copy.img" "$DIR/inplace.img"; then pass "both rebuilds are identical"; else fail "the rebuilds differ"; fi
+
+cp "$DIR/inplace.img" "$DIR/again.img"
+if "$MKFS" --base="$DIR/inplace.img" --manifest="$DIR/inplace.txt" "$DIR/inplace.img" "$T" |
+    grep -q "^incremental: 0 files rewritten.* 0 directories rewritten" && cmp -s "$DIR/inplace.img" "$DIR/again.img"; then
+    pass "a rebuild without changes changes nothing"
+else
+    fail "a rebuild without changes rewrote the image"
+fi
+
+# A sysfs file claims 4096 bytes and reads fewer, so copying it fails after
+# the rebuild has started changing the image
+SHORT=/sys/kernel/uevent_seqnum
+if [ -r "$SHORT" ] && [ "$(stat -c %s "$SHORT")" -gt "$(wc -c < "$SHORT")" ]; then
+    cp "$DIR/inplace.img" "$DIR/before.img"
+    cp "$DIR/inplace.txt" "$DIR/before.txt"
+    echo "changed again" >> "$T/kernel/main.c"
+    ln -s "$SHORT" "$T/new/short"
+    if ! "$MKFS" --base="$DIR/inplace.img" --manifest="$DIR/inplace.txt" "$DIR/inplace.img" "$T" > /dev/null 2>&1 &&
+        cmp -s "$DIR/inplace.img" "$DIR/before.img" && cmp -s "$DIR/inplace.txt" "$DIR/before.txt" &&
+        [ -z "$(ls "$DIR" | grep -e '^inplace\.img\.' -e '^inplace\.txt\.tmp$')" ]; then
+        pass "a failed rebuild leaves the base image and manifest alone"
+    else
+        fail "a failed rebuild changed the base image or manifest"
+    fi
+else
+    echo "SKIP: no short-reading sysfs file to make a rebuild fail"
+fi
+
+# Paths longer than a manifest line holds are refused before anything is written
+mkdir "$DIR/deep"
+(cd "$DIR/deep" && for ((k = 0; k < 300; k++)); do mkdir dddddddddddddd && cd dddddddddddddd || exit 1; done)
+if ! "$MKFS" $GEOMETRY --manifest="$DIR/deep.txt" "$DIR/deep.img" "$DIR/deep" > /dev/null 2>&1 &&
+    [ ! -e "$DIR/deep.img" ] && [ ! -e "$DIR/deep.txt" ]; then
+    pass "a tree with paths too long for the manifest is refused"
+else
+    fail "a tree with paths too long for the manifest was built"
+fi
+
+exit $FAILED
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# mkfs --from-tar on hard links: a link to a file earlier in the archive
+# builds an image that passes fcheck, and a link to a file the archive does
+# not hold, even as its first entry, is refused with an error.
+# Usage: ./test_tar.sh    (after make)
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+MKFS="$DIR/mkfs"
+FAILED=0
+
+gcc -O -w -iquote xv6/include xv6/tools/mkfs.c fcheck.c xv6z.c -DFCHECK_NO_MAIN -o "$MKFS" -lm -lz -pthread || exit 1
+
+pass() {
+    echo "PASS: $1"
+}
+
+fail() {
+    echo "FAIL: $1"
+    FAILED=1
+}
+
+# y, then x as a hard link to it; only.tar holds the link alone
+mkdir "$DIR/tree"
+echo "linked" > "$DIR/tree/y"
+ln "$DIR/tree/y" "$DIR/tree/x"
+tar --format=ustar -C "$DIR/tree" -cf "$DIR/link.tar" y x || exit 1
+cp "$DIR/link.tar" "$DIR/only.tar"
+tar --delete -f "$DIR/only.tar" y || exit 1
+
+if "$MKFS" --from-tar "$DIR/link.tar" "$DIR/link.img" > /dev/null && [ -z "$(./fcheck "$DIR/link.img" 2>&1)" ]; then
+    pass "a link to an earlier file builds a clean image"
+else
+    fail "a link to an earlier file does not build a clean image"
+fi
+
+"$MKFS" --from-tar "$DIR/only.tar" "$DIR/only.img" > /dev/null 2> "$DIR/only.err"
+status=$?
+if [ $status -eq 1 ] && grep -q "x links to y, which is not a file earlier in the archive" "$DIR/only.err"; then
+    pass "a link as the first entry is refused"
+else
+    fail "a link as the first entry exits with $status"
+fi
+
+exit $FAILED
@@ -3,14 +3,20 @@
 TOOLS_DEPS := tools/mkfs.d
 
 # all generated files
-TOOLS_CLEAN := tools/mkfs tools/mkfs.o $(TOOLS_DEPS)
+TOOLS_CLEAN := tools/mkfs tools/mkfs.o tools/fcheck.o tools/xv6z.o $(TOOLS_DEPS)
 
 # flags
 TOOLS_CPPFLAGS := -iquote include
 
-# mkfs
-tools/mkfs: tools/mkfs.o
-	$(CC) $(LDFLAGS) $< -o $@
+# mkfs, with the checker from the top level for --verify and zlib for --chunked
+tools/mkfs: tools/mkfs.o tools/fcheck.o tools/xv6z.o
+	$(CC) $(LDFLAGS) $^ -o $@ -pthread -lm -lz
+
+tools/fcheck.o: ../fcheck.c ../fcheck.h
+	$(CC) -c $(CFLAGS) -O -DFCHECK_NO_MAIN -o $@ $<
+
+tools/xv6z.o: ../xv6z.c ../xv6z.h
+	$(CC) -c $(CFLAGS) -O -o $@ $<
 
 # build object files from c files
 tools/%.o: tools/%.c
@@ -8,6 +8,14 @@
 #include <assert.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
 
 #define stat xv6_stat  // avoid clash with host struct stat
 #define dirent xv6_dirent  // avoid clash with host struct stat
@@ -16,30 +24,69 @@
 #include "stat.h"
 #undef stat
 #undef dirent
+#include "../../fcheck.h"
+#include "../../xv6z.h"
 
 #define BLOCK_SIZE (512)
+#define BLOCKS_PER_INODE 5  // geometry ratio when only one of --size and --ninodes is given
+#define MAXINODES 65536     // dirent.inum is a ushort
+#define MAXTHREADS 64
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23  // Linux 5.14
+#endif
+#ifndef O_TMPFILE
+#define O_TMPFILE (020000000 | O_DIRECTORY)  // Linux 3.11
+#endif
+#define FILL_RUN 256        // most blocks fill() reads with one pread()
+
+// Block placement, chosen with --layout=
+#define LAYOUT_LEGACY 0   // blocks in the order iappend() asks for them
+#define LAYOUT_EXTENT 1   // one extent per inode, reserved when it is allocated
+#define LAYOUT_CLUSTER 2  // extents, with every directory's next to the inode table
 
 int nblocks = 995;
 int ninodes = 200;
 int size = 1024;
+int headroom = 10;  // percent more than the tree needs, for --size/--ninodes=auto
 
 int fsfd;
-struct superblock sb;
-char zeroes[512];
+char *img;              // the whole image, a shared mapping of the output file
+struct dinode *inodes;  // every inode, copied to the inode blocks by iflush()
+static struct superblock sb;  // static, fcheck's is global
 uint freeblock;
 uint usedblocks;
+int policy = LAYOUT_LEGACY;
+uint *extent;           // per inode, the next block of its extent, when not legacy
+uint dirnext;           // LAYOUT_CLUSTER: the next block of the directory region
 uint bitblocks;
 uint freeinode = 1;
 uint root_inode;
+char *base;             // --base image, rebuilt incrementally
+char *manifest;         // --manifest file
+int verify;             // --verify: check the image before it replaces the output
+char *outtmp;           // the temporary file built into, once it has a name
+uint chunked;           // --chunked: bytes per chunk of a .xv6z output, 0 for a raw image
+int report;             // --report: print the seeks a walk of the image makes
 
+void geometry(char*, char*);
+void checkfit(void);
+uint metablocks(uint);
+int sizeworks(uint);
+void finish(void);
+void opentmp(char*);
+uint bitalloc(uint);
 void balloc(int);
+void bset(uint, uint);
+char *sect(uint);
 void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
-void rsect(uint sec, void *buf);
+void iflush(void);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
 
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
 // convert to intel byte order
 ushort
 xshort(ushort x)
@@ -64,17 +111,26 @@ xint(uint x)
 }
 
 
+// The image is built in a MAP_SHARED mapping of a temporary file next to
+// the output, which ftruncate() has already zero-filled and left sparse,
+// and which is renamed over the output once the build is done, so a build
+// that fails leaves the old image alone. Data and indirect
+// blocks are written in place, inodes stay in inodes[] until iflush(), and
+// the bitmap is written once by balloc(), so building costs no syscalls
+// beyond reading the source files. With --verify or --chunked the image is
+// built in anonymous memory instead, and written to the temporary file only
+// once finished: with --verify once fcheck passes it, and with --chunked as
+// compressed chunks.
 int 
 mkfs(int nblocks, int ninodes, int size) {
 
-  int i;
   char buf[BLOCK_SIZE];
 
   sb.size = xint(size);
   sb.nblocks = xint(nblocks); // so whole disk is size sectors
   sb.ninodes = xint(ninodes);
 
-  bitblocks = size/(512*8) + 1;
+  bitblocks = (size + BPB - 1) / BPB;
   usedblocks = ninodes / IPB + 3 + bitblocks;
   freeblock = usedblocks;
 
@@ -83,8 +139,22 @@ mkfs(int nblocks, int ninodes, int size) {
 
   assert(nblocks + usedblocks == size);
 
-  for(i = 0; i < nblocks + usedblocks; i++)
-    wsect(i, zeroes);
+  if(chunked || verify)
+    img = mmap(NULL, (size_t)size * BSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  else if(ftruncate(fsfd, (off_t)size * BSIZE) != 0){
+    perror("ftruncate");
+    exit(1);
+  } else
+    img = mmap(NULL, (size_t)size * BSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if(img == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+  inodes = calloc(ninodes / IPB + 1, BSIZE);
+  if(inodes == NULL){
+    perror("calloc");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -94,282 +164,1994 @@ mkfs(int nblocks, int ninodes, int size) {
   return 0;
 }
 
+// Building from a host tree takes three steps. scan() reads only metadata,
+// with getdents64 and fstatat relative to each directory's fd, and records
+// every entry in entries[]. layout() then walks entries[] on one thread,
+// giving out inodes and blocks in the same order the old recursive build
+// did and writing the directories, so the image never depends on timing.
+// Last, fill() copies file contents into the blocks already assigned to
+// them, on a pool of threads, with one pread() per run of consecutive blocks.
+
+struct entry {
+  char *name;     // host name, may be longer than DIRSIZ
+  int parent;     // index in entries[]
+  int child;      // first entry of a directory, -1 if none
+  int next;       // next entry in the same directory, -1 if none
+  int isdir;
+  int nchild;     // entries in a directory, . and .. not included
+  off_t size;
+  struct timespec mtime;
+  unsigned long long hash;  // of the contents, for the manifest
+  uint inum;
+};
+
+struct linux_dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct entry *entries;
+int nentries;
+int maxentries;
+int rootfd = -1;
+int *files;         // entries[] indices of the files fill() copies
+int nfiles;
+atomic_int nextfile;
+int nthreads = 4;   // fill() is mostly waiting on reads, so more than the CPUs
+
 int
-add_dir(DIR *cur_dir, int cur_inode, int parent_inode) {
-	int r;
-	int child_inode;
-	int cur_fd, child_fd;
-	struct xv6_dirent de;
-	struct dinode din;
-	struct dirent dir_buf;
-	struct dirent *entry;
-	struct stat st;
-	int bytes_read;
-	char buf[BLOCK_SIZE];
-	int off;
-
-	bzero(&de, sizeof(de));
-	de.inum = xshort(cur_inode);
-	strcpy(de.name, ".");
-	iappend(cur_inode, &de, sizeof(de));
-
-	bzero(&de, sizeof(de));
-	de.inum = xshort(parent_inode);
-	strcpy(de.name, "..");
-	iappend(cur_inode, &de, sizeof(de));
-
-	if (cur_dir == NULL) {
-		return 0;
-	}
-
-	cur_fd = dirfd(cur_dir);
-	if (cur_fd == -1){
-		perror("add_dir");
-		exit(EXIT_FAILURE);
-	}
-
-	if (fchdir(cur_fd) != 0){
-		perror("add_dir");
-		return -1;
-	}
-
-	while (true) {
-		r = readdir_r(cur_dir, &dir_buf, &entry);
-
-		if (r != 0) {
-			perror("add_dir");
-			return -1;
-		}
-
-		if (entry == NULL)
-			break;
-
-		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-			continue;
-
-		printf("%s\n", entry->d_name);
-
-		child_fd = open(entry->d_name, O_RDONLY);
-		if (child_fd == -1) {
-			perror("open");
-			return -1;
-		}
-
-		r = fstat(child_fd, &st);
-		if (r != 0) {
-			perror("stat");
-			return -1;
-		}
-
-		if (S_ISDIR(st.st_mode)) {
-      child_inode = ialloc(T_DIR);
-			r = add_dir(fdopendir(child_fd), child_inode, cur_inode);
-			if (r != 0) return r;
-			if (fchdir(cur_fd) != 0) {
-				perror("chdir");
-				return -1;
-			}
-		} else {
-			bytes_read = 0;
-	  		child_inode = ialloc(T_FILE);
-			bzero(&de, sizeof(de));
-			while((bytes_read = read(child_fd, buf, sizeof(buf))) > 0) {
-				iappend(child_inode, buf, bytes_read);
-			}
-		}
-		close(child_fd);
-
-		de.inum = xshort(child_inode);
-		strncpy(de.name, entry->d_name, DIRSIZ);
-		iappend(cur_inode, &de, sizeof(de));
-
-	}
-
-	// fix size of inode cur_dir
-	rinode(cur_inode, &din);
-	off = xint(din.size);
-	off = ((off/BSIZE) + 1) * BSIZE;
-	din.size = xint(off);
-	winode(cur_inode, &din);
-	return 0;
+addentry(char *name, int parent, int isdir, struct stat *st)
+{
+  struct entry *e;
+
+  if(nentries == maxentries){
+    maxentries = maxentries ? 2 * maxentries : 1024;
+    entries = realloc(entries, maxentries * sizeof(struct entry));
+    if(entries == NULL){
+      perror("realloc");
+      exit(1);
+    }
+  }
+  e = &entries[nentries];
+  e->name = strdup(name);
+  e->parent = parent;
+  e->child = -1;
+  e->next = -1;
+  e->isdir = isdir;
+  e->nchild = 0;
+  e->size = isdir ? 0 : st->st_size;
+  e->mtime = st->st_mtim;
+  e->hash = 0;
+  e->inum = 0;
+  return nentries++;
+}
+
+// Record the entries of directory dir, open as fd, in getdents order
+void
+scan(int fd, int dir)
+{
+  static char buf[32 * 1024];
+  struct linux_dirent64 *d;
+  struct stat st;
+  int n, off, e, last, childfd;
+
+  last = -1;
+  while((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0){
+    for(off = 0; off < n; off += d->d_reclen){
+      d = (struct linux_dirent64*)(buf + off);
+      if(strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+        continue;
+      if(d->d_type == DT_DIR){
+        memset(&st, 0, sizeof(st));
+        st.st_mode = S_IFDIR;
+      } else if(fstatat(fd, d->d_name, &st, 0) != 0){
+        perror(d->d_name);
+        exit(1);
+      }
+      e = addentry(d->d_name, dir, S_ISDIR(st.st_mode), &st);
+      entries[dir].nchild++;
+      if(last < 0)
+        entries[dir].child = e;
+      else
+        entries[last].next = e;
+      last = e;
+    }
+  }
+  if(n < 0){
+    perror("getdents64");
+    exit(1);
+  }
+
+  // Subdirectories once this directory's fd is no longer read from, so only
+  // one fd per level is open
+  for(e = entries[dir].child; e >= 0; e = entries[e].next){
+    if(!entries[e].isdir)
+      continue;
+    childfd = openat(fd, entries[e].name, O_RDONLY | O_DIRECTORY);
+    if(childfd < 0){
+      perror(entries[e].name);
+      exit(1);
+    }
+    scan(childfd, e);
+    close(childfd);
+  }
+}
+
+// Data and indirect blocks of a file of n bytes
+uint
+fileblocks(off_t n)
+{
+  uint b = (n + BSIZE - 1) / BSIZE;
+
+  return b + (b > NDIRECT);
+}
+
+// Blocks entry e will take, -1 for an empty root
+uint
+entryblocks(int e)
+{
+  if(e < 0)
+    return fileblocks(2 * sizeof(struct xv6_dirent));
+  if(entries[e].isdir)
+    return fileblocks((2 + entries[e].nchild) * sizeof(struct xv6_dirent));
+  return fileblocks(entries[e].size);
+}
+
+// Blocks layout() will give out for the scanned tree, or for its directories
+uint
+treeblocks(int dirs)
+{
+  uint n = 0;
+  int e;
+
+  if(nentries == 0)
+    return entryblocks(-1);
+  for(e = 0; e < nentries; e++){
+    if(entries[e].isdir || !dirs)
+      n += entryblocks(e);
+  }
+  return n;
+}
+
+// Set aside n consecutive blocks for inode inum, which allocblock() hands
+// out in order. Each inode gets one extent, with the indirect block where
+// iappend() asks for it: right before file block NDIRECT, the first one it
+// maps, which is also where the kernel's bmap() first reads it.
+void
+reserve(uint inum, uint n, int isdir)
+{
+  if(policy == LAYOUT_LEGACY)
+    return;
+  if(isdir && policy == LAYOUT_CLUSTER){
+    extent[inum] = dirnext;
+    dirnext += n;
+  } else {
+    extent[inum] = freeblock;
+    freeblock += n;
+  }
+}
+
+// Next block for inode inum
+uint
+allocblock(uint inum)
+{
+  usedblocks++;
+  if(base)
+    return bitalloc(inum);
+  if(policy == LAYOUT_LEGACY)
+    return freeblock++;
+  return extent[inum]++;
+}
+
+void
+dirappend(uint dir, uint inum, char *name)
+{
+  struct xv6_dirent de;
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strncpy(de.name, name, DIRSIZ);
+  iappend(dir, &de, sizeof(de));
 }
 
+// Give directory entry dir, already inode inum, its entries and their inodes
+// and blocks. File blocks are only reserved, fill() copies their contents.
+// dir is -1 for an empty root.
+static void
+layout(int dir, uint inum, uint parent)
+{
+  int e;
+  uint off;
+
+  dirappend(inum, inum, ".");
+  dirappend(inum, parent, "..");
+  if(dir < 0)
+    return;
 
+  for(e = entries[dir].child; e >= 0; e = entries[e].next){
+    printf("%s\n", entries[e].name);
+    if(entries[e].isdir){
+      entries[e].inum = ialloc(T_DIR);
+      reserve(entries[e].inum, entryblocks(e), 1);
+      layout(e, entries[e].inum, inum);
+    } else {
+      if(entries[e].size > MAXFILE * BSIZE){
+        fprintf(stderr, "mkfs: %s is %lld bytes, more than the %d an xv6 file holds\n",
+                entries[e].name, (long long)entries[e].size, (int)(MAXFILE * BSIZE));
+        exit(1);
+      }
+      entries[e].inum = ialloc(T_FILE);
+      reserve(entries[e].inum, entryblocks(e), 0);
+      iappend(entries[e].inum, NULL, entries[e].size);
+      files[nfiles++] = e;
+    }
+    dirappend(inum, entries[e].inum, entries[e].name);
+  }
 
+  // round the directory size past its last block, as xv6's mkfs always has
+  off = xint(inodes[inum].size);
+  off = ((off/BSIZE) + 1) * BSIZE;
+  inodes[inum].size = xint(off);
+}
 
+// Path of entry e relative to the root of the tree, its length or 0 if it
+// does not fit in n bytes
 int
-main(int argc, char *argv[])
+entrypath(int e, char *path, int n)
 {
-  int r;
-  DIR *root_dir;
+  int len, k;
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
-    exit(1);
+  len = 0;
+  if(entries[e].parent != 0){
+    len = entrypath(entries[e].parent, path, n);
+    if(len == 0)
+      return 0;
+    path[len++] = '/';
   }
+  k = strlen(entries[e].name);
+  if(len + k + 1 > n)
+    return 0;
+  memcpy(path + len, entries[e].name, k + 1);
+  return len + k;
+}
 
-  assert((512 % sizeof(struct dinode)) == 0);
-  assert((512 % sizeof(struct xv6_dirent)) == 0);
+// Block holding byte fbn * BSIZE of inode din
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  if(fbn < NDIRECT)
+    return xint(din->addrs[fbn]);
+  return xint(((uint*)sect(xint(din->addrs[NDIRECT])))[fbn - NDIRECT]);
+}
 
-  fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
-  if(fsfd < 0){
-    perror(argv[1]);
+// Block fbn of inode din, 0 if it has none
+uint
+iblock(struct dinode *din, uint fbn)
+{
+  if(fbn >= MAXFILE || (fbn >= NDIRECT && din->addrs[NDIRECT] == 0))
+    return 0;
+  return bmap(din, fbn);
+}
+
+// Copy the contents of file entry e into its blocks
+void
+fillfile(int e)
+{
+  static __thread char path[4096];
+  struct dinode *din = &inodes[entries[e].inum];
+  uint size = xint(din->size);
+  uint n = (size + BSIZE - 1) / BSIZE;
+  uint fbn, b, run;
+  size_t len, done;
+  ssize_t r;
+  int fd;
+
+  if(entrypath(e, path, sizeof(path)) == 0){
+    fprintf(stderr, "mkfs: %s: path too long\n", entries[e].name);
+    exit(1);
+  }
+  fd = openat(rootfd, path, O_RDONLY);
+  if(fd < 0){
+    perror(path);
     exit(1);
   }
+  for(fbn = 0; fbn < n; fbn += run){
+    b = bmap(din, fbn);
+    for(run = 1; fbn + run < n && run < FILL_RUN && bmap(din, fbn + run) == b + run; run++)
+      ;
+    len = min((size_t)run * BSIZE, size - (size_t)fbn * BSIZE);
+    sect(b + run - 1);
+    for(done = 0; done < len; done += r){
+      r = pread(fd, sect(b) + done, len - done, (off_t)fbn * BSIZE + done);
+      if(r < 0){
+        perror(path);
+        exit(1);
+      }
+      if(r == 0){
+        fprintf(stderr, "mkfs: %s shrank while the image was built\n", path);
+        exit(1);
+      }
+    }
+    // a rebuild on a --base image may reuse a block holding older data
+    memset(sect(b) + len, 0, (size_t)run * BSIZE - len);
+  }
+  close(fd);
+}
 
-  mkfs(995, 200, 1024);
+void*
+fillworker(void *arg)
+{
+  int i;
 
-  root_dir = opendir(argv[2]);
+  while((i = atomic_fetch_add(&nextfile, 1)) < nfiles)
+    fillfile(files[i]);
+  return NULL;
+}
 
-  root_inode = ialloc(T_DIR);
-  assert(root_inode == ROOTINO);
+void
+fill(void)
+{
+  pthread_t threads[MAXTHREADS];
+  int t;
 
-  r = add_dir(root_dir, root_inode, root_inode);
-  if (r != 0) {
-    exit(EXIT_FAILURE);
+  if(nthreads <= 1 || nfiles <= 1){
+    fillworker(NULL);
+    return;
+  }
+  for(t = 0; t < nthreads; t++){
+    if(pthread_create(&threads[t], NULL, fillworker, NULL) != 0){
+      perror("pthread_create");
+      exit(1);
+    }
   }
+  for(t = 0; t < nthreads; t++)
+    pthread_join(threads[t], NULL);
+}
 
-  balloc(usedblocks);
+// Incremental builds
+//
+// --manifest=FILE records each path of the tree with its size, mtime and a
+// hash of its contents, and the inode it went to. Given the image that
+// build wrote as --base=, the next build starts from a copy of it, and
+// touches only what changed. A file is kept when its size
+// and mtime match, or failing the mtime its hash. Changed files are
+// rewritten, keeping the blocks they need, paths that are gone free their
+// inodes and blocks in the bitmap, and a directory is rewritten only when
+// its entries changed. The result holds the same tree as a fresh build.
+// The copy is renamed over the output, and the manifest over the old one,
+// only once the build is done, so a build that fails halfway, even when
+// the output is the base itself, leaves both as they were.
 
-  exit(0);
+struct record {
+  char *path;
+  int isdir;
+  uint inum;
+  off_t size;
+  struct timespec mtime;
+  unsigned long long hash;
+  int seen;
+};
+
+struct record *records;
+int nrecords;
+int *rectab;          // records[] by path, open addressing, -1 for empty
+int rectabcap;
+uint bitnext;         // where bitalloc() starts looking
+uint written, kept, removed, dirswritten;
+
+// 64-bit hash of n bytes, a word at a time, continuing from h
+// Callers hash in pieces that are multiples of 8 bytes but for the last.
+unsigned long long
+hash64(unsigned long long h, char *p, size_t n)
+{
+  unsigned long long w;
+
+  for(; n >= 8; n -= 8, p += 8){
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  for(; n > 0; n--, p++)
+    h = (h ^ (uchar)*p) * 0x100000001b3ULL;
+  return h;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+// Hash of the contents of inode inum in the image
+unsigned long long
+ihash(uint inum)
+{
+  struct dinode *din = &inodes[inum];
+  uint size = xint(din->size);
+  uint fbn;
+  unsigned long long h = HASH_SEED;
+
+  for(fbn = 0; fbn * BSIZE < size; fbn++)
+    h = hash64(h, sect(bmap(din, fbn)), min(BSIZE, size - fbn * BSIZE));
+  return h;
 }
 
+// Hash of the contents of host file path, relative to the tree
+unsigned long long
+fhash(char *path)
+{
+  static char buf[64 * 1024];
+  unsigned long long h = HASH_SEED;
+  size_t n;
+  ssize_t r;
+  int fd;
+
+  fd = openat(rootfd, path, O_RDONLY);
+  if(fd < 0){
+    perror(path);
+    exit(1);
+  }
+  do {
+    // fill buf completely, so only the last piece is not a multiple of 8
+    for(n = 0; n < sizeof(buf) && (r = read(fd, buf + n, sizeof(buf) - n)) > 0; n += r)
+      ;
+    if(r < 0){
+      perror(path);
+      exit(1);
+    }
+    h = hash64(h, buf, n);
+  } while(n == sizeof(buf));
+  close(fd);
+  return h;
+}
+
+int*
+recslot(char *path)
+{
+  int *slot;
+
+  for(slot = &rectab[hash64(HASH_SEED, path, strlen(path)) & (rectabcap - 1)];
+      *slot >= 0 && strcmp(records[*slot].path, path) != 0;
+      slot = slot + 1 == rectab + rectabcap ? rectab : slot + 1)
+    ;
+  return slot;
+}
+
+// Manifest paths are one per line, with '\n' and '%' written as %0a and %25
 void
-wsect(uint sec, void *buf)
+putpath(FILE *f, char *path)
+{
+  for(; *path; path++){
+    if(*path == '\n' || *path == '%')
+      fprintf(f, "%%%02x", (uchar)*path);
+    else
+      putc(*path, f);
+  }
+}
+
+// Undo putpath() in place
+void
+unescape(char *path)
+{
+  char *p, hex[3] = "";
+
+  for(p = path; *path; p++){
+    if(path[0] == '%' && isxdigit((uchar)path[1]) && isxdigit((uchar)path[2])){
+      memcpy(hex, path + 1, 2);
+      *p = strtol(hex, NULL, 16);
+      path += 3;
+    } else
+      *p = *path++;
+  }
+  *p = '\0';
+}
+
+// Read the manifest of the --base image and check it against the image
+void
+readmanifest(void)
 {
-  if(lseek(fsfd, sec * 512L, 0) != sec * 512L){
-    perror("lseek");
+  FILE *f;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  struct record *r;
+  char type;
+  int msize, mninodes, n, i;
+  long long rsize, sec, nsec;
+
+  f = fopen(manifest, "r");
+  if(f == NULL){
+    perror(manifest);
     exit(1);
   }
-  if(write(fsfd, buf, 512) != 512){
-    perror("write");
+  if(fscanf(f, "mkfs manifest %d %d\n", &msize, &mninodes) != 2 || msize != size || mninodes != ninodes){
+    fprintf(stderr, "mkfs: %s is not the manifest of a %d block, %d inode image\n", manifest, size, ninodes);
+    exit(1);
+  }
+  while((len = getline(&line, &cap, f)) > 0){
+    if(line[len - 1] == '\n')
+      line[--len] = '\0';
+    records = realloc(records, (nrecords + 1) * sizeof(struct record));
+    if(records == NULL){
+      perror("realloc");
+      exit(1);
+    }
+    r = &records[nrecords];
+    if(sscanf(line, "%c %u %lld %lld.%lld %llx %n", &type, &r->inum, &rsize, &sec, &nsec, &r->hash, &n) != 6 ||
+       (type != 'f' && type != 'd') || line[n] == '\0'){
+      fprintf(stderr, "mkfs: %s: bad line %s\n", manifest, line);
+      exit(1);
+    }
+    r->isdir = type == 'd';
+    r->size = rsize;
+    r->mtime.tv_sec = sec;
+    r->mtime.tv_nsec = nsec;
+    r->path = strdup(line + n);
+    if(r->path == NULL){
+      perror("strdup");
+      exit(1);
+    }
+    unescape(r->path);
+    r->seen = 0;
+    if(r->inum <= ROOTINO || r->inum >= ninodes ||
+       xshort(inodes[r->inum].type) != (r->isdir ? T_DIR : T_FILE) ||
+       (!r->isdir && xint(inodes[r->inum].size) != r->size)){
+      fprintf(stderr, "mkfs: %s does not match the base image at %s\n", manifest, r->path);
+      exit(1);
+    }
+    nrecords++;
+  }
+  free(line);
+  fclose(f);
+
+  for(rectabcap = 16; rectabcap < 2 * nrecords; rectabcap *= 2)
+    ;
+  rectab = malloc(rectabcap * sizeof(int));
+  if(rectab == NULL){
+    perror("malloc");
     exit(1);
   }
+  memset(rectab, -1, rectabcap * sizeof(int));
+  for(i = 0; i < nrecords; i++)
+    *recslot(records[i].path) = i;
 }
 
-uint
-i2b(uint inum)
+// The manifest is written to FILE.tmp, and placemanifest() renames it
+// over FILE once the image is in place
+char manifesttmp[4096];
+
+void
+dropmanifest(void)
 {
-  return (inum / IPB) + 2;
+  if(manifesttmp[0])
+    unlink(manifesttmp);
 }
 
 void
-winode(uint inum, struct dinode *ip)
+writemanifest(void)
 {
-  char buf[512];
-  uint bn;
-  struct dinode *dip;
+  static char path[4096];
+  FILE *f;
+  int e;
 
-  bn = i2b(inum);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *dip = *ip;
-  wsect(bn, buf);
+  snprintf(manifesttmp, sizeof(manifesttmp), "%s.tmp", manifest);
+  f = fopen(manifesttmp, "w");
+  if(f == NULL){
+    perror(manifesttmp);
+    exit(1);
+  }
+  atexit(dropmanifest);
+  fprintf(f, "mkfs manifest %d %d\n", size, ninodes);
+  for(e = 1; e < nentries; e++){
+    // checkfit() refuses trees with longer paths, archives are only known now
+    if(entrypath(e, path, sizeof(path)) == 0){
+      fprintf(stderr, "mkfs: the path of %s is too long for the manifest\n", entries[e].name);
+      exit(1);
+    }
+    fprintf(f, "%c %u %lld %lld.%09ld %016llx ", entries[e].isdir ? 'd' : 'f', entries[e].inum,
+            (long long)entries[e].size, (long long)entries[e].mtime.tv_sec, entries[e].mtime.tv_nsec,
+            entries[e].hash);
+    putpath(f, path);
+    putc('\n', f);
+  }
+  if(fclose(f) != 0){
+    perror(manifesttmp);
+    exit(1);
+  }
 }
 
 void
-rinode(uint inum, struct dinode *ip)
+placemanifest(void)
 {
-  char buf[512];
-  uint bn;
-  struct dinode *dip;
-
-  bn = i2b(inum);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *ip = *dip;
+  if(rename(manifesttmp, manifest) != 0){
+    perror(manifest);
+    exit(1);
+  }
+  manifesttmp[0] = '\0';
 }
 
+// Start from the --base image: copy it to the temporary file for out, and
+// take the geometry from it
 void
-rsect(uint sec, void *buf)
+openbase(char *out)
 {
-  if(lseek(fsfd, sec * 512L, 0) != sec * 512L){
-    perror("lseek");
+  struct stat bst;
+  int bfd;
+  off_t off;
+  ssize_t n;
+  char buf[BLOCK_SIZE];
+
+  bfd = open(base, O_RDONLY);
+  if(bfd < 0 || fstat(bfd, &bst) != 0 || pread(bfd, buf, BSIZE, BSIZE) != BSIZE){
+    perror(base);
     exit(1);
   }
-  if(read(fsfd, buf, 512) != 512){
-    perror("read");
+  memmove(&sb, buf, sizeof(sb));
+  size = xint(sb.size);
+  ninodes = xint(sb.ninodes);
+  nblocks = xint(sb.nblocks);
+  if(size <= 0 || ninodes <= ROOTINO || ninodes > MAXINODES || !sizeworks(size) ||
+     metablocks(size) + nblocks != size || bst.st_size != (off_t)size * BSIZE){
+    fprintf(stderr, "mkfs: %s was not built by mkfs\n", base);
     exit(1);
   }
+  checkfit();
+
+  opentmp(out);
+  for(off = 0; off < bst.st_size; off += n){
+    n = syscall(SYS_copy_file_range, bfd, NULL, fsfd, NULL, (size_t)(bst.st_size - off), 0);
+    if(n <= 0 && (n = pread(bfd, buf, BSIZE, off)) > 0 && pwrite(fsfd, buf, n, off) != n)
+      n = -1;
+    if(n <= 0){
+      perror(out);
+      exit(1);
+    }
+  }
+  close(bfd);
 }
 
-uint
-ialloc(ushort type)
+int
+btest(uint b)
 {
-  uint inum = freeinode++;
-  struct dinode din;
+  uchar *map = (uchar*)sect(BBLOCK(0, ninodes));
 
-  bzero(&din, sizeof(din));
-  din.type = xshort(type);
-  din.nlink = xshort(1);
-  din.size = xint(0);
-  winode(inum, &din);
-  return inum;
+  return map[b / 8] >> (b % 8) & 1;
 }
 
 void
-balloc(int used)
+bfree(uint b)
 {
-  uchar buf[512];
-  int i;
+  uchar *map = (uchar*)sect(BBLOCK(0, ninodes));
 
-  printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < 512*8);
-  bzero(buf, 512);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(btest(b));
+  map[b / 8] &= ~(1 << (b % 8));
+}
+
+// Next block for inode inum on a --base image: the block after its last
+// one if that is free, else the first free one from bitnext on
+uint
+bitalloc(uint inum)
+{
+  uint b, start = size - nblocks;
+
+  b = extent[inum];
+  if(b < start || b >= size || btest(b)){
+    for(b = bitnext; b < size && btest(b); b++)
+      ;
+    if(b == size)
+      for(b = start; b < bitnext && btest(b); b++)
+        ;
+    if(b == size || (b == bitnext && btest(b))){
+      fprintf(stderr, "mkfs: the %d block base image is full\n", size);
+      exit(1);
+    }
   }
-  printf("balloc: write bitmap block at sector %zu\n", ninodes/IPB + 3);
-  wsect(ninodes / IPB + 3, buf);
+  bset(b, b + 1);
+  memset(sect(b), 0, BSIZE);  // a free block may still hold what it did
+  extent[inum] = b + 1;
+  bitnext = b + 1 < size ? b + 1 : start;
+  return b;
 }
 
-#define min(a, b) ((a) < (b) ? (a) : (b))
+// Free the blocks of inode inum from file block keep on
+void
+itrunc(uint inum, uint keep)
+{
+  struct dinode *din = &inodes[inum];
+  uint *indirect;
+  uint fbn;
+
+  for(fbn = keep; fbn < NDIRECT; fbn++){
+    if(din->addrs[fbn]){
+      bfree(xint(din->addrs[fbn]));
+      din->addrs[fbn] = 0;
+    }
+  }
+  if(din->addrs[NDIRECT] == 0)
+    return;
+  indirect = (uint*)sect(xint(din->addrs[NDIRECT]));
+  for(fbn = keep > NDIRECT ? keep : NDIRECT; fbn < MAXFILE; fbn++){
+    if(indirect[fbn - NDIRECT]){
+      bfree(xint(indirect[fbn - NDIRECT]));
+      indirect[fbn - NDIRECT] = 0;
+    }
+  }
+  if(keep <= NDIRECT){
+    bfree(xint(din->addrs[NDIRECT]));
+    din->addrs[NDIRECT] = 0;
+  }
+}
 
+// Replace the contents of inode inum with n bytes, keeping the blocks it
+// already has as far as they go. buf NULL leaves the contents to fill(),
+// which clears the rest of the last block as this does.
 void
-iappend(uint inum, void *xp, int n)
+rewrite(uint inum, char *buf, uint n)
 {
-  char *p = (char*)xp;
-  uint fbn, off, n1;
-  struct dinode din;
-  char buf[512];
-  uint indirect[NINDIRECT];
-  uint x;
+  itrunc(inum, (n + BSIZE - 1) / BSIZE);
+  inodes[inum].size = 0;
+  extent[inum] = 0;
+  iappend(inum, buf, n);
+  if(buf && n % BSIZE)
+    memset(sect(bmap(&inodes[inum], n / BSIZE)) + n % BSIZE, 0, BSIZE - n % BSIZE);
+}
 
-  rinode(inum, &din);
+// Whether file entry e, at path, still has the contents record r describes
+int
+unchanged(int e, char *path, struct record *r)
+{
+  if(entries[e].size != r->size)
+    return 0;
+  if(entries[e].mtime.tv_sec == r->mtime.tv_sec && entries[e].mtime.tv_nsec == r->mtime.tv_nsec)
+    return 1;
+  return fhash(path) == r->hash;
+}
 
-  off = xint(din.size);
-  while(n > 0){
-    fbn = off / 512;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-        usedblocks++;
+// Bring directory entry dir, inode inum, up to date with the tree
+void
+rebuild(int dir, uint inum, uint parent)
+{
+  static char path[4096];
+  struct record *r;
+  struct xv6_dirent *de;
+  uint len, nb, fbn, b, k, off;
+  int e, same;
+
+  for(e = entries[dir].child; e >= 0; e = entries[e].next){
+    if(entries[e].isdir){
+      if(entries[e].inum == 0)
+        entries[e].inum = ialloc(T_DIR);
+      rebuild(e, entries[e].inum, inum);
+      continue;
+    }
+    if(entries[e].size > MAXFILE * BSIZE){
+      fprintf(stderr, "mkfs: %s is %lld bytes, more than the %d an xv6 file holds\n",
+              entries[e].name, (long long)entries[e].size, (int)(MAXFILE * BSIZE));
+      exit(1);
+    }
+    if(entries[e].inum){
+      entrypath(e, path, sizeof(path));
+      r = &records[*recslot(path)];
+      if(unchanged(e, path, r)){
+        entries[e].hash = r->hash;
+        kept++;
+        continue;
       }
-      x = xint(din.addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        // printf("allocate indirect block\n");
-        din.addrs[NDIRECT] = xint(freeblock++);
-        usedblocks++;
-      }
-      // printf("read indirect block\n");
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        usedblocks++;
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
+      entries[e].inum = ialloc(T_FILE);
     }
-    n1 = min(n, (fbn + 1) * 512 - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * 512), n1);
-    wsect(x, buf);
-    n -= n1;
-    off += n1;
-    p += n1;
+    rewrite(entries[e].inum, NULL, entries[e].size);
+    files[nfiles++] = e;
+    written++;
   }
-  din.size = xint(off);
-  winode(inum, &din);
+
+  // The blocks a fresh build would give the directory, compared with the
+  // ones it has
+  len = (2 + entries[dir].nchild) * sizeof(*de);
+  nb = (len + BSIZE - 1) / BSIZE;
+  de = calloc(nb, BSIZE);
+  if(de == NULL){
+    perror("calloc");
+    exit(1);
+  }
+  de[0].inum = xshort(inum);
+  strcpy(de[0].name, ".");
+  de[1].inum = xshort(parent);
+  strcpy(de[1].name, "..");
+  for(k = 2, e = entries[dir].child; e >= 0; k++, e = entries[e].next){
+    de[k].inum = xshort(entries[e].inum);
+    strncpy(de[k].name, entries[e].name, DIRSIZ);
+  }
+  same = xint(inodes[inum].size) == (len / BSIZE + 1) * BSIZE && iblock(&inodes[inum], nb) == 0;
+  for(fbn = 0; same && fbn < nb; fbn++){
+    b = iblock(&inodes[inum], fbn);
+    same = b != 0 && memcmp(sect(b), (char*)de + fbn * BSIZE, BSIZE) == 0;
+  }
+  if(!same){
+    rewrite(inum, (char*)de, len);
+    off = xint(inodes[inum].size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    inodes[inum].size = xint(off);
+    dirswritten++;
+  }
+  free(de);
+}
+
+// Rebuild the --base image for the tree at entry root
+void
+incremental(int root)
+{
+  static char path[4096];
+  int e, *slot, i;
+
+  if(root < 0){
+    fprintf(stderr, "mkfs: --base needs a tree to rebuild from\n");
+    exit(1);
+  }
+  memmove(inodes, sect(IBLOCK(0)), (ninodes / IPB + 1) * BSIZE);
+  extent = calloc(ninodes, sizeof(uint));
+  if(extent == NULL){
+    perror("calloc");
+    exit(1);
+  }
+  bitnext = size - nblocks;
+  readmanifest();
+
+  // Paths still there keep their inodes, the rest are freed first so
+  // their blocks can be reused
+  for(e = 1; e < nentries; e++){
+    if(entrypath(e, path, sizeof(path)) == 0)
+      continue;
+    slot = recslot(path);
+    if(*slot >= 0 && records[*slot].isdir == entries[e].isdir){
+      entries[e].inum = records[*slot].inum;
+      records[*slot].seen = 1;
+    }
+  }
+  for(i = 0; i < nrecords; i++){
+    if(records[i].seen)
+      continue;
+    itrunc(records[i].inum, 0);
+    memset(&inodes[records[i].inum], 0, sizeof(struct dinode));
+    removed++;
+  }
+
+  root_inode = ROOTINO;
+  entries[root].inum = ROOTINO;
+  rebuild(root, ROOTINO, ROOTINO);
+  printf("incremental: %u files rewritten, %u kept, %u paths removed, %u directories rewritten\n",
+         written, kept, removed, dirswritten);
+}
+
+// Building from a tar archive
+//
+// --from-tar reads a ustar or pax archive, GNU long names included, in one
+// pass, so it can come down a pipe. There is no tree to scan first, so each
+// entry is placed as it arrives: a file gets its inode and blocks and its
+// data is read straight into them, and a directory, named or implied by the
+// paths under it, gets its inode. Directory blocks come last, once all their
+// entries are known, with the sizes rounded as layout() rounds them. Only
+// the entries' metadata stays in memory. Hard links become copies, as they
+// do when mkfs reads a tree; symlinks, devices and fifos are skipped.
+
+struct tarheader {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];      // "ustar" and a NUL for POSIX, "ustar " for GNU
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];   // POSIX only
+  char pad[12];
+};
+
+int tarfd;
+long long taroff;     // bytes of the archive read, for errors
+int *tartab;          // entries[] by parent and name, -1 for empty
+int tartabcap;
+
+// Read exactly n bytes of the archive into buf
+void
+tarread(void *buf, size_t n)
+{
+  ssize_t r;
+
+  for(; n > 0; n -= r, buf = (char*)buf + r, taroff += r){
+    r = read(tarfd, buf, n);
+    if(r < 0){
+      perror("read");
+      exit(1);
+    }
+    if(r == 0){
+      fprintf(stderr, "mkfs: the archive ends early, at byte %lld\n", taroff);
+      exit(1);
+    }
+  }
+}
+
+// Skip the data of an entry of n bytes and its padding
+void
+tarskip(long long n)
+{
+  static char buf[64 * 1024];
+  size_t k;
+
+  for(n = (n + BSIZE - 1) / BSIZE * BSIZE; n > 0; n -= k){
+    k = min(n, (long long)sizeof(buf));
+    tarread(buf, k);
+  }
+}
+
+// Read the data of an entry of n bytes, metadata such as a pax header or a
+// GNU long name, NUL-terminated
+char*
+tardata(long long n)
+{
+  char *p;
+
+  if(n > 1024 * 1024){
+    fprintf(stderr, "mkfs: a %lld byte tar header at byte %lld is too long\n", n, taroff);
+    exit(1);
+  }
+  p = malloc((n + BSIZE - 1) / BSIZE * BSIZE + 1);
+  if(p == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  tarread(p, (n + BSIZE - 1) / BSIZE * BSIZE);
+  p[n] = '\0';
+  return p;
+}
+
+// A numeric header field: octal, or base-256 when the top bit is set
+long long
+tarnum(char *p, int n)
+{
+  long long v = 0;
+  int i;
+
+  if(*p & 0x80){
+    v = *p & 0x3f;
+    for(i = 1; i < n; i++)
+      v = v << 8 | (uchar)p[i];
+    return v;
+  }
+  for(i = 0; i < n && (p[i] == ' ' || p[i] == '\0'); i++)
+    ;
+  for(; i < n && p[i] >= '0' && p[i] <= '7'; i++)
+    v = v * 8 + p[i] - '0';
+  return v;
+}
+
+int*
+tarslot(int parent, char *name)
+{
+  int *slot;
+
+  for(slot = &tartab[hash64(HASH_SEED + parent, name, strlen(name)) & (tartabcap - 1)];
+      *slot >= 0 && (entries[*slot].parent != parent || strcmp(entries[*slot].name, name) != 0);
+      slot = slot + 1 == tartab + tartabcap ? tartab : slot + 1)
+    ;
+  return slot;
+}
+
+// Entry name of directory dir, added if missing
+int
+tarchild(int dir, char *name, int isdir, struct stat *st)
+{
+  int *slot, e;
+
+  if(2 * (nentries + 1) > tartabcap){
+    tartabcap = tartabcap ? 2 * tartabcap : 1024;
+    free(tartab);
+    tartab = malloc(tartabcap * sizeof(int));
+    if(tartab == NULL){
+      perror("malloc");
+      exit(1);
+    }
+    memset(tartab, -1, tartabcap * sizeof(int));
+    for(e = 1; e < nentries; e++)
+      *tarslot(entries[e].parent, entries[e].name) = e;
+  }
+  slot = tarslot(dir, name);
+  if(*slot >= 0)
+    return *slot;
+
+  // entries are prepended, tardirs() puts them back in archive order
+  e = addentry(name, dir, isdir, st);
+  entries[e].next = entries[dir].child;
+  entries[dir].child = e;
+  entries[dir].nchild++;
+  if(isdir)
+    entries[e].inum = ialloc(T_DIR);
+  *tarslot(dir, name) = e;
+  return e;
+}
+
+// Entry for path, with the directories above it, or -1 if create is 0 and
+// it is missing. The root for an empty path.
+int
+tarpath(int root, char *path, int isdir, struct stat *st, int create)
+{
+  static struct stat dirst;
+  char *copy, *name, *end;
+  int e, last;
+
+  copy = strdup(path);
+  if(copy == NULL){
+    perror("strdup");
+    exit(1);
+  }
+  e = root;
+  for(name = copy; *name; name = end){
+    for(end = name; *end && *end != '/'; end++)
+      ;
+    last = *end == '\0' || end[strspn(end, "/")] == '\0';
+    if(*end)
+      *end++ = '\0';
+    if(*name == '\0' || strcmp(name, ".") == 0)
+      continue;
+    if(strcmp(name, "..") == 0){
+      fprintf(stderr, "mkfs: %s goes outside the archive\n", path);
+      exit(1);
+    }
+    if(!entries[e].isdir){
+      fprintf(stderr, "mkfs: %s is under a file in the archive\n", path);
+      exit(1);
+    }
+    if(!create){
+      // tartab is only allocated by the first tarchild()
+      e = tartab ? *tarslot(e, name) : -1;
+      if(e < 0)
+        break;
+    } else {
+      e = tarchild(e, name, last ? isdir : 1, last ? st : &dirst);
+    }
+    if(last)
+      break;
+  }
+  free(copy);
+  return e;
+}
+
+// Fail before n more blocks, for what, run past the end of the image
+void
+tarroom(char *what, uint n)
+{
+  if(freeblock + n > size){
+    fprintf(stderr, "mkfs: the archive does not fit in the %d block image, %s would end past it\n", size, what);
+    exit(1);
+  }
+}
+
+// Give file entry e its inode and blocks and read its contents into them,
+// or for a hard link copy them from file entry from
+void
+tarfile(int e, char *path, int from)
+{
+  struct dinode *din;
+  off_t len = entries[e].size;
+  uint n, fbn, b, run;
+
+  if(len > MAXFILE * BSIZE){
+    fprintf(stderr, "mkfs: %s is %lld bytes, more than the %d an xv6 file holds\n",
+            path, (long long)len, (int)(MAXFILE * BSIZE));
+    exit(1);
+  }
+  tarroom(path, fileblocks(len));
+  entries[e].inum = ialloc(T_FILE);
+  reserve(entries[e].inum, fileblocks(len), 0);
+  iappend(entries[e].inum, NULL, len);
+
+  din = &inodes[entries[e].inum];
+  n = (len + BSIZE - 1) / BSIZE;
+  if(from >= 0){
+    for(fbn = 0; fbn < n; fbn++)
+      memmove(sect(bmap(din, fbn)), sect(bmap(&inodes[entries[from].inum], fbn)), BSIZE);
+    return;
+  }
+  for(fbn = 0; fbn < n; fbn += run){
+    b = bmap(din, fbn);
+    for(run = 1; fbn + run < n && bmap(din, fbn + run) == b + run; run++)
+      ;
+    tarread(sect(b), (size_t)run * BSIZE);
+  }
+  // the padding should be zeros already, but is not checked
+  if(len % BSIZE)
+    memset(sect(bmap(din, n - 1)) + len % BSIZE, 0, BSIZE - len % BSIZE);
+}
+
+// Read the archive into entries[] and the image, under entry root
+void
+untar(int root)
+{
+  struct tarheader h;
+  struct stat st;
+  char *longname = NULL, *longlink = NULL, *paxpath = NULL, *paxlink = NULL;
+  char *pax, *p, *key, *val, *path, *link;
+  char name[256 + 1], linkname[100 + 1];
+  long long n, len, paxsize = -1;
+  struct timespec paxmtime = { -1, 0 };
+  uint sum;
+  int e, from, i;
+
+  for(;;){
+    tarread(&h, sizeof(h));
+    for(sum = 0, i = 0; i < sizeof(h); i++)
+      sum += (uchar)(i >= offsetof(struct tarheader, chksum) &&
+                     i < offsetof(struct tarheader, typeflag) ? ' ' : ((char*)&h)[i]);
+    if(sum == 8 * ' ')
+      break;  // a zero block ends the archive
+    if(sum != tarnum(h.chksum, sizeof(h.chksum))){
+      fprintf(stderr, "mkfs: bad tar header checksum at byte %lld\n", taroff - BSIZE);
+      exit(1);
+    }
+    n = paxsize >= 0 ? paxsize : tarnum(h.size, sizeof(h.size));
+
+    switch(h.typeflag){
+    case 'x':  // pax attributes of the next entry, "len key=value\n" records
+      pax = tardata(n);
+      for(p = pax; p < pax + n; p += len){
+        len = strtoll(p, &key, 10);
+        if(len <= 0 || p + len > pax + n || *key != ' ' || p[len - 1] != '\n' ||
+           (val = memchr(key, '=', p + len - key)) == NULL){
+          fprintf(stderr, "mkfs: bad pax header before byte %lld\n", taroff);
+          exit(1);
+        }
+        key++;
+        *val++ = '\0';
+        p[len - 1] = '\0';
+        if(strcmp(key, "path") == 0)
+          paxpath = strdup(val);
+        else if(strcmp(key, "linkpath") == 0)
+          paxlink = strdup(val);
+        else if(strcmp(key, "size") == 0)
+          paxsize = strtoll(val, NULL, 10);
+        else if(strcmp(key, "mtime") == 0){
+          paxmtime.tv_sec = strtoll(val, &val, 10);
+          paxmtime.tv_nsec = 0;
+          if(*val == '.')
+            for(i = 0, val++; i < 9; i++)
+              paxmtime.tv_nsec = paxmtime.tv_nsec * 10 + (isdigit((uchar)*val) ? *val++ - '0' : 0);
+        }
+      }
+      free(pax);
+      continue;
+    case 'g':  // global pax attributes, nothing mkfs keeps
+      tarskip(n);
+      continue;
+    case 'L':  // GNU long name of the next entry
+      free(longname);
+      longname = tardata(n);
+      continue;
+    case 'K':  // GNU long link name of the next entry
+      free(longlink);
+      longlink = tardata(n);
+      continue;
+    }
+
+    if(longname)
+      path = longname;
+    else if(paxpath)
+      path = paxpath;
+    else {
+      if(memcmp(h.magic, "ustar", 6) == 0 && h.prefix[0])
+        snprintf(name, sizeof(name), "%.155s/%.100s", h.prefix, h.name);
+      else
+        snprintf(name, sizeof(name), "%.100s", h.name);
+      path = name;
+    }
+    link = longlink ? longlink : paxlink;
+    if(link == NULL){
+      snprintf(linkname, sizeof(linkname), "%.100s", h.linkname);
+      link = linkname;
+    }
+    memset(&st, 0, sizeof(st));
+    st.st_size = n;
+    st.st_mtim.tv_sec = paxmtime.tv_sec >= 0 ? paxmtime.tv_sec : tarnum(h.mtime, sizeof(h.mtime));
+    st.st_mtim.tv_nsec = paxmtime.tv_sec >= 0 ? paxmtime.tv_nsec : 0;
+
+    switch(h.typeflag){
+    case '0':
+    case '\0':
+    case '7':
+      e = tarpath(root, path, 0, &st, 1);
+      if(entries[e].isdir || entries[e].inum){
+        fprintf(stderr, "mkfs: %s is in the archive twice\n", path);
+        exit(1);
+      }
+      tarfile(e, path, -1);
+      break;
+    case '1':
+      from = tarpath(root, link, 0, &st, 0);
+      if(from < 0 || entries[from].isdir || entries[from].inum == 0){
+        fprintf(stderr, "mkfs: %s links to %s, which is not a file earlier in the archive\n", path, link);
+        exit(1);
+      }
+      st.st_size = entries[from].size;
+      e = tarpath(root, path, 0, &st, 1);
+      if(entries[e].isdir || entries[e].inum){
+        fprintf(stderr, "mkfs: %s is in the archive twice\n", path);
+        exit(1);
+      }
+      tarfile(e, path, from);
+      tarskip(n);
+      break;
+    case '5':
+      e = tarpath(root, path, 1, &st, 1);
+      if(!entries[e].isdir){
+        fprintf(stderr, "mkfs: %s is both a file and a directory in the archive\n", path);
+        exit(1);
+      }
+      entries[e].mtime = st.st_mtim;
+      tarskip(n);
+      break;
+    default:
+      fprintf(stderr, "mkfs: skipping %s, xv6 has only files and directories\n", path);
+      tarskip(n);
+      break;
+    }
+
+    free(longname);
+    free(longlink);
+    free(paxpath);
+    free(paxlink);
+    longname = longlink = paxpath = paxlink = NULL;
+    paxsize = -1;
+    paxmtime.tv_sec = -1;
+  }
+}
+
+// Write the entries of directory entry dir, inode inum, and of the
+// directories under it
+void
+tardirs(int dir, uint inum, uint parent)
+{
+  int e, prev, next;
+  uint off;
+
+  for(prev = -1, e = entries[dir].child; e >= 0; prev = e, e = next){
+    next = entries[e].next;
+    entries[e].next = prev;
+  }
+  entries[dir].child = prev;
+
+  reserve(inum, entryblocks(dir), 1);
+  dirappend(inum, inum, ".");
+  dirappend(inum, parent, "..");
+  for(e = entries[dir].child; e >= 0; e = entries[e].next)
+    dirappend(inum, entries[e].inum, entries[e].name);
+  off = xint(inodes[inum].size);
+  off = ((off/BSIZE) + 1) * BSIZE;
+  inodes[inum].size = xint(off);
+
+  for(e = entries[dir].child; e >= 0; e = entries[e].next){
+    if(entries[e].isdir)
+      tardirs(e, entries[e].inum, inum);
+  }
+}
+
+// Build the image from the archive at name, - for stdin
+void
+tarbuild(char *name)
+{
+  struct stat st;
+  char buf[BLOCK_SIZE];
+  int root, e;
+
+  tarfd = strcmp(name, "-") == 0 ? 0 : open(name, O_RDONLY);
+  if(tarfd < 0){
+    perror(name);
+    exit(1);
+  }
+  if(policy != LAYOUT_LEGACY){
+    extent = calloc(ninodes, sizeof(uint));
+    if(extent == NULL){
+      perror("calloc");
+      exit(1);
+    }
+  }
+
+  memset(&st, 0, sizeof(st));
+  root = addentry(name, -1, 1, &st);
+  root_inode = ialloc(T_DIR);
+  assert(root_inode == ROOTINO);
+  entries[root].inum = root_inode;
+  untar(root);
+
+  // Whatever follows the end, such as tar's padding to a whole record, is
+  // read so a writer on a pipe does not fail
+  while(read(tarfd, buf, sizeof(buf)) > 0)
+    ;
+
+  tarroom("its directories", treeblocks(1));
+  tardirs(root, root_inode, root_inode);
+  assert(freeblock == usedblocks);
+
+  files = realloc(files, (nentries + 1) * sizeof(int));
+  if(files == NULL){
+    perror("realloc");
+    exit(1);
+  }
+  for(e = 0; e < nentries; e++){
+    if(!entries[e].isdir)
+      files[nfiles++] = e;
+  }
+  finish();
+  balloc(usedblocks);
+}
+
+// Head movement reading the image in the order a recursive walk of it does,
+// to compare layouts without a disk (--report): a read that is not of the
+// block just read or the one after it is a seek
+struct walk {
+  uint last;
+  uint seeks;
+  unsigned long long distance;
+  uint extents;   // runs of consecutive blocks, over the inodes walked
+  uint ninode;
+};
+
+void
+walkread(struct walk *w, uint b)
+{
+  if(b != w->last && b != w->last + 1){
+    w->seeks++;
+    w->distance += b > w->last ? b - w->last : w->last - b;
+  }
+  w->last = b;
+}
+
+// Walk inode inum: its inode, then its blocks in the order bmap() reads
+// them, indirect block included, for directories and, with data, files too
+void
+walkinode(struct walk *w, uint inum, int data)
+{
+  struct dinode *din = &inodes[inum];
+  struct xv6_dirent *de;
+  uint n, fbn, b, prev, k;
+
+  w->ninode++;
+  walkread(w, IBLOCK(inum));
+  if(xshort(din->type) != T_DIR && !data)
+    return;
+  n = (xint(din->size) + BSIZE - 1) / BSIZE;
+  prev = 0;
+  for(fbn = 0; fbn < n; fbn++){
+    if(fbn == NDIRECT && din->addrs[NDIRECT]){
+      b = xint(din->addrs[NDIRECT]);
+      walkread(w, b);
+      w->extents += b != prev + 1;
+      prev = b;
+    }
+    if((fbn < NDIRECT && din->addrs[fbn] == 0) || (b = bmap(din, fbn)) == 0)
+      continue;
+    walkread(w, b);
+    w->extents += b != prev + 1;
+    prev = b;
+  }
+  if(xshort(din->type) != T_DIR)
+    return;
+
+  for(fbn = 0; fbn < n; fbn++){
+    if((fbn < NDIRECT && din->addrs[fbn] == 0) || (b = bmap(din, fbn)) == 0)
+      continue;
+    de = (struct xv6_dirent*)sect(b);
+    for(k = 0; k < BSIZE / sizeof(*de); k++){
+      if(de[k].inum == 0 || strcmp(de[k].name, ".") == 0 || strcmp(de[k].name, "..") == 0)
+        continue;
+      walkinode(w, xshort(de[k].inum), data);
+    }
+  }
+}
+
+// Compare layouts: seeks to list the whole tree and to read all of it
+void
+walkreport(void)
+{
+  struct walk list, read;
+
+  memset(&list, 0, sizeof(list));
+  memset(&read, 0, sizeof(read));
+  walkinode(&list, root_inode, 0);
+  walkinode(&read, root_inode, 1);
+  printf("layout: %u extents over %u inodes; listing %u seeks over %llu blocks; "
+         "reading %u seeks over %llu blocks\n",
+         read.extents, read.ninode, list.seeks, list.distance, read.seeks, read.distance);
+}
+
+// Open the temporary file next to out the image is built into. It has no name
+// (O_TMPFILE) until replaceout() links it in just before renaming it over
+// out, so a build killed on the way leaves nothing behind. Where O_TMPFILE
+// or /proc is missing it is a mkstemp() file, removed again at exit.
+void
+droptmp(void)
+{
+  if(outtmp)
+    unlink(outtmp);
+}
+
+void
+opentmp(char *out)
+{
+  char *dir, *slash;
+  mode_t mask;
+
+  outtmp = malloc(strlen(out) + 32);
+  dir = strdup(out);
+  if(outtmp == NULL || dir == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  slash = strrchr(dir, '/');
+  if(slash == NULL)
+    strcpy(dir, ".");
+  else
+    slash[slash == dir] = '\0';
+  fsfd = -1;
+  if(access("/proc/self/fd", X_OK) == 0)
+    fsfd = open(dir, O_TMPFILE | O_RDWR, 0666);
+  free(dir);
+  if(fsfd >= 0){
+    free(outtmp);
+    outtmp = NULL;
+    return;
+  }
+
+  sprintf(outtmp, "%s.XXXXXX", out);
+  mask = umask(0);
+  umask(mask);
+  if((fsfd = mkstemp(outtmp)) < 0 || fchmod(fsfd, 0666 & ~mask) != 0){
+    perror(outtmp);
+    exit(1);
+  }
+  atexit(droptmp);
+}
+
+// Run fcheck's checks on the finished image, still in memory, and only if
+// it passes write it out and put it in place of out with replaceout(). A
+// failed image is never written anywhere.
+void
+verifyimage(char *out)
+{
+  struct timespec start, end;
+  int r;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  r = fcheck_check_buffer(img, (size_t)size * BSIZE);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if(r != FCHECK_CLEAN){
+    fprintf(stderr, "mkfs: %s is not written, the image fails fcheck: %s\n", out,
+            r == FCHECK_NO_MEMORY ? "out of memory" :
+            r == FCHECK_BAD_SUPERBLOCK ? "bad superblock." : fcheck_last_error());
+    exit(1);
+  }
+  printf("verify: clean in %.1f ms\n",
+         (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+// Write the image built in memory to the output, leaving runs of zero
+// blocks as holes the way ftruncate() does for a mapped build. Nothing is
+// allocated past usedblocks, so those pages are never touched.
+int
+zeroblock(uint b)
+{
+  long *p = (long*)(img + (size_t)b * BSIZE);
+  int k;
+
+  for(k = 0; k < BSIZE / sizeof(long); k++)
+    if(p[k] != 0)
+      return 0;
+  return 1;
+}
+
+void
+writeimage(void)
+{
+  uint b, e;
+  size_t n;
+  ssize_t w;
+  char *p;
+
+  for(b = 0; b < usedblocks; b = e){
+    while(b < usedblocks && zeroblock(b))
+      b++;
+    for(e = b; e < usedblocks && !zeroblock(e); e++)
+      ;
+    p = img + (size_t)b * BSIZE;
+    for(n = (size_t)(e - b) * BSIZE; n > 0; n -= w, p += w){
+      if((w = pwrite(fsfd, p, n, p - img)) <= 0){
+        perror("write");
+        exit(1);
+      }
+    }
+  }
+  if(ftruncate(fsfd, (off_t)size * BSIZE) != 0){
+    perror("ftruncate");
+    exit(1);
+  }
+}
+
+// Put the temporary file in place of out
+void
+replaceout(char *out)
+{
+  char proc[32];
+  int k;
+
+  if(outtmp == NULL){
+    outtmp = malloc(strlen(out) + 32);
+    if(outtmp == NULL){
+      perror("malloc");
+      exit(1);
+    }
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fsfd);
+    for(k = 0;; k++){
+      sprintf(outtmp, "%s.%d.%d", out, getpid(), k);
+      if(linkat(AT_FDCWD, proc, AT_FDCWD, outtmp, AT_SYMLINK_FOLLOW) == 0)
+        break;
+      if(errno != EEXIST){
+        perror(outtmp);
+        exit(1);
+      }
+    }
+  }
+  if(rename(outtmp, out) != 0){
+    perror(out);
+    unlink(outtmp);
+    exit(1);
+  }
+  free(outtmp);
+  outtmp = NULL;
+}
+
+// Write the finished image as a .xv6z file (--chunked), compressing its
+// chunks on the fill() threads
+void
+writechunked(void)
+{
+  struct xv6z_stats st;
+
+  if(xv6z_write(fsfd, img, (size_t)size * BSIZE, chunked, nthreads, &st) != 0){
+    perror("write");
+    exit(1);
+  }
+  printf("chunked: %u of %u chunks of %u KiB stored, %llu bytes, %.1f%% of the image\n",
+         st.stored, st.nchunks, chunked / 1024, st.file_bytes, 100.0 * st.file_bytes / ((size_t)size * BSIZE));
+}
+
+// Build the image for the tree at entry root, -1 for none, from scratch
+void
+build(int root)
+{
+  uint used;
+
+  // Fault in every block the tree will use in one sequential pass. Left to
+  // layout(), the scattered directory and indirect blocks it writes first
+  // would break the later fill() writes into three times as many page faults.
+  // Only an optimization, so kernels without it are fine.
+  used = usedblocks + treeblocks(0);
+  madvise(img, (size_t)min(used, size) * BSIZE, MADV_POPULATE_WRITE);
+
+  if(policy != LAYOUT_LEGACY){
+    extent = calloc(ninodes, sizeof(uint));
+    if(extent == NULL){
+      perror("calloc");
+      exit(1);
+    }
+  }
+  if(policy == LAYOUT_CLUSTER){
+    dirnext = freeblock;
+    freeblock += treeblocks(1);
+  }
+
+  root_inode = ialloc(T_DIR);
+  assert(root_inode == ROOTINO);
+  reserve(root_inode, entryblocks(root), 1);
+  layout(root, root_inode, root_inode);
+  fill();
+  assert(freeblock == used && usedblocks == used);
+
+  finish();
+  balloc(usedblocks);
+}
+
+// Record what the tree's files hold for the manifest and flush the inodes
+void
+finish(void)
+{
+  int k;
+
+  if(manifest){
+    for(k = 0; k < nfiles; k++)
+      entries[files[k]].hash = ihash(entries[files[k]].inum);
+    writemanifest();
+  }
+  iflush();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int root;
+  struct stat st;
+  char *size_arg = NULL, *ninodes_arg = NULL, *tar = NULL;
+
+  for(; argc > 1 && strncmp(argv[1], "--", 2) == 0; argc--, argv++){
+    if(strncmp(argv[1], "--size=", 7) == 0)
+      size_arg = argv[1] + 7;
+    else if(strncmp(argv[1], "--ninodes=", 10) == 0)
+      ninodes_arg = argv[1] + 10;
+    else if(strncmp(argv[1], "--threads=", 10) == 0)
+      nthreads = atoi(argv[1] + 10);
+    else if(strncmp(argv[1], "--headroom=", 11) == 0)
+      headroom = atoi(argv[1] + 11);
+    else if(strcmp(argv[1], "--layout=legacy") == 0)
+      policy = LAYOUT_LEGACY;
+    else if(strcmp(argv[1], "--layout=extent") == 0)
+      policy = LAYOUT_EXTENT;
+    else if(strcmp(argv[1], "--layout=cluster") == 0)
+      policy = LAYOUT_CLUSTER;
+    else if(strncmp(argv[1], "--base=", 7) == 0)
+      base = argv[1] + 7;
+    else if(strncmp(argv[1], "--manifest=", 11) == 0)
+      manifest = argv[1] + 11;
+    else if(strcmp(argv[1], "--verify") == 0)
+      verify = 1;
+    else if(strcmp(argv[1], "--report") == 0)
+      report = 1;
+    else if(strcmp(argv[1], "--chunked") == 0)
+      chunked = XV6Z_CHUNK_SIZE;
+    else if(strncmp(argv[1], "--chunked=", 10) == 0)
+      chunked = atoi(argv[1] + 10) * 1024;
+    else if(strncmp(argv[1], "--from-tar=", 11) == 0)
+      tar = argv[1] + 11;
+    else if(strcmp(argv[1], "--from-tar") == 0 && argc > 2){
+      tar = argv[2];
+      argc--;
+      argv++;
+    } else
+      break;
+  }
+  if(argc < 2 || strncmp(argv[1], "--", 2) == 0 || nthreads < 1 || nthreads > MAXTHREADS ||
+     headroom < 0 || headroom > 1000 || chunked % 4096 != 0 || chunked > (1 << 26) ||
+     (base && (!manifest || size_arg || ninodes_arg || tar || verify || chunked)) ||
+     (tar && (argc > 2 || policy == LAYOUT_CLUSTER || (size_arg && strcmp(size_arg, "auto") == 0) ||
+              (ninodes_arg && strcmp(ninodes_arg, "auto") == 0)))){
+    fprintf(stderr, "Usage: mkfs [--size=N|auto] [--ninodes=N|auto] [--headroom=PERCENT] [--threads=N] "
+            "[--layout=legacy|extent|cluster] [--report] [--manifest=FILE] [--verify] [--chunked[=KiB]] fs.img files...\n"
+            "       mkfs --base=old.img --manifest=FILE [--threads=N] [--report] fs.img files...\n"
+            "       mkfs [--size=N] [--ninodes=N] [--layout=legacy|extent] [--report] "
+            "[--manifest=FILE] [--verify] [--chunked[=KiB]] --from-tar FILE|- fs.img\n");
+    exit(1);
+  }
+
+  assert((512 % sizeof(struct dinode)) == 0);
+  assert((512 % sizeof(struct xv6_dirent)) == 0);
+  // The tree's metadata comes first, to size the image by and check it
+  // fits before anything is written. Without a readable tree the root
+  // holds just . and ..
+  root = -1;
+  if(argc > 2 && (rootfd = open(argv[2], O_RDONLY | O_DIRECTORY)) >= 0){
+    memset(&st, 0, sizeof(st));
+    root = addentry(argv[2], -1, 1, &st);
+    scan(rootfd, root);
+  }
+  if(base){
+    openbase(argv[1]);
+  } else {
+    geometry(size_arg, ninodes_arg);
+    opentmp(argv[1]);
+  }
+  files = malloc((nentries + 1) * sizeof(int));
+  if(files == NULL){
+    perror("malloc");
+    exit(1);
+  }
+
+  mkfs(nblocks, ninodes, size);
+  if(base){
+    incremental(root);
+    fill();
+    finish();
+  } else if(tar){
+    tarbuild(tar);
+  } else {
+    build(root);
+  }
+  if(report)
+    walkreport();
+  if(verify)
+    verifyimage(argv[1]);
+  if(chunked)
+    writechunked();
+  else if(verify)
+    writeimage();
+  replaceout(argv[1]);
+  if(manifest)
+    placemanifest();
+
+  if(munmap(img, (size_t)size * BSIZE) != 0 || close(fsfd) != 0){
+    perror(argv[1]);
+    exit(1);
+  }
+  exit(0);
+}
+
+// Block sec of the image
+char*
+sect(uint sec)
+{
+  if(sec >= size){
+    fprintf(stderr, "mkfs: block %u is past the end of the %d block image\n", sec, size);
+    exit(1);
+  }
+  return img + (size_t)sec * BSIZE;
+}
+
+void
+wsect(uint sec, void *buf)
+{
+  memmove(sect(sec), buf, BSIZE);
+}
+
+// Parse a --size or --ninodes value, 0 for auto
+uint
+geomarg(char *opt, char *arg, uint max)
+{
+  char *end;
+  unsigned long n;
+
+  if(arg == NULL || strcmp(arg, "auto") == 0)
+    return 0;
+  n = strtoul(arg, &end, 10);
+  if(*arg == '\0' || *end != '\0' || n == 0 || n > max){
+    fprintf(stderr, "mkfs: bad %s value %s, want 1 to %u or auto\n", opt, arg, max);
+    exit(1);
+  }
+  return n;
+}
+
+// Blocks before the data blocks in an image of s blocks
+uint
+metablocks(uint s)
+{
+  return ninodes / IPB + 3 + (s + BPB - 1) / BPB;
+}
+
+// The bitmap has a bit for every block, so the kernel needs ceil(size/BPB)
+// bitmap blocks from BBLOCK(0) on, while fcheck finds the data blocks after
+// ceil(nblocks/BPB) of them. A size works when the two agree.
+int
+sizeworks(uint s)
+{
+  return s > metablocks(s) && (s - metablocks(s) + BPB - 1) / BPB == (s + BPB - 1) / BPB;
+}
+
+// Choose size, ninodes and nblocks for the scanned tree, and check them
+// against fs.h and the tree before anything is written
+// With neither option the image is the classic 1024 blocks and 200 inodes.
+// With one, the other follows from BLOCKS_PER_INODE: a derived size is
+// rounded up until it works, derived inodes are cut until the size works.
+// With auto for either, what is not given is the least that holds the tree
+// and headroom percent more.
+void
+geometry(char *size_arg, char *ninodes_arg)
+{
+  uint want_size = geomarg("--size", size_arg, 1u << 30);
+  uint want_ninodes = geomarg("--ninodes", ninodes_arg, MAXINODES);
+  uint need_inodes = (nentries ? nentries : 1) + 1;  // inode 0 is never used
+  uint need_blocks = treeblocks(0);
+  uint s, below, n;
+  int fit;
+
+  fit = (size_arg && strcmp(size_arg, "auto") == 0) || (ninodes_arg && strcmp(ninodes_arg, "auto") == 0);
+  if(want_size)
+    size = want_size;
+  if(want_ninodes)
+    ninodes = want_ninodes;
+  else if(fit){
+    n = need_inodes + (unsigned long long)need_inodes * headroom / 100;
+    ninodes = min(MAXINODES, (n + IPB - 1) / IPB * IPB);
+  } else if(want_size){
+    ninodes = min(MAXINODES, (size / BLOCKS_PER_INODE + IPB - 1) / IPB * IPB);
+    while(ninodes > IPB && !sizeworks(size))
+      ninodes -= IPB;
+  }
+  if(ninodes <= ROOTINO)
+    ninodes = IPB;
+  if(fit && !want_size){
+    n = need_blocks + ((unsigned long long)need_blocks * headroom + 99) / 100;
+    for(size = n + metablocks(n); size - metablocks(size) < n; size++)
+      ;
+  } else if(want_ninodes && !want_size)
+    size = ninodes * BLOCKS_PER_INODE;
+
+  // Sizes that work are a multiple of BPB or more than metablocks() past one,
+  // so within one BPB of size there is one, unless the metadata fills a whole
+  // bitmap block's worth of blocks
+  for(s = size; s < size + BPB && !sizeworks(s); s++)
+    ;
+  if(s == size + BPB){
+    fprintf(stderr, "mkfs: no image size near %d works with %d inodes, the inode and bitmap blocks "
+            "must stay under %d blocks\n", size, ninodes, BPB);
+    exit(1);
+  }
+  if(s != size && want_size){
+    for(below = size; below > 0 && !sizeworks(below); below--)
+      ;
+    if(below)
+      fprintf(stderr, "mkfs: --size=%d leaves the bitmap and the data blocks disagreeing, try --size=%u or %u\n",
+              size, below, s);
+    else
+      fprintf(stderr, "mkfs: --size=%d leaves the bitmap and the data blocks disagreeing, try --size=%u\n",
+              size, s);
+    exit(1);
+  }
+  size = s;
+  nblocks = size - metablocks(size);
+
+  // The same geometry through fs.h: the inodes end before the bitmap, and the
+  // bitmap block of the last block is the last one before the data blocks
+  if(IBLOCK(ninodes - 1) >= BBLOCK(0, ninodes) ||
+     BBLOCK((size - 1), ninodes) != size - nblocks - 1){
+    fprintf(stderr, "mkfs: geometry of %d blocks and %d inodes disagrees with fs.h\n", size, ninodes);
+    exit(1);
+  }
+
+  if(fit)
+    printf("geometry: the tree needs %u inodes and %u data blocks, with %d%% headroom %d and %d\n",
+           need_inodes, need_blocks, headroom, ninodes, nblocks);
+  checkfit();
+}
+
+// Fail unless every file of the scanned tree fits an inode, and the tree
+// fits the image
+// A rebuilt --base image ends up holding just the tree too, and never
+// needs more on the way, as what goes is freed before anything is added.
+void
+checkfit(void)
+{
+  static char path[4096];
+  uint need_inodes = (nentries ? nentries : 1) + 1;
+  uint need_blocks;
+  int e;
+
+  for(e = 0; e < nentries; e++){
+    // A path the manifest cannot hold would never be found by the next --base
+    if(manifest && e > 0 && entrypath(e, path, sizeof(path)) == 0){
+      fprintf(stderr, "mkfs: the path of %s is too long for the manifest\n", entries[e].name);
+      exit(1);
+    }
+    if(!entries[e].isdir && entries[e].size > MAXFILE * BSIZE){
+      entrypath(e, path, sizeof(path));
+      fprintf(stderr, "mkfs: %s is %lld bytes, more than the %d an xv6 file holds\n",
+              path, (long long)entries[e].size, (int)(MAXFILE * BSIZE));
+      exit(1);
+    }
+  }
+  need_blocks = treeblocks(0);
+  if(need_inodes > ninodes || need_blocks > nblocks){
+    fprintf(stderr, "mkfs: the tree needs %u inodes and %u data blocks, the image has %d and %d%s\n",
+            need_inodes, need_blocks, ninodes, nblocks, base ? "" : ", try --size=auto");
+    exit(1);
+  }
+}
+
+void
+winode(uint inum, struct dinode *ip)
+{
+  inodes[inum] = *ip;
+}
+
+void
+rinode(uint inum, struct dinode *ip)
+{
+  *ip = inodes[inum];
+}
+
+// Copy inodes[] to the inode blocks, each written once and only if it changed
+void
+iflush(void)
+{
+  uint bn;
+
+  for(bn = 0; bn <= ninodes / IPB; bn++){
+    if(memcmp(sect(IBLOCK(bn * IPB)), (char*)inodes + bn * BSIZE, BSIZE) != 0)
+      wsect(IBLOCK(bn * IPB), (char*)inodes + bn * BSIZE);
+  }
+}
+
+uint
+ialloc(ushort type)
+{
+  uint inum;
+  struct dinode din;
+
+  // Only a --base image has inodes in use past freeinode
+  while(freeinode < ninodes && inodes[freeinode].type != 0)
+    freeinode++;
+  inum = freeinode++;
+  if(inum >= ninodes){
+    fprintf(stderr, "mkfs: out of inodes, the image has %d\n", ninodes);
+    exit(1);
+  }
+
+  bzero(&din, sizeof(din));
+  din.type = xshort(type);
+  din.nlink = xshort(1);
+  din.size = xint(0);
+  winode(inum, &din);
+  return inum;
+}
+
+void
+balloc(int used)
+{
+  printf("balloc: first %d blocks have been allocated\n", used);
+  printf("balloc: write bitmap blocks %zu to %zu\n", BBLOCK(0, ninodes), BBLOCK((size - 1), ninodes));
+  bset(0, used);
+}
+
+// Mark blocks [from, to) in use
+// The bitmap blocks are consecutive, so their bits form one array indexed
+// by block number, which is set a 32-bit word at a time.
+void
+bset(uint from, uint to)
+{
+  uint *map = (uint*)sect(BBLOCK(0, ninodes));
+
+  assert(to <= size);
+  for(; from < to && from % 32 != 0; from++)
+    map[from / 32] |= xint(1u << (from % 32));
+  for(; from + 32 <= to; from += 32)
+    map[from / 32] = 0xffffffff;
+  for(; from < to; from++)
+    map[from / 32] |= xint(1u << (from % 32));
+}
+
+// Append n bytes to inode inum, straight into its blocks in the image
+// With xp NULL the blocks are only allocated, for fill() to write later.
+void
+iappend(uint inum, void *xp, int n)
+{
+  char *p = (char*)xp;
+  uint fbn, off, n1;
+  struct dinode *din = &inodes[inum];
+  uint *indirect;
+  uint x;
+
+  off = xint(din->size);
+  while(n > 0){
+    fbn = off / 512;
+    assert(fbn < MAXFILE);
+    if(fbn < NDIRECT){
+      if(xint(din->addrs[fbn]) == 0)
+        din->addrs[fbn] = xint(allocblock(inum));
+      x = xint(din->addrs[fbn]);
+    } else {
+      if(xint(din->addrs[NDIRECT]) == 0)
+        din->addrs[NDIRECT] = xint(allocblock(inum));
+      indirect = (uint*)sect(xint(din->addrs[NDIRECT]));
+      if(indirect[fbn - NDIRECT] == 0)
+        indirect[fbn - NDIRECT] = xint(allocblock(inum));
+      x = xint(indirect[fbn-NDIRECT]);
+    }
+    n1 = min(n, (fbn + 1) * 512 - off);
+    if(p){
+      memmove(sect(x) + off - (fbn * 512), p, n1);
+      p += n1;
+    }
+    n -= n1;
+    off += n1;
+  }
+  din->size = xint(off);
 }
@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "types.h"
+#include "fs.h"
+#include "fcheck.h"
+
+// Host-side access to xv6 images without booting them
+//
+//   xv6fs extract [--threads=N] [--pwrite] [--naive] <image> <dest>
+//
+// extract recreates the tree under ROOTINO in dest. The image must pass the
+// full check, so every address and dirent the walk follows has been validated.
+// The main thread walks the directories and creates them, regular files become
+// jobs for a pool of workers. A worker writes each run of consecutive blocks
+// with one call: copy_file_range() for long runs, so the kernel moves the data
+// between the files, otherwise pwrite() straight from the mapped image. The
+// final partial block is cut to dinode.size. A file named twice is written once
+// and hard-linked. --naive is the baseline: one thread, a read() and a write()
+// per block.
+
+#define ERROR_CODE 1
+#define T_UNALLOC 0
+#define T_DIR 1
+#define T_FILE 2
+#define COPY_RANGE_MIN (64 * 1024)    // Shorter runs are not worth a copy_file_range() call
+
+struct job
+{
+    uint inum;
+    char *path;
+    uint first;                // For a link, 1 + index of the job that writes the data, otherwise 0
+};
+
+char *image_base;
+int image_fd;
+struct fcheck_geometry g;
+
+struct job *jobs;
+uint njobs, cap_jobs;
+atomic_uint next_job;
+atomic_bool copy_range = true;  // Cleared for good once the kernel refuses it
+uint nthreads = 4;
+bool naive;
+uint ndirs, nlinks, nskipped;
+_Atomic unsigned long long bytes_out;
+
+char *block_of(uint b)
+{
+    return image_base + (size_t)b * g.bsize;
+}
+
+struct dinode *dinode_of(uint inum)
+{
+    uint ipb = g.bsize / sizeof(struct dinode);
+    return (struct dinode *)block_of(g.inode_start + inum / ipb) + inum % ipb;
+}
+
+// Block holding byte lbn * bsize of an inode, 0 if unmapped
+uint bmap(struct dinode *dip, uint lbn)
+{
+    uint nindirect = g.bsize / sizeof(uint);
+    if (lbn < g.ndirect) return dip->addrs[lbn];
+    lbn -= g.ndirect;
+
+    if (lbn < nindirect)
+    {
+        uint indirect = dip->addrs[g.ndirect];
+        return indirect ? ((uint *)block_of(indirect))[lbn] : 0;
+    }
+    lbn -= nindirect;
+
+    uint dindirect = g.dindirect ? dip->addrs[g.ndirect + 1] : 0;
+    if (!dindirect || lbn >= nindirect * nindirect) return 0;
+    uint level1 = ((uint *)block_of(dindirect))[lbn / nindirect];
+    return level1 ? ((uint *)block_of(level1))[lbn % nindirect] : 0;
+}
+
+void add_job(uint inum, char *path, uint first)
+{
+    if (njobs == cap_jobs)
+    {
+        cap_jobs = cap_jobs ? 2 * cap_jobs : 256;
+        jobs = realloc(jobs, cap_jobs * sizeof(struct job));
+        if (!jobs)
+        {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(ERROR_CODE);
+        }
+    }
+    jobs[njobs++] = (struct job){ inum, path, first };
+}
+
+char *join_path(const char *dir, const char *name)
+{
+    char *path = malloc(strlen(dir) + 1 + strlen(name) + 1);
+    if (!path)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+// Create the directories breadth first and queue their files
+// The directory queue is the job list itself, directories are dropped from it afterwards
+void walk_tree(const char *dest)
+{
+    uint *first_job = calloc(g.ninodes, sizeof(uint));
+    if (!first_job)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+
+    add_job(ROOTINO, strdup(dest), 0);
+    for (uint q = 0; q < njobs; q++)
+    {
+        if (dinode_of(jobs[q].inum)->type != T_DIR) continue;
+        struct dinode *dip = dinode_of(jobs[q].inum);
+        uint ndirents = dip->size / sizeof(struct dirent);
+        uint per_block = g.bsize / sizeof(struct dirent);
+
+        for (uint e = 0; e < ndirents; e++)
+        {
+            uint b = bmap(dip, e / per_block);
+            if (b == 0) continue;
+            struct dirent *de = (struct dirent *)block_of(b) + e % per_block;
+            if (de->inum == 0 || de->inum >= g.ninodes) continue;
+
+            char name[DIRSIZ + 1];
+            memcpy(name, de->name, DIRSIZ);
+            name[DIRSIZ] = '\0';
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            if (name[0] == '\0' || strchr(name, '/'))
+            {
+                fprintf(stderr, "skipping unsafe name in directory %u\n", jobs[q].inum);
+                nskipped++;
+                continue;
+            }
+
+            char *path = join_path(jobs[q].path, name);
+            short type = dinode_of(de->inum)->type;
+            if (type == T_DIR)
+            {
+                if (mkdir(path, 0755) == -1 && errno != EEXIST)
+                {
+                    perror(path);
+                    exit(ERROR_CODE);
+                }
+                ndirs++;
+                add_job(de->inum, path, 0);
+            }
+            else if (type == T_FILE)
+            {
+                add_job(de->inum, path, first_job[de->inum]);
+                if (first_job[de->inum]) nlinks++;
+                else first_job[de->inum] = njobs;
+            }
+            else
+            {
+                nskipped++;
+                free(path);
+            }
+        }
+    }
+    free(first_job);
+
+    // Keep the files, in the order they were found
+    uint *new_index = calloc(njobs + 1, sizeof(uint));
+    if (!new_index)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+    uint n = 0;
+    for (uint j = 0; j < njobs; j++)
+    {
+        if (dinode_of(jobs[j].inum)->type != T_FILE)
+        {
+            free(jobs[j].path);
+            continue;
+        }
+        new_index[j + 1] = n + 1;
+        jobs[n] = jobs[j];
+        jobs[n].first = new_index[jobs[n].first];
+        n++;
+    }
+    njobs = n;
+    free(new_index);
+}
+
+// Write len bytes of the image from block b at off in fd
+void write_run(int fd, uint b, off_t off, size_t len)
+{
+    loff_t in = (loff_t)b * g.bsize, out = off;
+    if (len >= COPY_RANGE_MIN && atomic_load_explicit(&copy_range, memory_order_relaxed))
+    {
+        while (len > 0)
+        {
+            ssize_t n = copy_file_range(image_fd, &in, fd, &out, len, 0);
+            if (n <= 0) break;
+            len -= n;
+        }
+        if (len == 0) return;
+
+        // Not supported between these files, the rest goes through pwrite()
+        atomic_store(&copy_range, false);
+    }
+
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = pwrite(fd, image_base + in + done, len - done, out + done);
+        if (n <= 0)
+        {
+            perror("pwrite");
+            exit(ERROR_CODE);
+        }
+        done += n;
+    }
+}
+
+void extract_file(struct job *job)
+{
+    struct dinode *dip = dinode_of(job->inum);
+    int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(job->path);
+        exit(ERROR_CODE);
+    }
+
+    // One write per run of consecutive blocks, unmapped blocks stay holes
+    uint nblocks = (dip->size + g.bsize - 1) / g.bsize;
+    for (uint lbn = 0; lbn < nblocks;)
+    {
+        uint b = bmap(dip, lbn);
+        if (b == 0)
+        {
+            lbn++;
+            continue;
+        }
+        uint run = 1;
+        while (lbn + run < nblocks && bmap(dip, lbn + run) == b + run) run++;
+
+        off_t off = (off_t)lbn * g.bsize;
+        size_t len = (size_t)run * g.bsize;
+        if (off + len > dip->size) len = dip->size - off;
+        write_run(fd, b, off, len);
+        lbn += run;
+    }
+    if (ftruncate(fd, dip->size) == -1)
+    {
+        perror("ftruncate");
+        exit(ERROR_CODE);
+    }
+    atomic_fetch_add_explicit(&bytes_out, dip->size, memory_order_relaxed);
+    close(fd);
+}
+
+// The baseline: a read() and a write() per block through a bounce buffer
+void extract_file_naive(struct job *job)
+{
+    struct dinode *dip = dinode_of(job->inum);
+    int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(job->path);
+        exit(ERROR_CODE);
+    }
+
+    char buf[4096];
+    for (uint off = 0; off < dip->size; off += g.bsize)
+    {
+        uint b = bmap(dip, off / g.bsize);
+        uint len = dip->size - off < g.bsize ? dip->size - off : g.bsize;
+        if (b == 0) memset(buf, 0, len);
+        else if (lseek(image_fd, (off_t)b * g.bsize, SEEK_SET) == -1 || read(image_fd, buf, len) != len)
+        {
+            perror("read");
+            exit(ERROR_CODE);
+        }
+        if (write(fd, buf, len) != len)
+        {
+            perror("write");
+            exit(ERROR_CODE);
+        }
+    }
+    bytes_out += dip->size;
+    close(fd);
+}
+
+void *extract_worker(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        uint j = atomic_fetch_add(&next_job, 1);
+        if (j >= njobs) return NULL;
+        if (jobs[j].first == 0) extract_file(&jobs[j]);
+    }
+}
+
+int extract(const char *image, const char *dest)
+{
+    image_fd = open(image, O_RDONLY);
+    if (image_fd < 0)
+    {
+        fprintf(stderr, "image not found.\n");
+        exit(ERROR_CODE);
+    }
+    struct stat st;
+    if (fstat(image_fd, &st) == -1)
+    {
+        perror("fstat");
+        exit(ERROR_CODE);
+    }
+    image_base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, image_fd, 0);
+    if (image_base == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(ERROR_CODE);
+    }
+
+    int verdict = fcheck_check_buffer(image_base, st.st_size);
+    if (verdict == FCHECK_NO_MEMORY)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(ERROR_CODE);
+    }
+    if (verdict != FCHECK_CLEAN)
+    {
+        fprintf(stderr, "ERROR: image is not consistent: %s\n", fcheck_last_error());
+        exit(ERROR_CODE);
+    }
+    fcheck_geometry(image_base, st.st_size, &g);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (mkdir(dest, 0755) == -1 && errno != EEXIST)
+    {
+        perror(dest);
+        exit(ERROR_CODE);
+    }
+    walk_tree(dest);
+
+    if (naive)
+    {
+        for (uint j = 0; j < njobs; j++)
+        {
+            if (jobs[j].first == 0) extract_file_naive(&jobs[j]);
+        }
+    }
+    else
+    {
+        pthread_t threads[64];
+        for (uint t = 0; t < nthreads; t++) pthread_create(&threads[t], NULL, extract_worker, NULL);
+        for (uint t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+    }
+
+    // Links go last, once every file they point to exists
+    for (uint j = 0; j < njobs; j++)
+    {
+        if (jobs[j].first == 0) continue;
+        unlink(jobs[j].path);
+        if (link(jobs[jobs[j].first - 1].path, jobs[j].path) == -1)
+        {
+            perror(jobs[j].path);
+            exit(ERROR_CODE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("extracted %u files (%llu bytes), %u directories, %u links, %u skipped in %.1f ms (%.1f MB/s)\n",
+           njobs - nlinks, (unsigned long long)bytes_out, ndirs, nlinks, nskipped, ms,
+           ms > 0 ? bytes_out / ms / 1e3 : 0.0);
+
+    for (uint j = 0; j < njobs; j++) free(jobs[j].path);
+    free(jobs);
+    munmap(image_base, st.st_size);
+    close(image_fd);
+    return 0;
+}
+
+void xv6fs_usage()
+{
+    fprintf(stderr, "Usage: xv6fs extract [--threads=N] [--pwrite] [--naive] <image> <dest>\n");
+    exit(ERROR_CODE);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || strcmp(argv[1], "extract") != 0) xv6fs_usage();
+
+    static struct option long_options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "pwrite", no_argument, NULL, 'w' },
+        { "naive", no_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    optind = 2;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            nthreads = strtoul(optarg, NULL, 10);
+            if (nthreads == 0 || nthreads > 64) xv6fs_usage();
+            break;
+        case 'w':
+            copy_range = false;
+            break;
+        case 'n':
+            naive = true;
+            break;
+        default:
+            xv6fs_usage();
+        }
+    }
+    if (argc - optind != 2) xv6fs_usage();
+    return extract(argv[optind], argv[optind + 1]);
+}
@@ -0,0 +1,517 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "xv6z.h"
+
+// Writer and reader of .xv6z images, see xv6z.h.
+// The writer compresses chunks in any order on its threads, each into its
+// own buffer, then writes them in chunk order, so the file never depends on
+// timing.
+//
+// The reader keeps decompressed chunks in a cache on an LRU list. A read
+// pins the chunks it copies from, so a chunk is never dropped while another
+// thread is still copying out of it; when every cached chunk is pinned the
+// cache runs over its capacity until they are released. Zero chunks are
+// never cached, reads of them are just zero-filled.
+
+#define ABSENT 0
+#define LOADING 1
+#define CACHED 2
+
+#define MIN_CACHE 4            // Room for the chunks one access pattern can need at once
+
+static struct
+{
+    int fd;
+    size_t image_size;
+    size_t chunk_size;
+    unsigned nchunks;
+    struct xv6z_chunk *index;
+    uint32_t max_length;       // Largest compressed chunk
+    unsigned char *state;
+    char **data;               // Decompressed chunks, while CACHED
+    unsigned *pins;            // Reads copying out of each chunk
+    int *prev, *next;          // Links of the LRU list
+    int head, tail;            // Most and least recently used, -1 if empty
+    unsigned len, cap;
+    pthread_mutex_t lock;
+    pthread_cond_t published;  // A chunk has finished loading
+    int last_read;             // Chunk of the last read that changed chunks, to spot reading forward
+
+    // Prefetch threads and the chunks queued for them
+    pthread_t *threads;
+    unsigned nthreads;
+    int *queue;
+    unsigned queue_head, queue_len;
+    pthread_cond_t queued;
+    bool stopping;
+
+    struct xv6z_stats stats;
+    atomic_ullong bytes_read;
+} z;
+
+// Per thread zlib state and buffer for compressed chunks
+static __thread z_stream *stream;
+static __thread char *in;
+static __thread size_t in_cap;
+
+// The header and index are little-endian in the file whatever the host is;
+// each conversion is its own inverse
+static uint32_t le32(uint32_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(x);
+#else
+    return x;
+#endif
+}
+
+static uint64_t le64(uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(x);
+#else
+    return x;
+#endif
+}
+
+// A broken container is found in the middle of a check, with no way to
+// return an error to the code that asked for the block
+static void corrupt(unsigned c)
+{
+    fprintf(stderr, "ERROR: chunk %u of the compressed image is corrupt.\n", c);
+    _exit(1);
+}
+
+// Read and decompress chunk c into a new buffer
+static char *materialize(unsigned c)
+{
+    struct xv6z_chunk *ch = &z.index[c];
+    char *buf = malloc(z.chunk_size);
+    if (!buf)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        _exit(1);
+    }
+
+    if (in_cap < ch->length)
+    {
+        free(in);
+        in_cap = z.max_length;
+        in = malloc(in_cap);
+        if (!in) corrupt(c);
+    }
+    for (size_t done = 0; done < ch->length;)
+    {
+        ssize_t r = pread(z.fd, in + done, ch->length - done, ch->offset + done);
+        if (r <= 0) corrupt(c);
+        done += r;
+    }
+    atomic_fetch_add(&z.bytes_read, ch->length);
+    if (crc32(0, (unsigned char *)in, ch->length) != ch->crc) corrupt(c);
+
+    if (!stream)
+    {
+        stream = calloc(1, sizeof(z_stream));
+        if (!stream || inflateInit(stream) != Z_OK) corrupt(c);
+    }
+    else inflateReset(stream);
+    size_t want = c + 1 < z.nchunks ? z.chunk_size : z.image_size - (size_t)c * z.chunk_size;
+    stream->next_in = (unsigned char *)in;
+    stream->avail_in = ch->length;
+    stream->next_out = (unsigned char *)buf;
+    stream->avail_out = z.chunk_size;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out != want) corrupt(c);
+    return buf;
+}
+
+static void list_remove(int c)
+{
+    if (z.prev[c] >= 0) z.next[z.prev[c]] = z.next[c];
+    else z.head = z.next[c];
+    if (z.next[c] >= 0) z.prev[z.next[c]] = z.prev[c];
+    else z.tail = z.prev[c];
+    z.len--;
+}
+
+static void list_push(int c)
+{
+    z.prev[c] = -1;
+    z.next[c] = z.head;
+    if (z.head >= 0) z.prev[z.head] = c;
+    else z.tail = c;
+    z.head = c;
+    z.len++;
+}
+
+// Drop the least recently used unpinned chunks until the cache is within
+// its capacity, holding z.lock
+static void balance()
+{
+    for (int c = z.tail; c >= 0 && z.len > z.cap;)
+    {
+        int prev = z.prev[c];
+        if (z.pins[c] == 0)
+        {
+            list_remove(c);
+            free(z.data[c]);
+            z.data[c] = NULL;
+            z.state[c] = ABSENT;
+            z.stats.evicted++;
+        }
+        c = prev;
+    }
+}
+
+// Queue the chunks after c for the prefetch threads, when c is further into
+// the image than the chunk read before it: the checker walks the inodes in
+// order, and their blocks mostly follow. Never more than half the cache
+// ahead, so the prefetched chunks do not push out those in use. Holding z.lock.
+static void prefetch_after(unsigned c)
+{
+    if ((int)c == z.last_read) return;
+    bool forward = z.last_read >= 0 && (int)c > z.last_read;
+    z.last_read = c;
+    if (!forward) return;
+
+    unsigned depth = 2 * z.nthreads;
+    if (depth > z.cap / 2) depth = z.cap / 2;
+    for (unsigned k = 1; k <= depth && c + k < z.nchunks && z.queue_len < z.nchunks; k++)
+    {
+        if (z.state[c + k] != ABSENT || z.index[c + k].length == 0) continue;
+        z.queue[(z.queue_head + z.queue_len) % z.nchunks] = c + k;
+        z.queue_len++;
+    }
+    pthread_cond_broadcast(&z.queued);
+}
+
+// Chunk c, decompressed unless it is cached, and pinned for a read until
+// unpin(). A prefetch leaves a chunk that is cached or being loaded alone,
+// and pins nothing; it returns NULL.
+static char *pin(unsigned c, bool prefetch)
+{
+    pthread_mutex_lock(&z.lock);
+    if (!prefetch && z.nthreads) prefetch_after(c);
+    while (z.state[c] == LOADING && !prefetch) pthread_cond_wait(&z.published, &z.lock);
+    if (z.state[c] != ABSENT)
+    {
+        char *p = NULL;
+        if (!prefetch)
+        {
+            list_remove(c);
+            list_push(c);
+            z.pins[c]++;
+            z.stats.hits++;
+            p = z.data[c];
+        }
+        pthread_mutex_unlock(&z.lock);
+        return p;
+    }
+    z.state[c] = LOADING;
+    pthread_mutex_unlock(&z.lock);
+
+    char *buf = materialize(c);
+
+    pthread_mutex_lock(&z.lock);
+    z.data[c] = buf;
+    z.state[c] = CACHED;
+    list_push(c);
+    z.stats.loaded++;
+    if (prefetch) z.stats.prefetched++;
+    else z.pins[c]++;
+    balance();
+    pthread_cond_broadcast(&z.published);
+    pthread_mutex_unlock(&z.lock);
+    return prefetch ? NULL : buf;
+}
+
+static void unpin(unsigned c)
+{
+    pthread_mutex_lock(&z.lock);
+    z.pins[c]--;
+    if (z.len > z.cap) balance();
+    pthread_mutex_unlock(&z.lock);
+}
+
+static void *prefetch_thread(void *arg)
+{
+    pthread_mutex_lock(&z.lock);
+    for (;;)
+    {
+        while (!z.stopping && z.queue_len == 0) pthread_cond_wait(&z.queued, &z.lock);
+        if (z.stopping) break;
+        int c = z.queue[z.queue_head];
+        z.queue_head = (z.queue_head + 1) % z.nchunks;
+        z.queue_len--;
+        pthread_mutex_unlock(&z.lock);
+        pin(c, true);
+        pthread_mutex_lock(&z.lock);
+    }
+    pthread_mutex_unlock(&z.lock);
+    return NULL;
+}
+
+void xv6z_read(void *buf, size_t n, uint64_t off)
+{
+    char *out = buf;
+    while (n > 0)
+    {
+        unsigned c = off / z.chunk_size;
+        size_t at = off % z.chunk_size;
+        size_t k = z.chunk_size - at < n ? z.chunk_size - at : n;
+        if (z.index[c].length == 0) memset(out, 0, k);
+        else
+        {
+            memcpy(out, pin(c, false) + at, k);
+            unpin(c);
+        }
+        out += k;
+        off += k;
+        n -= k;
+    }
+}
+
+int xv6z_detect(int fd)
+{
+    char magic[8];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, XV6Z_MAGIC, 8) == 0;
+}
+
+// Free what xv6z_open() set up, when it fails and in xv6z_close()
+static void release(void)
+{
+    for (unsigned c = 0; z.data && c < z.nchunks; c++) free(z.data[c]);
+    free(z.threads);
+    free(z.index);
+    free(z.state);
+    free(z.data);
+    free(z.pins);
+    free(z.prev);
+    free(z.next);
+    free(z.queue);
+    memset(&z, 0, sizeof(z));
+}
+
+int xv6z_open(int fd, size_t *image_size, unsigned cache_chunks, unsigned prefetch)
+{
+    struct xv6z_header h;
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h)) memset(&h, 0, sizeof(h));
+    h.version = le32(h.version);
+    h.codec = le32(h.codec);
+    h.image_size = le64(h.image_size);
+    h.chunk_size = le32(h.chunk_size);
+    h.nchunks = le32(h.nchunks);
+    if (memcmp(h.magic, XV6Z_MAGIC, 8) != 0 || h.version != XV6Z_VERSION || h.codec != XV6Z_CODEC_ZLIB ||
+        h.chunk_size == 0 || h.nchunks != (h.image_size + h.chunk_size - 1) / h.chunk_size)
+    {
+        fprintf(stderr, "ERROR: bad compressed image header.\n");
+        return -1;
+    }
+
+    memset(&z, 0, sizeof(z));
+    z.fd = fd;
+    z.image_size = h.image_size;
+    z.chunk_size = h.chunk_size;
+    z.nchunks = h.nchunks;
+    z.index = malloc((size_t)z.nchunks * sizeof(struct xv6z_chunk));
+    z.state = calloc(z.nchunks, 1);
+    z.data = calloc(z.nchunks, sizeof(char *));
+    z.pins = calloc(z.nchunks, sizeof(unsigned));
+    z.prev = malloc(z.nchunks * sizeof(int));
+    z.next = malloc(z.nchunks * sizeof(int));
+    z.queue = malloc(z.nchunks * sizeof(int));
+    if (!z.index || !z.state || !z.data || !z.pins || !z.prev || !z.next || !z.queue)
+    {
+        fprintf(stderr, "Memory allocation failed\n");
+        release();
+        return -1;
+    }
+    size_t index_bytes = (size_t)z.nchunks * sizeof(struct xv6z_chunk);
+    if (pread(fd, z.index, index_bytes, sizeof(h)) != (ssize_t)index_bytes)
+    {
+        fprintf(stderr, "ERROR: bad compressed image index.\n");
+        release();
+        return -1;
+    }
+    z.bytes_read = sizeof(h) + index_bytes;
+    for (unsigned c = 0; c < z.nchunks; c++)
+    {
+        struct xv6z_chunk *ch = &z.index[c];
+        ch->offset = le64(ch->offset);
+        ch->length = le32(ch->length);
+        ch->crc = le32(ch->crc);
+        if ((ch->length && ch->offset < sizeof(h) + index_bytes) || ch->offset + ch->length > (uint64_t)st.st_size ||
+            ch->length > compressBound(z.chunk_size))
+        {
+            fprintf(stderr, "ERROR: bad compressed image index.\n");
+            release();
+            return -1;
+        }
+        if (ch->length > z.max_length) z.max_length = ch->length;
+        if (ch->length) z.stats.stored++;
+    }
+    z.stats.nchunks = z.nchunks;
+    z.stats.file_bytes = st.st_size;
+
+    z.cap = cache_chunks < MIN_CACHE ? MIN_CACHE : cache_chunks;
+    z.head = z.tail = -1;
+    z.last_read = -1;
+    pthread_mutex_init(&z.lock, NULL);
+    pthread_cond_init(&z.queued, NULL);
+    pthread_cond_init(&z.published, NULL);
+
+    z.threads = malloc(prefetch * sizeof(pthread_t));
+    for (unsigned t = 0; z.threads && t < prefetch; t++)
+    {
+        if (pthread_create(&z.threads[t], NULL, prefetch_thread, NULL) != 0) break;
+        z.nthreads++;
+    }
+
+    *image_size = z.image_size;
+    return 0;
+}
+
+void xv6z_close(void)
+{
+    pthread_mutex_lock(&z.lock);
+    z.stopping = true;
+    pthread_cond_broadcast(&z.queued);
+    pthread_mutex_unlock(&z.lock);
+    for (unsigned t = 0; t < z.nthreads; t++) pthread_join(z.threads[t], NULL);
+    pthread_mutex_destroy(&z.lock);
+    pthread_cond_destroy(&z.queued);
+    pthread_cond_destroy(&z.published);
+    release();
+}
+
+void xv6z_stats(struct xv6z_stats *stats)
+{
+    pthread_mutex_lock(&z.lock);
+    *stats = z.stats;
+    stats->bytes_read = z.bytes_read;
+    pthread_mutex_unlock(&z.lock);
+}
+
+struct write_job
+{
+    const char *image;
+    size_t image_size;
+    size_t chunk_size;
+    unsigned nchunks;
+    unsigned char **data;      // Compressed chunks, NULL for zeros
+    uLongf *length;
+    atomic_uint next;
+    atomic_bool failed;
+};
+
+static bool all_zeros(const char *p, size_t n)
+{
+    for (size_t k = 0; k < n; k += sizeof(long))
+    {
+        if (*(const long *)(p + k) != 0) return false;
+    }
+    return true;
+}
+
+static void *compress_thread(void *arg)
+{
+    struct write_job *job = arg;
+    unsigned c;
+    while ((c = atomic_fetch_add(&job->next, 1)) < job->nchunks)
+    {
+        const char *p = job->image + (size_t)c * job->chunk_size;
+        size_t n = job->image_size - (size_t)c * job->chunk_size;
+        if (n > job->chunk_size) n = job->chunk_size;
+        if (all_zeros(p, n)) continue;
+        job->length[c] = compressBound(n);
+        job->data[c] = malloc(job->length[c]);
+        if (!job->data[c] ||
+            compress2(job->data[c], &job->length[c], (const unsigned char *)p, n, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            atomic_store(&job->failed, true);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int write_all(int fd, const void *p, size_t n, off_t off)
+{
+    while (n > 0)
+    {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w <= 0) return -1;
+        p = (const char *)p + w;
+        n -= w;
+        off += w;
+    }
+    return 0;
+}
+
+int xv6z_write(int fd, const char *image, size_t image_size, uint32_t chunk_size, unsigned threads,
+               struct xv6z_stats *stats)
+{
+    struct write_job job = { image, image_size, chunk_size, (image_size + chunk_size - 1) / chunk_size };
+    struct xv6z_header h = { XV6Z_MAGIC, le32(XV6Z_VERSION), le32(XV6Z_CODEC_ZLIB), le64(image_size), le32(chunk_size),
+                             le32(job.nchunks) };
+    size_t index_bytes = (size_t)job.nchunks * sizeof(struct xv6z_chunk);
+    if (threads == 0) threads = 1;
+    struct xv6z_chunk *index = calloc(job.nchunks, sizeof(struct xv6z_chunk));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    job.data = calloc(job.nchunks, sizeof(unsigned char *));
+    job.length = calloc(job.nchunks, sizeof(uLongf));
+    int r = -1;
+    if (!index || !tids || !job.data || !job.length) goto out;
+
+    unsigned started = 0;
+    while (started + 1 < threads && pthread_create(&tids[started], NULL, compress_thread, &job) == 0) started++;
+    compress_thread(&job);
+    for (unsigned t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    if (atomic_load(&job.failed))
+    {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    unsigned long long off = sizeof(h) + index_bytes;
+    unsigned stored = 0;
+    for (unsigned c = 0; c < job.nchunks; c++)
+    {
+        if (!job.data[c]) continue;
+        index[c].offset = le64(off);
+        index[c].length = le32(job.length[c]);
+        index[c].crc = le32(crc32(0, job.data[c], job.length[c]));
+        if (write_all(fd, job.data[c], job.length[c], off) != 0) goto out;
+        off += job.length[c];
+        stored++;
+    }
+    if (write_all(fd, &h, sizeof(h), 0) != 0 || write_all(fd, index, index_bytes, sizeof(h)) != 0 ||
+        ftruncate(fd, off) != 0)
+        goto out;
+    if (stats)
+    {
+        memset(stats, 0, sizeof(*stats));
+        stats->nchunks = job.nchunks;
+        stats->stored = stored;
+        stats->file_bytes = off;
+    }
+    r = 0;
+out:
+    for (unsigned c = 0; job.data && c < job.nchunks; c++) free(job.data[c]);
+    free(job.data);
+    free(job.length);
+    free(index);
+    free(tids);
+    return r;
+}
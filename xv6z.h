@@ -0,0 +1,85 @@
+#ifndef _XV6Z_H_
+#define _XV6Z_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Chunked, compressed xv6 images (.xv6z), which a checker can read without
+// decompressing all of it.
+// The image is cut into fixed-size chunks, each compressed on its own with
+// zlib. A header and a chunk index come first, so a reader finds any block
+// with one read of the index. Chunks that are all zeros, such as the free
+// blocks of a fresh image, are not stored. Everything is little-endian, and
+// the same image, chunk size and zlib always give the same bytes.
+//
+//   struct xv6z_header
+//   struct xv6z_chunk index[nchunks]
+//   the stored chunks, in order
+
+#define XV6Z_MAGIC "XV6Z\r\n\032\n"
+#define XV6Z_VERSION 1
+#define XV6Z_CODEC_ZLIB 1
+#define XV6Z_CHUNK_SIZE (64 * 1024)   // Default image bytes per chunk
+
+struct xv6z_header
+{
+    char magic[8];             // XV6Z_MAGIC
+    uint32_t version;          // XV6Z_VERSION
+    uint32_t codec;            // XV6Z_CODEC_ZLIB
+    uint64_t image_size;       // Bytes of the image, the last chunk may be short
+    uint32_t chunk_size;       // Bytes of every chunk but the last
+    uint32_t nchunks;
+};
+
+struct xv6z_chunk
+{
+    uint64_t offset;           // Of the compressed chunk in the file
+    uint32_t length;           // Compressed bytes, 0 for a chunk of zeros
+    uint32_t crc;              // crc32 of the compressed bytes
+};
+
+// Counters of the open image, or of what xv6z_write() wrote
+struct xv6z_stats
+{
+    unsigned nchunks;
+    unsigned stored;                    // Chunks not all zeros
+    unsigned long long file_bytes;      // Compressed bytes in the file
+    unsigned loaded;                    // Chunks read and decompressed
+    unsigned hits;                      // Reads of a chunk already in the cache
+    unsigned evicted;
+    unsigned prefetched;                // Loads done ahead on prefetch threads
+    unsigned long long bytes_read;      // Compressed bytes read from the file, index included
+};
+
+// Writer
+// Writes the image of image_size bytes to fd as a .xv6z file, from offset 0
+// and truncated to its end, compressing chunks of chunk_size bytes on
+// threads threads. Fills stats->nchunks, stored and file_bytes when stats
+// is not NULL. Returns -1 with errno set if a write fails.
+int xv6z_write(int fd, const char *image, size_t image_size, uint32_t chunk_size, unsigned threads,
+               struct xv6z_stats *stats);
+
+// Reader
+// Opens the image held in the .xv6z file fd for xv6z_read(), which reads
+// and decompresses a chunk the first time a read needs it. At most
+// cache_chunks decompressed chunks are kept, the least recently read are
+// dropped and decompressed again if needed; chunks all zeros cost nothing.
+// With prefetch threads, the chunks after one being read in order are
+// decompressed ahead on them into the same cache. Reads may come from any
+// number of threads at once.
+// One image can be open at a time. Returns -1 with a message printed if fd
+// is not a valid .xv6z file, else 0 with the image size in *image_size.
+int xv6z_open(int fd, size_t *image_size, unsigned cache_chunks, unsigned prefetch);
+void xv6z_close(void);
+
+// Copy n bytes of the open image from offset off to buf; they must lie
+// inside the image. A corrupt chunk ends the process with a message.
+void xv6z_read(void *buf, size_t n, uint64_t off);
+
+// Whether the file fd starts with XV6Z_MAGIC
+int xv6z_detect(int fd);
+
+// The counters of the open image so far
+void xv6z_stats(struct xv6z_stats *stats);
+
+#endif //_XV6Z_H_